@@ -0,0 +1,84 @@
+// Times the string hash against the 32-bit FNV-1a it replaced, for the
+// table in the README. The VM's hashString() is static, so this pulls
+// in object.c to get exactly the code copyString() runs. Build it with
+// everything else but main.c and object.c:
+//
+//   SOURCES=$(ls src/*.c | grep -v -e main.c -e object.c)
+//   cc -O3 -pthread -o hash bench/hash.c $SOURCES
+//   ./hash [bytes to hash per length]
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/object.c"
+
+// The hash from the book, one byte and one multiply at a time.
+static uint32_t hashFnv(const char* key, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+typedef uint32_t (*HashFn)(const char* key, int length);
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+// Hashes the same buffer [iterations] times and returns the time per
+// hash in nanoseconds. The buffer is read through a volatile pointer so
+// the compiler can't hoist the hash out of the loop.
+static double timeHash(HashFn hash, const char* buffer, int length,
+                       long iterations) {
+  const char* volatile source = buffer;
+  uint32_t sum = 0;
+  double start = now();
+  for (long i = 0; i < iterations; i++) {
+    sum += hash(source, length);
+  }
+  double elapsed = now() - start;
+
+  // Keeps the results alive.
+  if (sum == 0x12345678) printf("!");
+  return elapsed * 1e9 / (double)iterations;
+}
+
+static void printTime(double nanoseconds) {
+  if (nanoseconds >= 1000) {
+    printf(" %9.2f us", nanoseconds / 1000);
+  } else {
+    printf(" %9.1f ns", nanoseconds);
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  // Enough bytes per length that every run takes about as long.
+  long bytes = argc > 1 ? atol(argv[1]) : 400000000L;
+  static const int lengths[] = {4, 8, 16, 32, 64, 256, 4096};
+
+  char* buffer = (char*)malloc(4096);
+  if (buffer == NULL) exit(1);
+  for (int i = 0; i < 4096; i++) buffer[i] = (char)('a' + i % 26);
+
+  printf("%-8s %12s %12s\n", "Length", "FNV-1a", "wyhash");
+  for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    int length = lengths[i];
+    long iterations = bytes / (length < 16 ? 16 : length);
+
+    printf("%-8d", length);
+    printTime(timeHash(hashFnv, buffer, length, iterations));
+    printTime(timeHash(hashString, buffer, length, iterations));
+    printf("\n");
+  }
+
+  free(buffer);
+  return 0;
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+# Builds clox with and without NaN boxing and computed gotos, runs every
+# benchmark in this directory against each build and prints the median
+# time, the instructions retired (only when `perf` is around) and the
+# peak heap size.
+#
+#   python3 bench/run.py [-n runs] [--cc compiler] [benchmark ...]
+
+import argparse
+import glob
+import os
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+SRC_DIR = os.path.join(os.path.dirname(BENCH_DIR), "src")
+
+VARIANTS = [
+  ("default", []),
+  ("no-nan-boxing", ["-DNAN_BOXING=0"]),
+  ("switch", ["-DCOMPUTED_GOTO=0"]),
+  ("plain", ["-DNAN_BOXING=0", "-DCOMPUTED_GOTO=0"]),
+]
+
+PEAK_HEAP = re.compile(r"(\d+) bytes peak heap")
+
+
+def build(cc, directory, name, flags):
+  binary = os.path.join(directory, "clox-" + name)
+  sources = sorted(glob.glob(os.path.join(SRC_DIR, "*.c")))
+  command = [cc, "-O3", "-pthread", "-o", binary] + flags + sources
+  result = subprocess.run(command, capture_output=True, text=True)
+  if result.returncode != 0:
+    sys.exit("Building {} failed:\n{}".format(name, result.stderr))
+  return binary
+
+
+def run(binary, path):
+  start = time.perf_counter()
+  result = subprocess.run([binary, "--gc-stats", path],
+                          capture_output=True, text=True)
+  elapsed = time.perf_counter() - start
+  if result.returncode != 0:
+    sys.exit("{} failed with {}:\n{}".format(
+        path, binary, result.stdout + result.stderr))
+
+  match = PEAK_HEAP.search(result.stderr)
+  peak = int(match.group(1)) if match else None
+  return elapsed, result.stdout, peak
+
+
+def instructions(binary, path):
+  if shutil.which("perf") is None: return None
+
+  result = subprocess.run(
+      ["perf", "stat", "-x", ",", "-e", "instructions:u", binary, path],
+      capture_output=True, text=True)
+  for line in result.stderr.splitlines():
+    fields = line.split(",")
+    if len(fields) > 2 and fields[2].startswith("instructions"):
+      try:
+        return int(fields[0])
+      except ValueError:
+        return None
+  return None
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__)
+  parser.add_argument("-n", "--runs", type=int, default=5,
+                      help="times to run each benchmark (default 5)")
+  parser.add_argument("--cc", default=os.environ.get("CC", "cc"),
+                      help="C compiler to build with")
+  parser.add_argument("benchmarks", nargs="*",
+                      help="benchmark names, all of them by default")
+  args = parser.parse_args()
+
+  names = args.benchmarks or sorted(
+      os.path.splitext(os.path.basename(path))[0]
+      for path in glob.glob(os.path.join(BENCH_DIR, "*.lox")))
+
+  directory = tempfile.mkdtemp(prefix="clox-bench-")
+  try:
+    binaries = [(name, build(args.cc, directory, name, flags))
+                for name, flags in VARIANTS]
+
+    print("{:<16} {:<14} {:>10} {:>8} {:>14} {:>12}".format(
+        "benchmark", "build", "median ms", "vs", "instructions",
+        "peak heap"))
+    for benchmark in names:
+      path = os.path.join(BENCH_DIR, benchmark + ".lox")
+      if not os.path.exists(path):
+        sys.exit("No benchmark named '{}'.".format(benchmark))
+
+      baseline = None
+      expected = None
+      for variant, binary in binaries:
+        times = []
+        for _ in range(args.runs):
+          elapsed, output, peak = run(binary, path)
+          times.append(elapsed)
+
+        # Every build has to agree on what the program prints.
+        if expected is None:
+          expected = output
+        elif output != expected:
+          sys.exit("{} printed something else with the {} build.".format(
+              benchmark, variant))
+
+        median = statistics.median(times)
+        if baseline is None: baseline = median
+        count = instructions(binary, path)
+        print("{:<16} {:<14} {:>10.1f} {:>7.2f}x {:>14} {:>12}".format(
+            benchmark, variant, median * 1000, median / baseline,
+            "{:,}".format(count) if count is not None else "-",
+            "{:,}".format(peak) if peak is not None else "-"))
+  finally:
+    shutil.rmtree(directory)
+
+
+if __name__ == "__main__":
+  main()
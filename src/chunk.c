@@ -2,45 +2,197 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 void initChunk(Chunk* chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
 
   initValueArray(&chunk->constants);
 }
 
-void freeChunk(Chunk* chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+void freeChunk(VM* vm, Chunk* chunk) {
+  FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(vm, LineStart, chunk->lines, chunk->lineCapacity);
+  FREE_ARRAY(vm, InlineCache, chunk->caches, chunk->cacheCapacity);
 
-  freeValueArray(&chunk->constants);
+  freeValueArray(vm, &chunk->constants);
 
   initChunk(chunk);
 }
 
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {
   if (chunk->capacity < chunk->count + 1) {
     int oldCapacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCapacity);
-    chunk->code = GROW_ARRAY(uint8_t, chunk->code,
-        oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines,
+    chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code,
         oldCapacity, chunk->capacity);
   }
 
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   chunk->count++;
+
+  // Still on the same line.
+  if (chunk->lineCount > 0 &&
+      chunk->lines[chunk->lineCount - 1].line == line) {
+    return;
+  }
+
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(vm, LineStart, chunk->lines,
+        oldCapacity, chunk->lineCapacity);
+  }
+
+  LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+  lineStart->offset = chunk->count - 1;
+  lineStart->line = line;
 }
 
-int addConstant(Chunk* chunk, Value value) {
-  push(value);
-  writeValueArray(&chunk->constants, value);
-  pop();
+// Throws away the code from [count] on.
+void truncateChunk(Chunk* chunk, int count) {
+  chunk->count = count;
+  while (chunk->lineCount > 0 &&
+         chunk->lines[chunk->lineCount - 1].offset >= count) {
+    chunk->lineCount--;
+  }
+}
+
+int getLine(Chunk* chunk, int offset) {
+  int start = 0;
+  int end = chunk->lineCount - 1;
+
+  // Find the last entry starting at or before [offset].
+  while (start < end) {
+    int mid = start + (end - start + 1) / 2;
+    if (chunk->lines[mid].offset <= offset) {
+      start = mid;
+    } else {
+      end = mid - 1;
+    }
+  }
+
+  return chunk->lineCount > 0 ? chunk->lines[start].line : 0;
+}
+
+int addConstant(VM* vm, Chunk* chunk, Value value) {
+  push(vm, value);
+  writeValueArray(vm, &chunk->constants, value);
+  pop(vm);
 
   return chunk->constants.count - 1;
 }
+
+int addInlineCache(VM* vm, Chunk* chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(vm, InlineCache, chunk->caches,
+        oldCapacity, chunk->cacheCapacity);
+  }
+
+  InlineCache* cache = &chunk->caches[chunk->cacheCount];
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    cache->entries[i].shape = NULL;
+    cache->entries[i].target = NULL;
+    cache->entries[i].method = NIL_VAL;
+    cache->entries[i].slot = -1;
+  }
+
+  return chunk->cacheCount++;
+}
+
+int instructionLength(Chunk* chunk, int offset) {
+  switch ((OpCode)chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_SET_LOCAL_POP:
+    case OP_TAIL_CALL:
+    case OP_BUILD_LIST:
+    case OP_EXTEND_LIST:
+    case OP_BUILD_MAP:
+    case OP_EXTEND_MAP:
+      return 2;
+
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_ADD_RR:
+    case OP_INCREMENT_LOCAL:
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RR:
+    case OP_DIVIDE_RK:
+    case OP_LESS_RR:
+    case OP_LESS_RK:
+    case OP_GREATER_RR:
+    case OP_GREATER_RK:
+    case OP_MOVE:
+    case OP_LOADK:
+      return 3;
+
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_STORE_ADD_RR:
+    case OP_STORE_ADD_RK:
+    case OP_STORE_SUBTRACT_RR:
+    case OP_STORE_SUBTRACT_RK:
+    case OP_STORE_MULTIPLY_RR:
+    case OP_STORE_MULTIPLY_RK:
+    case OP_STORE_DIVIDE_RR:
+    case OP_STORE_DIVIDE_RK:
+      return 4;
+
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_LESS_LOCAL_CONSTANT_JUMP:
+    case OP_GREATER_LOCAL_CONSTANT_JUMP:
+    case OP_GET_LOCAL_PROPERTY:
+    case OP_TAIL_INVOKE:
+      return 5;
+
+    case OP_CLOSURE: {
+      ObjFunction* function = AS_FUNCTION(
+          chunk->constants.values[chunk->code[offset + 1]]);
+      return 2 + function->upvalueCount * 2;
+    }
+
+    case OP_WIDE: {
+      // The operand grows by a byte, a closure's upvalue indexes too.
+      if (chunk->code[offset + 1] == OP_CLOSURE) {
+        uint16_t constant = (uint16_t)((chunk->code[offset + 2] << 8) |
+                                       chunk->code[offset + 3]);
+        ObjFunction* function =
+            AS_FUNCTION(chunk->constants.values[constant]);
+        return 4 + function->upvalueCount * 3;
+      }
+      return 2 + instructionLength(chunk, offset + 1);
+    }
+
+    default:
+      return 1;
+  }
+}
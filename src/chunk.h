@@ -10,17 +10,60 @@ typedef enum {
   #undef OPCODE
 } OpCode;
 
+enum {
+  OPCODE_COUNT = 0
+  #define OPCODE(op) + 1
+  #include "opcodes.h"
+  #undef OPCODE
+};
+
+typedef struct ObjShape ObjShape;
+
+#define INLINE_CACHE_WAYS 4
+
+// A single entry of a property inline cache. An entry matches when the
+// receiver's shape is [shape], in which case the property lives in the
+// field at [slot], or is the method [method] when [slot] is -1.
+// Stores that add a new field also record the [target] shape the
+// instance transitions to.
+typedef struct {
+  ObjShape* shape;
+  ObjShape* target;
+  Value method;
+  int slot;
+} CacheEntry;
+
+typedef struct {
+  CacheEntry entries[INLINE_CACHE_WAYS];
+} InlineCache;
+
+// The line table is run-length encoded, each entry marks the first
+// byte of code that came from a different line than the one before it.
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+
 typedef struct {
   int count;
   int capacity;
   uint8_t* code;
-  int* lines;
+  int lineCount;
+  int lineCapacity;
+  LineStart* lines;
   ValueArray constants;
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache* caches;
 } Chunk;
 
 void initChunk(Chunk* chunk);
-void freeChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
-int addConstant(Chunk* chunk, Value value);
+void freeChunk(VM* vm, Chunk* chunk);
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
+void truncateChunk(Chunk* chunk, int count);
+int getLine(Chunk* chunk, int offset);
+int addConstant(VM* vm, Chunk* chunk, Value value);
+int addInlineCache(VM* vm, Chunk* chunk);
+int instructionLength(Chunk* chunk, int offset);
 
 #endif
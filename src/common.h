@@ -5,10 +5,15 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define NAN_BOXING
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 
+// Values are doubles with everything else packed into the NaN space,
+// build with -DNAN_BOXING=0 for the tagged union instead.
+#ifndef NAN_BOXING
+  #define NAN_BOXING 1
+#endif
+
 #ifndef COMPUTED_GOTO
   #ifdef _MSC_VER
     // No computed gotos in Visual Studio.
@@ -18,10 +23,53 @@
   #endif
 #endif
 
+// Compile arithmetic on locals and constants to instructions that name
+// their operands instead of pushing them first.
+#ifndef REGISTER_OPS
+  #define REGISTER_OPS 1
+#endif
+
+// Count how often each instruction runs and how long it takes, the
+// totals are printed by --opcode-stats.
+#ifndef PROFILE_OPCODES
+  #define PROFILE_OPCODES 0
+#endif
+
+// Pack an object's type, its GC bits and the link to the next object
+// into a single word. That needs addresses to fit in 48 bits, like NaN
+// boxing does, build with -DCOMPACT_OBJECTS=0 for separate fields.
+#ifndef COMPACT_OBJECTS
+  #if UINTPTR_MAX == UINT64_MAX
+    #define COMPACT_OBJECTS 1
+  #else
+    #define COMPACT_OBJECTS 0
+  #endif
+#endif
+
+// Let full collections mark and sweep on several threads, how many is
+// set with --gc-threads.
+#ifndef PARALLEL_GC
+  #ifdef _WIN32
+    #define PARALLEL_GC 0
+  #else
+    #define PARALLEL_GC 1
+  #endif
+#endif
+
+// Compile hot functions to machine code on platforms jit.c supports.
+#ifndef JIT
+  #define JIT 1
+#endif
+
 #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
 
+// Every piece of interpreter state hangs off a VM, so any number of
+// them can run side by side, even on different threads.
+typedef struct VM VM;
+
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #endif
 // In the book, we show them defined, but for working on them locally,
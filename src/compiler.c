@@ -5,17 +5,25 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
-typedef struct {
+// Everything one compilation needs, so separate VMs can compile at the
+// same time.
+typedef struct Parser {
+  VM* vm;
+  Scanner scanner;
   Token current;
   Token previous;
   bool hadError;
   bool panicMode;
+  // The innermost function and class being compiled.
+  struct Compiler* compiler;
+  struct ClassCompiler* currentClass;
 } Parser;
 
 typedef enum {
@@ -33,7 +41,7 @@ typedef enum {
   PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 typedef struct {
   ParseFn prefix;
@@ -45,13 +53,24 @@ typedef struct {
   Token name;
   int depth;
   bool isCaptured;
+  // Set by any assignment after the declaration, including ones from
+  // closures.
+  bool isAssigned;
 } Local;
 
 typedef struct {
-  uint8_t index;
+  uint16_t index;
   bool isLocal;
 } Upvalue;
 
+// Where an OP_CLOSURE captures one of the function's locals. Once the
+// local goes out of scope the capture is patched to copy the value if
+// the local was never assigned.
+typedef struct {
+  int slot;
+  int offset;
+} CaptureSite;
+
 typedef enum {
   TYPE_FUNCTION,
   TYPE_INITIALIZER,
@@ -59,15 +78,49 @@ typedef enum {
   TYPE_SCRIPT
 } FunctionType;
 
+// An operand that hasn't been pushed yet, so it can still end up named
+// by a register instruction or folded instead. An OPERAND_LITERAL is
+// the instruction [a] that pushes nil, true or false, an OPERAND_ARITH
+// is the push form [op] of two deferred operands [a] and [b].
+typedef enum {
+  OPERAND_LOCAL,
+  OPERAND_CONSTANT,
+  OPERAND_LITERAL,
+  OPERAND_ARITH
+} OperandType;
+
+typedef struct {
+  OperandType type;
+  uint8_t op;
+  uint16_t a;
+  uint8_t b;
+  int line;
+} Operand;
+
+#define MAX_OPERANDS 8
+
 typedef struct Compiler {
   struct Compiler* enclosing;
   ObjFunction* function;
   FunctionType type;
 
-  Local locals[UINT8_COUNT];
+  Local* locals;
   int localCount;
+  int localCapacity;
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
+
+  CaptureSite* captures;
+  int captureCount;
+  int captureCapacity;
+
+  // Values the expression being compiled keeps on the stack above the
+  // locals, like the left operand or the arguments parsed so far.
+  int temporaries;
+
+  // Operands that are pushed in order before anything else is emitted.
+  Operand operands[MAX_OPERANDS];
+  int operandCount;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -75,17 +128,13 @@ typedef struct ClassCompiler {
   bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL;
-
-static Chunk* currentChunk(void) {
-  return &current->function->chunk;
+static Chunk* currentChunk(Parser* parser) {
+  return &parser->compiler->function->chunk;
 }
 
-static void errorAt(Token* token, const char* message) {
-  if (parser.panicMode) return;
-  parser.panicMode = true;
+static void errorAt(Parser* parser, Token* token, const char* message) {
+  if (parser->panicMode) return;
+  parser->panicMode = true;
   fprintf(stderr, "[line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF) {
@@ -97,126 +146,383 @@ static void errorAt(Token* token, const char* message) {
   }
 
   fprintf(stderr, ": %s\n", message);
-  parser.hadError = true;
+  parser->hadError = true;
+  parser->scanner.hadError = true;
 }
 
-static void error(const char* message) {
-  errorAt(&parser.previous, message);
+static void error(Parser* parser, const char* message) {
+  errorAt(parser, &parser->previous, message);
 }
 
-static void errorAtCurrent(const char* message) {
-  errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+  errorAt(parser, &parser->current, message);
 }
 
-static void advance(void) {
-  parser.previous = parser.current;
+static void advance(Parser* parser) {
+  parser->previous = parser->current;
 
   for (;;) {
-    parser.current = scanToken();
-    if (parser.current.type != TOKEN_ERROR) break;
+    parser->current = scanToken(&parser->scanner);
+    if (parser->current.type != TOKEN_ERROR) break;
 
-    errorAtCurrent(parser.current.start);
+    errorAtCurrent(parser, parser->current.start);
   }
 }
 
-static void consume(TokenType type, const char* message) {
-  if (parser.current.type == type) {
-    advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+  if (parser->current.type == type) {
+    advance(parser);
     return;
   }
 
-  errorAtCurrent(message);
+  errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type) {
-  return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {
+  return parser->current.type == type;
 }
 
-static bool match(TokenType type) {
-  if (!check(type)) return false;
-  advance();
+static bool match(Parser* parser, TokenType type) {
+  if (!check(parser, type)) return false;
+  advance(parser);
   return true;
 }
 
-static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk(), byte, parser.previous.line);
+// Emits the deferred operands, which have to be on the stack before
+// whatever instruction comes next.
+static void dischargeOperands(Parser* parser) {
+  Compiler* current = parser->compiler;
+  Chunk* chunk = currentChunk(parser);
+  for (int i = 0; i < current->operandCount; i++) {
+    Operand* operand = &current->operands[i];
+    int line = operand->line;
+    switch (operand->type) {
+      case OPERAND_LOCAL:
+        writeChunk(parser->vm, chunk, OP_GET_LOCAL, line);
+        writeChunk(parser->vm, chunk, (uint8_t)operand->a, line);
+        break;
+      case OPERAND_CONSTANT:
+        if (operand->a > UINT8_MAX) {
+          writeChunk(parser->vm, chunk, OP_WIDE, line);
+          writeChunk(parser->vm, chunk, OP_CONSTANT, line);
+          writeChunk(parser->vm, chunk, (operand->a >> 8) & 0xff, line);
+        } else {
+          writeChunk(parser->vm, chunk, OP_CONSTANT, line);
+        }
+        writeChunk(parser->vm, chunk, operand->a & 0xff, line);
+        break;
+      case OPERAND_LITERAL:
+        writeChunk(parser->vm, chunk, (uint8_t)operand->a, line);
+        break;
+      case OPERAND_ARITH:
+        writeChunk(parser->vm, chunk, operand->op, line);
+        writeChunk(parser->vm, chunk, (uint8_t)operand->a, line);
+        writeChunk(parser->vm, chunk, operand->b, line);
+        break;
+    }
+  }
+  current->operandCount = 0;
+}
+
+static void emitByte(Parser* parser, uint8_t byte) {
+  dischargeOperands(parser);
+  writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-  emitByte(byte1);
-  emitByte(byte2);
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+  emitByte(parser, byte1);
+  emitByte(parser, byte2);
 }
 
-static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
+static void emitShort(Parser* parser, uint16_t value) {
+  emitByte(parser, (value >> 8) & 0xff);
+  emitByte(parser, value & 0xff);
+}
 
-  int offset = currentChunk()->count - loopStart + 2;
-  if (offset > UINT16_MAX) error("Loop body too large.");
+static void emitLoop(Parser* parser, int loopStart) {
+  emitByte(parser, OP_LOOP);
 
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
+  int offset = currentChunk(parser)->count - loopStart + 2;
+  if (offset > UINT16_MAX) error(parser, "Loop body too large.");
+
+  emitByte(parser, (offset >> 8) & 0xff);
+  emitByte(parser, offset & 0xff);
 }
 
-static int emitJump(uint8_t instruction) {
-  emitByte(instruction);
-  emitByte(0xff);
-  emitByte(0xff);
-  return currentChunk()->count - 2;
+static int emitJump(Parser* parser, uint8_t instruction) {
+  emitByte(parser, instruction);
+  emitByte(parser, 0xff);
+  emitByte(parser, 0xff);
+  return currentChunk(parser)->count - 2;
 }
 
-static void emitReturn(void) {
-  if (current->type == TYPE_INITIALIZER) {
-    emitBytes(OP_GET_LOCAL, 0);
+// Emits [instruction] with a constant index or local slot operand,
+// behind a WIDE prefix if it doesn't fit in a byte.
+static void emitArg(Parser* parser, uint8_t instruction, uint16_t arg) {
+  if (arg <= UINT8_MAX) {
+    emitBytes(parser, instruction, (uint8_t)arg);
+    return;
+  }
+
+  emitByte(parser, OP_WIDE);
+  emitByte(parser, instruction);
+  emitShort(parser, arg);
+}
+
+static void emitReturn(Parser* parser) {
+  if (parser->compiler->type == TYPE_INITIALIZER) {
+    emitBytes(parser, OP_GET_LOCAL, 0);
   } else {
-    emitByte(OP_NIL);
+    emitByte(parser, OP_NIL);
   }
 
-  emitByte(OP_RETURN);
+  emitByte(parser, OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
-  int constant = addConstant(currentChunk(), value);
+static uint16_t makeConstant(Parser* parser, Value value) {
+  int constant = addConstant(parser->vm, currentChunk(parser), value);
 
-  if (constant > UINT8_MAX) {
-    error("Too many constants in one chunk.");
+  if (constant > UINT16_MAX) {
+    error(parser, "Too many constants in one chunk.");
     return 0;
   }
 
-  return (uint8_t)constant;
+  return (uint16_t)constant;
 }
 
-static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+// Holds back pushing a local that fits in a byte, a constant or a
+// literal, returning false if it has to be emitted right away.
+static bool deferOperand(Parser* parser, OperandType type, int index) {
+  Compiler* current = parser->compiler;
+  if (type == OPERAND_LOCAL && (!REGISTER_OPS || index > UINT8_MAX)) {
+    return false;
+  }
+  if (current->operandCount == MAX_OPERANDS) dischargeOperands(parser);
+
+  Operand* operand = &current->operands[current->operandCount++];
+  operand->type = type;
+  operand->a = (uint16_t)index;
+  operand->line = parser->previous.line;
+  return true;
 }
 
-static void patchJump(int offset) {
+// Gets the value of the deferred operand [distance] down from the top
+// if it's known at compile time.
+static bool operandValue(Parser* parser, int distance, Value* value) {
+  Compiler* current = parser->compiler;
+  if (current->operandCount <= distance) return false;
+
+  Operand* operand = &current->operands[current->operandCount - 1 - distance];
+  switch (operand->type) {
+    case OPERAND_CONSTANT:
+      *value = currentChunk(parser)->constants.values[operand->a];
+      return true;
+    case OPERAND_LITERAL:
+      *value = operand->a == OP_NIL
+          ? NIL_VAL : BOOL_VAL(operand->a == OP_TRUE);
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Drops the top deferred operand. Every constant operand has a constant
+// of its own, so the newest one can be taken back out of the table.
+static void dropOperand(Parser* parser) {
+  Compiler* current = parser->compiler;
+  Operand* operand = &current->operands[--current->operandCount];
+  ValueArray* constants = &currentChunk(parser)->constants;
+  if (operand->type == OPERAND_CONSTANT &&
+      operand->a == constants->count - 1) {
+    constants->count--;
+  }
+}
+
+// Pops the value of the expression just compiled if it's known at
+// compile time.
+static bool popConstant(Parser* parser, Value* value) {
+  if (!operandValue(parser, 0, value)) return false;
+  dropOperand(parser);
+  return true;
+}
+
+// Turns the two deferred operands of a binary operator into its
+// register form. The left one has to be a local for that, the right one
+// a local or a constant.
+static bool deferArith(Parser* parser, TokenType operatorType) {
+  Compiler* current = parser->compiler;
+  if (current->operandCount < 2) return false;
+
+  Operand* left = &current->operands[current->operandCount - 2];
+  Operand* right = &current->operands[current->operandCount - 1];
+  if (!REGISTER_OPS || left->type != OPERAND_LOCAL ||
+      right->type == OPERAND_LITERAL || right->type == OPERAND_ARITH ||
+      right->a > UINT8_MAX) {
+    return false;
+  }
+
+  bool constant = right->type == OPERAND_CONSTANT;
+  uint8_t op;
+  switch (operatorType) {
+    case TOKEN_PLUS:    op = constant ? OP_ADD_RK : OP_ADD_RR; break;
+    case TOKEN_MINUS:   op = constant ? OP_SUBTRACT_RK : OP_SUBTRACT_RR; break;
+    case TOKEN_STAR:    op = constant ? OP_MULTIPLY_RK : OP_MULTIPLY_RR; break;
+    case TOKEN_SLASH:   op = constant ? OP_DIVIDE_RK : OP_DIVIDE_RR; break;
+    case TOKEN_LESS:    op = constant ? OP_LESS_RK : OP_LESS_RR; break;
+    case TOKEN_GREATER: op = constant ? OP_GREATER_RK : OP_GREATER_RR; break;
+    default: return false;
+  }
+
+  left->type = OPERAND_ARITH;
+  left->op = op;
+  left->b = right->a;
+  left->line = parser->previous.line;
+  current->operandCount--;
+  return true;
+}
+
+// The form of an arithmetic instruction that writes a local instead of
+// pushing, or -1 if it has none.
+static int storeForm(uint8_t op) {
+  switch (op) {
+    case OP_ADD_RR:      return OP_STORE_ADD_RR;
+    case OP_ADD_RK:      return OP_STORE_ADD_RK;
+    case OP_SUBTRACT_RR: return OP_STORE_SUBTRACT_RR;
+    case OP_SUBTRACT_RK: return OP_STORE_SUBTRACT_RK;
+    case OP_MULTIPLY_RR: return OP_STORE_MULTIPLY_RR;
+    case OP_MULTIPLY_RK: return OP_STORE_MULTIPLY_RK;
+    case OP_DIVIDE_RR:   return OP_STORE_DIVIDE_RR;
+    case OP_DIVIDE_RK:   return OP_STORE_DIVIDE_RK;
+    default:             return -1;
+  }
+}
+
+// Writes the deferred right hand side of an assignment straight into
+// the local in [slot], which is left deferred as the assignment's value.
+static bool assignRegister(Parser* parser, int slot) {
+  Compiler* current = parser->compiler;
+  if (!REGISTER_OPS || current->operandCount == 0 || slot > UINT8_MAX) {
+    return false;
+  }
+
+  Operand value = current->operands[current->operandCount - 1];
+  int op;
+  switch (value.type) {
+    case OPERAND_LOCAL:    op = OP_MOVE; break;
+    case OPERAND_CONSTANT: op = value.a <= UINT8_MAX ? OP_LOADK : -1; break;
+    case OPERAND_LITERAL:  op = -1; break;
+    default:               op = storeForm(value.op); break;
+  }
+  if (op == -1) return false;
+
+  current->operandCount--;
+  emitBytes(parser, (uint8_t)op, (uint8_t)slot);
+  emitByte(parser, value.a);
+  if (value.type == OPERAND_ARITH) emitByte(parser, value.b);
+
+  deferOperand(parser, OPERAND_LOCAL, slot);
+  return true;
+}
+
+// Drops the value of an expression statement. A deferred local,
+// constant or literal never made it onto the stack, so there's nothing
+// to pop.
+static void popExpression(Parser* parser) {
+  Compiler* current = parser->compiler;
+  if (current->operandCount > 0 &&
+      current->operands[current->operandCount - 1].type != OPERAND_ARITH) {
+    dropOperand(parser);
+    return;
+  }
+
+  emitByte(parser, OP_POP);
+}
+
+static void emitConstant(Parser* parser, Value value) {
+  uint16_t constant = makeConstant(parser, value);
+  if (!deferOperand(parser, OPERAND_CONSTANT, constant)) {
+    emitArg(parser, OP_CONSTANT, constant);
+  }
+}
+
+static void emitCache(Parser* parser) {
+  int cache = addInlineCache(parser->vm, currentChunk(parser));
+
+  if (cache > UINT16_MAX) {
+    error(parser, "Too many property accesses in one chunk.");
+  }
+
+  emitShort(parser, (uint16_t)cache);
+}
+
+static void patchJump(Parser* parser, int offset) {
+  dischargeOperands(parser);
+
   // -2 to adjust for the bytecode for the jump offset itself.
-  int jump = currentChunk()->count - offset - 2;
+  int jump = currentChunk(parser)->count - offset - 2;
 
   if (jump > UINT16_MAX) {
-    error("Too much code to jump over.");
+    error(parser, "Too much code to jump over.");
+  }
+
+  currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+  currentChunk(parser)->code[offset + 1] = jump & 0xff;
+}
+
+// Keeps maxSlots covering the locals plus [count] more temporaries,
+// which is what the VM makes room for on each call.
+static void reserveSlots(Parser* parser, int count) {
+  parser->compiler->temporaries += count;
+  int slots = parser->compiler->localCount + parser->compiler->temporaries;
+  if (slots > parser->compiler->function->maxSlots) {
+    parser->compiler->function->maxSlots = slots;
+  }
+}
+
+static void releaseSlots(Parser* parser, int count) {
+  parser->compiler->temporaries -= count;
+}
+
+static Local* pushLocal(Parser* parser) {
+  Compiler* current = parser->compiler;
+  if (current->localCapacity < current->localCount + 1) {
+    int oldCapacity = current->localCapacity;
+    current->localCapacity = GROW_CAPACITY(oldCapacity);
+    current->locals = GROW_ARRAY(parser->vm, Local, current->locals,
+        oldCapacity, current->localCapacity);
   }
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+  Local* local = &current->locals[current->localCount++];
+  local->isCaptured = false;
+  local->isAssigned = false;
+
+  reserveSlots(parser, 0);
+  return local;
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
-  compiler->enclosing = current;
+static void initCompiler(Parser* parser, Compiler* compiler,
+                         FunctionType type) {
+  compiler->enclosing = parser->compiler;
   compiler->function = NULL;
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
   compiler->scopeDepth = 0;
-  compiler->function = newFunction();
-  current = compiler;
+  compiler->captures = NULL;
+  compiler->captureCount = 0;
+  compiler->captureCapacity = 0;
+  compiler->temporaries = 0;
+  compiler->operandCount = 0;
+  compiler->function = newFunction(parser->vm);
+  parser->compiler = compiler;
   if (type != TYPE_SCRIPT) {
-    current->function->name = copyString(parser.previous.start,
-                                         parser.previous.length);
+    compiler->function->name = copyString(parser->vm,
+        parser->previous.start, parser->previous.length);
   }
 
-  Local* local = &current->locals[current->localCount++];
+  Local* local = pushLocal(parser);
   local->depth = 0;
-  local->isCaptured = false;
   if (type != TYPE_FUNCTION) {
     local->name.start = "this";
     local->name.length = 4;
@@ -226,62 +532,259 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   }
 }
 
-static ObjFunction* endCompiler(void) {
-  emitReturn();
+static void addCaptureSite(Parser* parser, int slot) {
+  Compiler* current = parser->compiler;
+  if (current->captureCapacity < current->captureCount + 1) {
+    int oldCapacity = current->captureCapacity;
+    current->captureCapacity = GROW_CAPACITY(oldCapacity);
+    current->captures = GROW_ARRAY(parser->vm, CaptureSite,
+        current->captures, oldCapacity, current->captureCapacity);
+  }
+
+  CaptureSite* site = &current->captures[current->captureCount++];
+  site->slot = slot;
+  site->offset = currentChunk(parser)->count;
+}
+
+// Resolves the captures of locals in slots [first] and up, which are
+// going out of scope. A local that's never assigned can't be told apart
+// from a copy of it, so those captures take the value right away and
+// skip the open upvalue list entirely.
+static void resolveCaptures(Parser* parser, int first) {
+  int kept = 0;
+  for (int i = 0; i < parser->compiler->captureCount; i++) {
+    CaptureSite* site = &parser->compiler->captures[i];
+    if (site->slot < first) {
+      parser->compiler->captures[kept++] = *site;
+    } else if (!parser->compiler->locals[site->slot].isAssigned) {
+      currentChunk(parser)->code[site->offset] = 2;
+    }
+  }
+  parser->compiler->captureCount = kept;
+}
+
+static ObjFunction* endCompiler(Parser* parser) {
+  Compiler* current = parser->compiler;
+  emitReturn(parser);
   ObjFunction* function = current->function;
+  resolveCaptures(parser, 0);
+  if (!parser->hadError) optimizeChunk(currentChunk(parser));
+  FREE_ARRAY(parser->vm, Local, current->locals, current->localCapacity);
+  FREE_ARRAY(parser->vm, CaptureSite, current->captures,
+             current->captureCapacity);
+  // It was written to without barriers while it was being compiled.
+  writeBarrier(parser->vm, (Obj*)function);
 
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError) {
-    disassembleChunk(currentChunk(), function->name != NULL
-        ? function->name->chars : "<script>");
+  if (!parser->hadError) {
+    disassembleChunk(parser->vm, currentChunk(parser),
+        function->name != NULL ? function->name->chars : "<script>");
   }
 #endif
 
-  current = current->enclosing;
+  parser->compiler = parser->compiler->enclosing;
   return function;
 }
 
-static void beginScope(void) {
-  current->scopeDepth++;
+static void beginScope(Parser* parser) {
+  parser->compiler->scopeDepth++;
 }
 
-static void endScope(void) {
-  current->scopeDepth--;
+static void endScope(Parser* parser) {
+  parser->compiler->scopeDepth--;
 
-  while (current->localCount > 0 &&
-         current->locals[current->localCount - 1].depth >
-            current->scopeDepth) {
-    if (current->locals[current->localCount - 1].isCaptured) {
-      emitByte(OP_CLOSE_UPVALUE);
+  while (parser->compiler->localCount > 0 &&
+         parser->compiler->locals[parser->compiler->localCount - 1].depth >
+            parser->compiler->scopeDepth) {
+    // Locals only captured by value have nothing to close.
+    Local* local = &parser->compiler->locals[parser->compiler->localCount - 1];
+    if (local->isCaptured && local->isAssigned) {
+      emitByte(parser, OP_CLOSE_UPVALUE);
     } else {
-      emitByte(OP_POP);
+      emitByte(parser, OP_POP);
     }
-    current->localCount--;
+    parser->compiler->localCount--;
   }
+
+  resolveCaptures(parser, parser->compiler->localCount);
 }
 
-static void expression(void);
-static void statement(void);
-static void declaration(void);
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser* parser, Precedence precedence);
+
+static bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Defers [value] as the result of an expression folded at compile time.
+static void deferValue(Parser* parser, Value value) {
+  if (IS_NIL(value)) {
+    deferOperand(parser, OPERAND_LITERAL, OP_NIL);
+  } else if (IS_BOOL(value)) {
+    deferOperand(parser, OPERAND_LITERAL, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitConstant(parser, value);
+  }
+}
+
+// The operands are still in the constant table so they're rooted while
+// this allocates.
+static ObjString* joinStrings(VM* vm, ObjString* a, ObjString* b) {
+  int length = a->length + b->length;
+  char* chars = ALLOCATE(vm, char, length + 1);
+  memcpy(chars, a->chars, a->length);
+  memcpy(chars + a->length, b->chars, b->length);
+  chars[length] = '\0';
+  return takeString(vm, chars, length);
+}
+
+// Folds a binary operator whose operands are both known at compile
+// time. Anything that would be a runtime error is left to the runtime
+// to report.
+static bool foldBinary(Parser* parser, TokenType operatorType) {
+  Value a, b;
+  if (!operandValue(parser, 1, &a) || !operandValue(parser, 0, &b)) {
+    return false;
+  }
+
+  Value result;
+  if (operatorType == TOKEN_EQUAL_EQUAL ||
+      operatorType == TOKEN_BANG_EQUAL) {
+    bool equal = valuesEqual(a, b);
+    result = BOOL_VAL(operatorType == TOKEN_EQUAL_EQUAL ? equal : !equal);
+  } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    // >= and <= are the negated opposite at runtime, which differs for
+    // NaN.
+    switch (operatorType) {
+      case TOKEN_GREATER:       result = BOOL_VAL(x > y); break;
+      case TOKEN_GREATER_EQUAL: result = BOOL_VAL(!(x < y)); break;
+      case TOKEN_LESS:          result = BOOL_VAL(x < y); break;
+      case TOKEN_LESS_EQUAL:    result = BOOL_VAL(!(x > y)); break;
+      case TOKEN_PLUS:          result = NUMBER_VAL(x + y); break;
+      case TOKEN_MINUS:         result = NUMBER_VAL(x - y); break;
+      case TOKEN_STAR:          result = NUMBER_VAL(x * y); break;
+      case TOKEN_SLASH:         result = NUMBER_VAL(x / y); break;
+      default: return false; // Unreachable.
+    }
+  } else if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+    result = OBJ_VAL(joinStrings(parser->vm, AS_STRING(a), AS_STRING(b)));
+  } else {
+    return false;
+  }
+
+  dropOperand(parser);
+  dropOperand(parser);
+  deferValue(parser, result);
+  return true;
+}
+
+static bool foldUnary(Parser* parser, TokenType operatorType) {
+  Value value;
+  if (!operandValue(parser, 0, &value)) return false;
+
+  if (operatorType == TOKEN_BANG) {
+    value = BOOL_VAL(isFalsey(value));
+  } else if (IS_NUMBER(value)) {
+    value = NUMBER_VAL(-AS_NUMBER(value));
+  } else {
+    return false;
+  }
+
+  dropOperand(parser);
+  deferValue(parser, value);
+  return true;
+}
+
+// Code that can never run is still compiled to report its errors, then
+// thrown away again. The deferred operands of the code around it are
+// set aside meanwhile so they don't end up in the dead code.
+typedef struct {
+  int start;
+  Operand operands[MAX_OPERANDS];
+  int operandCount;
+} DeadCode;
+
+static void beginDeadCode(Parser* parser, DeadCode* dead) {
+  Compiler* current = parser->compiler;
+  dead->start = currentChunk(parser)->count;
+  dead->operandCount = current->operandCount;
+  memcpy(dead->operands, current->operands,
+         sizeof(Operand) * current->operandCount);
+  current->operandCount = 0;
+}
+
+static void endDeadCode(Parser* parser, DeadCode* dead) {
+  Compiler* current = parser->compiler;
+  truncateChunk(currentChunk(parser), dead->start);
+  while (current->captureCount > 0 &&
+         current->captures[current->captureCount - 1].offset >=
+            dead->start) {
+    current->captureCount--;
+  }
+
+  current->operandCount = dead->operandCount;
+  memcpy(current->operands, dead->operands,
+         sizeof(Operand) * dead->operandCount);
+}
+
+static void branchExpression(Parser* parser, bool live,
+                             Precedence precedence) {
+  if (live) {
+    parsePrecedence(parser, precedence);
+    return;
+  }
+
+  DeadCode dead;
+  beginDeadCode(parser, &dead);
+  parsePrecedence(parser, precedence);
+  endDeadCode(parser, &dead);
+}
+
+static void branchStatement(Parser* parser, bool live) {
+  if (live) {
+    statement(parser);
+    return;
+  }
+
+  DeadCode dead;
+  beginDeadCode(parser, &dead);
+  statement(parser);
+  endDeadCode(parser, &dead);
+}
 
-static uint8_t identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(copyString(name->start,
+static uint16_t identifierConstant(Parser* parser, Token* name) {
+  return makeConstant(parser, OBJ_VAL(copyString(parser->vm, name->start,
                                          name->length)));
 }
 
+static uint16_t globalVariable(Parser* parser, Token* name) {
+  VM* vm = parser->vm;
+  int slot = globalSlot(vm, copyString(vm, name->start, name->length));
+
+  if (slot > UINT16_MAX) {
+    error(parser, "Too many global variables.");
+    return 0;
+  }
+
+  return (uint16_t)slot;
+}
+
 static bool identifiersEqual(Token* a, Token* b) {
   if (a->length != b->length) return false;
   return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
   for (int i = compiler->localCount - 1; i >= 0; i--) {
     Local* local = &compiler->locals[i];
     if (identifiersEqual(name, &local->name)) {
       if (local->depth == -1) {
-        error("Can't read local variable in its own initializer.");
+        error(parser, "Can't read local variable in its own initializer.");
       }
       return i;
     }
@@ -290,7 +793,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
   return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index,
+static int addUpvalue(Parser* parser, Compiler* compiler, uint16_t index,
                       bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
 
@@ -302,7 +805,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index,
   }
 
   if (upvalueCount == UINT8_COUNT) {
-    error("Too many closure variables in function.");
+    error(parser, "Too many closure variables in function.");
     return 0;
   }
 
@@ -311,219 +814,368 @@ static int addUpvalue(Compiler* compiler, uint8_t index,
   return compiler->function->upvalueCount++;
 }
 
-static int resolveUpvalue(Compiler* compiler, Token* name) {
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name) {
   if (compiler->enclosing == NULL) return -1;
 
-  int local = resolveLocal(compiler->enclosing, name);
+  int local = resolveLocal(parser, compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    return addUpvalue(parser, compiler, (uint16_t)local, true);
   }
 
-  int upvalue = resolveUpvalue(compiler->enclosing, name);
+  int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t)upvalue, false);
+    return addUpvalue(parser, compiler, (uint16_t)upvalue, false);
   }
   
   return -1;
 }
 
-static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
-    error("Too many local variables in function.");
+static void markAssigned(Compiler* compiler, int upvalue) {
+  Upvalue* captured = &compiler->upvalues[upvalue];
+  if (captured->isLocal) {
+    compiler->enclosing->locals[captured->index].isAssigned = true;
+  } else {
+    markAssigned(compiler->enclosing, captured->index);
+  }
+}
+
+static void addLocal(Parser* parser, Token name) {
+  if (parser->compiler->localCount == UINT16_COUNT) {
+    error(parser, "Too many local variables in function.");
     return;
   }
 
-  Local* local = &current->locals[current->localCount++];
+  Local* local = pushLocal(parser);
   local->name = name;
   local->depth = -1;
-  local->isCaptured = false;
 }
 
-static void declareVariable(void) {
-  if (current->scopeDepth == 0) return;
+static void declareVariable(Parser* parser) {
+  if (parser->compiler->scopeDepth == 0) return;
 
-  Token* name = &parser.previous;
-  for (int i = current->localCount - 1; i >= 0; i--) {
-    Local* local = &current->locals[i];
-    if (local->depth != -1 && local->depth < current->scopeDepth) {
+  Token* name = &parser->previous;
+  for (int i = parser->compiler->localCount - 1; i >= 0; i--) {
+    Local* local = &parser->compiler->locals[i];
+    if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
       break;
     }
     
     if (identifiersEqual(name, &local->name)) {
-      error("Already a variable with this name in this scope.");
+      error(parser, "Already a variable with this name in this scope.");
     }
   }
 
-  addLocal(*name);
+  addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
-  consume(TOKEN_IDENTIFIER, errorMessage);
+static uint16_t parseVariable(Parser* parser, const char* errorMessage) {
+  consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-  declareVariable();
-  if (current->scopeDepth > 0) return 0;
+  declareVariable(parser);
+  if (parser->compiler->scopeDepth > 0) return 0;
 
-  return identifierConstant(&parser.previous);
+  return globalVariable(parser, &parser->previous);
 }
 
-static void markInitialized(void) {
-  if (current->scopeDepth == 0) return;
-  current->locals[current->localCount - 1].depth =
-      current->scopeDepth;
+static void markInitialized(Parser* parser) {
+  if (parser->compiler->scopeDepth == 0) return;
+  parser->compiler->locals[parser->compiler->localCount - 1].depth =
+      parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
-  if (current->scopeDepth > 0) {
-    markInitialized();
+static void defineVariable(Parser* parser, uint16_t global) {
+  if (parser->compiler->scopeDepth > 0) {
+    // The value is the new local's slot, so it has to be pushed now.
+    dischargeOperands(parser);
+    markInitialized(parser);
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitByte(parser, OP_DEFINE_GLOBAL);
+  emitShort(parser, global);
 }
 
-static uint8_t argumentList(void) {
+static uint8_t argumentList(Parser* parser) {
   uint8_t argCount = 0;
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      expression();
+      expression(parser);
+      reserveSlots(parser, 1);
       if (argCount == 255) {
-        error("Can't have more than 255 arguments.");
+        error(parser, "Can't have more than 255 arguments.");
       }
       argCount++;
-    } while (match(TOKEN_COMMA));
+    } while (match(parser, TOKEN_COMMA));
   }
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  releaseSlots(parser, argCount);
   return argCount;
 }
 
-static void and_(bool canAssign) {
-  int endJump = emitJump(OP_JUMP_IF_FALSE);
+static void and_(Parser* parser, bool canAssign) {
+  Value left;
+  if (operandValue(parser, 0, &left)) {
+    // A falsey left side is the result, otherwise the right side is.
+    bool falsey = isFalsey(left);
+    if (!falsey) dropOperand(parser);
+    branchExpression(parser, !falsey, PREC_AND);
+    return;
+  }
+
+  int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-  emitByte(OP_POP);
-  parsePrecedence(PREC_AND);
+  emitByte(parser, OP_POP);
+  parsePrecedence(parser, PREC_AND);
 
-  patchJump(endJump);
+  patchJump(parser, endJump);
 }
 
-static void binary(bool canAssign) {
-  TokenType operatorType = parser.previous.type;
+static void binary(Parser* parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
   ParseRule* rule = getRule(operatorType);
-  parsePrecedence((Precedence)(rule->precedence + 1));
+  parsePrecedence(parser, (Precedence)(rule->precedence + 1));
+  if (foldBinary(parser, operatorType)) return;
+  if (deferArith(parser, operatorType)) return;
 
   switch (operatorType) {
-    case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
-    case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-    case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-    case TOKEN_LESS:          emitByte(OP_LESS); break;
-    case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-    case TOKEN_PLUS:          emitByte(OP_ADD); break;
-    case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-    case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-    case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
+    case TOKEN_BANG_EQUAL:    emitBytes(parser, OP_EQUAL, OP_NOT); break;
+    case TOKEN_EQUAL_EQUAL:   emitByte(parser, OP_EQUAL); break;
+    case TOKEN_GREATER:       emitByte(parser, OP_GREATER); break;
+    case TOKEN_GREATER_EQUAL: emitBytes(parser, OP_LESS, OP_NOT); break;
+    case TOKEN_LESS:          emitByte(parser, OP_LESS); break;
+    case TOKEN_LESS_EQUAL:    emitBytes(parser, OP_GREATER, OP_NOT); break;
+    case TOKEN_PLUS:          emitByte(parser, OP_ADD); break;
+    case TOKEN_MINUS:         emitByte(parser, OP_SUBTRACT); break;
+    case TOKEN_STAR:          emitByte(parser, OP_MULTIPLY); break;
+    case TOKEN_SLASH:         emitByte(parser, OP_DIVIDE); break;
     default: return; // Unreachable.
   }
 }
 
-static void call(bool canAssign) {
-  uint8_t argCount = argumentList();
-  emitBytes(OP_CALL, argCount);
+static void call(Parser* parser, bool canAssign) {
+  uint8_t argCount = argumentList(parser);
+  emitBytes(parser, OP_CALL, argCount);
+}
+
+static void dot(Parser* parser, bool canAssign) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  uint16_t name = identifierConstant(parser, &parser->previous);
+
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitArg(parser, OP_SET_PROPERTY, name);
+    emitCache(parser);
+  } else if (match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(parser);
+    emitArg(parser, OP_INVOKE, name);
+    emitByte(parser, argCount);
+    emitCache(parser);
+  } else {
+    emitArg(parser, OP_GET_PROPERTY, name);
+    emitCache(parser);
+  }
 }
 
-static void dot(bool canAssign) {
-  consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifierConstant(&parser.previous);
+static void subscript(Parser* parser, bool canAssign) {
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(OP_SET_PROPERTY, name);
-  } else if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
-    emitByte(argCount);
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    reserveSlots(parser, 1);
+    expression(parser);
+    releaseSlots(parser, 1);
+    emitByte(parser, OP_SET_INDEX);
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    emitByte(parser, OP_GET_INDEX);
   }
 }
 
-static void literal(bool canAssign) {
-  switch (parser.previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_NIL: emitByte(OP_NIL); break;
-    case TOKEN_TRUE: emitByte(OP_TRUE); break;
+static void list(Parser* parser, bool canAssign) {
+  // Elements are collected on the stack, longer lists are built up in
+  // batches of at most 255.
+  bool built = false;
+  int pending = 0;
+
+  if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+    do {
+      // Allow a trailing comma.
+      if (check(parser, TOKEN_RIGHT_BRACKET)) break;
+
+      expression(parser);
+      reserveSlots(parser, 1);
+      if (++pending == UINT8_MAX) {
+        emitBytes(parser, built ? OP_EXTEND_LIST : OP_BUILD_LIST, UINT8_MAX);
+        releaseSlots(parser, UINT8_MAX);
+        built = true;
+        pending = 0;
+      }
+    } while (match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+  releaseSlots(parser, pending);
+
+  if (!built) {
+    emitBytes(parser, OP_BUILD_LIST, (uint8_t)pending);
+  } else if (pending > 0) {
+    emitBytes(parser, OP_EXTEND_LIST, (uint8_t)pending);
+  }
+}
+
+static void map(Parser* parser, bool canAssign) {
+  // Same batching as lists, counted in key/value pairs.
+  bool built = false;
+  int pending = 0;
+
+  if (!check(parser, TOKEN_RIGHT_BRACE)) {
+    do {
+      // Allow a trailing comma.
+      if (check(parser, TOKEN_RIGHT_BRACE)) break;
+
+      expression(parser);
+      reserveSlots(parser, 1);
+      consume(parser, TOKEN_COLON, "Expect ':' after map key.");
+      expression(parser);
+      reserveSlots(parser, 1);
+      if (++pending == UINT8_MAX) {
+        emitBytes(parser, built ? OP_EXTEND_MAP : OP_BUILD_MAP, UINT8_MAX);
+        releaseSlots(parser, UINT8_MAX * 2);
+        built = true;
+        pending = 0;
+      }
+    } while (match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+  releaseSlots(parser, pending * 2);
+
+  if (!built) {
+    emitBytes(parser, OP_BUILD_MAP, (uint8_t)pending);
+  } else if (pending > 0) {
+    emitBytes(parser, OP_EXTEND_MAP, (uint8_t)pending);
+  }
+}
+
+static void literal(Parser* parser, bool canAssign) {
+  switch (parser->previous.type) {
+    case TOKEN_FALSE: deferOperand(parser, OPERAND_LITERAL, OP_FALSE); break;
+    case TOKEN_NIL: deferOperand(parser, OPERAND_LITERAL, OP_NIL); break;
+    case TOKEN_TRUE: deferOperand(parser, OPERAND_LITERAL, OP_TRUE); break;
     default: return; // Unreachable.
   }
 }
 
-static void grouping(bool canAssign) {
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser* parser, bool canAssign) {
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(bool canAssign) {
-  double value = strtod(parser.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));
+static void number(Parser* parser, bool canAssign) {
+  // The source isn't terminated, and a streamed one goes on with
+  // whatever was left in the block, so strtod() needs a copy.
+  char buffer[64];
+  int length = parser->previous.length;
+  char* text = length < (int)sizeof(buffer)
+      ? buffer : (char*)malloc(length + 1);
+  if (text == NULL) exit(1);
+  memcpy(text, parser->previous.start, length);
+  text[length] = '\0';
+
+  double value = strtod(text, NULL);
+  if (text != buffer) free(text);
+  emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void conditional(bool canAssign) {
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
+static void conditional(Parser* parser, bool canAssign) {
+  Value condition;
+  if (popConstant(parser, &condition)) {
+    // Only the branch that's taken is compiled.
+    bool taken = !isFalsey(condition);
+    branchExpression(parser, taken, PREC_CONDITIONAL);
+    consume(parser, TOKEN_COLON, "Expect ':' after then branch of conditional   operator.");
+    branchExpression(parser, !taken, PREC_ASSIGNMENT);
+    return;
+  }
+
+  int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
 
   // Compile the then branch.
-  parsePrecedence(PREC_CONDITIONAL);
+  parsePrecedence(parser, PREC_CONDITIONAL);
 
-  int elseJump = emitJump(OP_JUMP);
-  patchJump(thenJump);
-  emitByte(OP_POP);
+  int elseJump = emitJump(parser, OP_JUMP);
+  patchJump(parser, thenJump);
+  emitByte(parser, OP_POP);
 
-  consume(TOKEN_COLON, "Expect ':' after then branch of conditional   operator.");
+  consume(parser, TOKEN_COLON, "Expect ':' after then branch of conditional   operator.");
 
   // Compile the else branch.
-  parsePrecedence(PREC_ASSIGNMENT);
-  patchJump(elseJump);
+  parsePrecedence(parser, PREC_ASSIGNMENT);
+  patchJump(parser, elseJump);
 }
 
-static void or_(bool canAssign) {
-  int elseJump = emitJump(OP_JUMP_IF_FALSE);
-  int endJump = emitJump(OP_JUMP);
+static void or_(Parser* parser, bool canAssign) {
+  Value left;
+  if (operandValue(parser, 0, &left)) {
+    bool falsey = isFalsey(left);
+    if (falsey) dropOperand(parser);
+    branchExpression(parser, falsey, PREC_OR);
+    return;
+  }
+
+  int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  int endJump = emitJump(parser, OP_JUMP);
 
-  patchJump(elseJump);
-  emitByte(OP_POP);
+  patchJump(parser, elseJump);
+  emitByte(parser, OP_POP);
 
-  parsePrecedence(PREC_OR);
-  patchJump(endJump);
+  parsePrecedence(parser, PREC_OR);
+  patchJump(parser, endJump);
 }
 
-static void string(bool canAssign) {
-  emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-                                  parser.previous.length - 2)));
+static void string(Parser* parser, bool canAssign) {
+  emitConstant(parser, OBJ_VAL(copyString(parser->vm,
+      parser->previous.start + 1, parser->previous.length - 2)));
 }
 
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
   uint8_t getOp, setOp;
-  int arg = resolveLocal(current, &name);
+  int arg = resolveLocal(parser, parser->compiler, &name);
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
-  } else if ((arg = resolveUpvalue(current, &name)) != -1) {
+  } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = globalVariable(parser, &name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
-  if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(setOp, (uint8_t)arg);
+
+  uint8_t op = getOp;
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    op = setOp;
+    if (op == OP_SET_LOCAL) {
+      parser->compiler->locals[arg].isAssigned = true;
+      if (assignRegister(parser, arg)) return;
+    }
+    if (op == OP_SET_UPVALUE) markAssigned(parser->compiler, arg);
+  }
+
+  if (op == OP_GET_LOCAL && deferOperand(parser, OPERAND_LOCAL, arg)) return;
+
+  // Globals are always addressed by a 16-bit slot.
+  if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL) {
+    emitByte(parser, op);
+    emitShort(parser, (uint16_t)arg);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitArg(parser, op, (uint16_t)arg);
   }
 }
 
-static void variable(bool canAssign) {
-  namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {
+  namedVariable(parser, parser->previous, canAssign);
 }
 
 static Token syntheticToken(const char* text) {
@@ -533,47 +1185,50 @@ static Token syntheticToken(const char* text) {
   return token;
 }
 
-static void super_(bool canAssign) {
-  if (currentClass == NULL) {
-    error("Can't use 'super' outside of a class.");
-  } else if (!currentClass->hasSuperclass) {
-    error("Can't use 'super' in a class with no superclass.");
+static void super_(Parser* parser, bool canAssign) {
+  if (parser->currentClass == NULL) {
+    error(parser, "Can't use 'super' outside of a class.");
+  } else if (!parser->currentClass->hasSuperclass) {
+    error(parser, "Can't use 'super' in a class with no superclass.");
   }
 
-  consume(TOKEN_DOT, "Expect '.' after 'super'.");
-  consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifierConstant(&parser.previous);
+  consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+  uint16_t name = identifierConstant(parser, &parser->previous);
   
-  namedVariable(syntheticToken("this"), false);
-  if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t argCount = argumentList();
-    namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_SUPER_INVOKE, name);
-    emitByte(argCount);
+  namedVariable(parser, syntheticToken("this"), false);
+  if (match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(parser);
+    namedVariable(parser, syntheticToken("super"), false);
+    emitArg(parser, OP_SUPER_INVOKE, name);
+    emitByte(parser, argCount);
+    emitCache(parser);
   } else {
-    namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    namedVariable(parser, syntheticToken("super"), false);
+    emitArg(parser, OP_GET_SUPER, name);
+    emitCache(parser);
   }
 }
 
-static void this_(bool canAssign) {
-  if (currentClass == NULL) {
-    error("Can't use 'this' outside of a class.");
+static void this_(Parser* parser, bool canAssign) {
+  if (parser->currentClass == NULL) {
+    error(parser, "Can't use 'this' outside of a class.");
     return;
   }
   
-  variable(false);
+  variable(parser, false);
 }
 
-static void unary(bool canAssign) {
-  TokenType operatorType = parser.previous.type;
+static void unary(Parser* parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
 
-  parsePrecedence(PREC_UNARY);
+  parsePrecedence(parser, PREC_UNARY);
+  if (foldUnary(parser, operatorType)) return;
 
   // Emit the operator instruction.
   switch (operatorType) {
-    case TOKEN_BANG: emitByte(OP_NOT); break;
-    case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+    case TOKEN_BANG: emitByte(parser, OP_NOT); break;
+    case TOKEN_MINUS: emitByte(parser, OP_NEGATE); break;
     default: return; // Unreachable.
   }
 }
@@ -581,8 +1236,10 @@ static void unary(bool canAssign) {
 ParseRule rules[] = {
   [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
   [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACE]    = {map,      NULL,   PREC_NONE},
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACKET]  = {list,     subscript, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
   [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
@@ -592,7 +1249,6 @@ ParseRule rules[] = {
   [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR},
   [TOKEN_COLON]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_QUESTION]      = {NULL,     conditional, PREC_CONDITIONAL},
-  [TOKEN_LINE]          = {NULL,     NULL,   PREC_NONE},
   [TOKEN_BANG]          = {unary,    NULL,   PREC_NONE},
   [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_EQUALITY},
   [TOKEN_EQUAL]         = {NULL,     NULL,   PREC_NONE},
@@ -624,25 +1280,29 @@ ParseRule rules[] = {
   [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
 
-static void parsePrecedence(Precedence precedence) {
-  advance();
-  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+  advance(parser);
+  ParseFn prefixRule = getRule(parser->previous.type)->prefix;
   if (prefixRule == NULL) {
-    error("Expect expression.");
+    error(parser, "Expect expression.");
     return;
   }
 
+  // The operand stays on the stack while any infix rule parses the
+  // right hand side.
+  reserveSlots(parser, 1);
   bool canAssign = precedence <= PREC_ASSIGNMENT;
-  prefixRule(canAssign);
+  prefixRule(parser, canAssign);
 
-  while (precedence <= getRule(parser.current.type)->precedence) {
-    advance();
-    ParseFn infixRule = getRule(parser.previous.type)->infix;
-    infixRule(canAssign);
+  while (precedence <= getRule(parser->current.type)->precedence) {
+    advance(parser);
+    ParseFn infixRule = getRule(parser->previous.type)->infix;
+    infixRule(parser, canAssign);
   }
+  releaseSlots(parser, 1);
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    error("Invalid assignment target.");
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    error(parser, "Invalid assignment target.");
   }
 }
 
@@ -650,242 +1310,294 @@ static ParseRule* getRule(TokenType type) {
   return &rules[type];
 }
 
-static void expression(void) {
-  parsePrecedence(PREC_ASSIGNMENT);
+static void expression(Parser* parser) {
+  parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block(void) {
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    declaration();
+static void block(Parser* parser) {
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    declaration(parser);
   }
 
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
+static void function(Parser* parser, FunctionType type) {
   Compiler compiler;
-  initCompiler(&compiler, type);
-  beginScope();
+  initCompiler(parser, &compiler, type);
+  beginScope(parser);
 
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      current->function->arity++;
-      if (current->function->arity > 255) {
-        errorAtCurrent("Can't have more than 255 parameters.");
+      parser->compiler->function->arity++;
+      if (parser->compiler->function->arity > 255) {
+        errorAtCurrent(parser, "Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
-      defineVariable(constant);
-    } while (match(TOKEN_COMMA));
+      uint16_t constant = parseVariable(parser, "Expect parameter name.");
+      defineVariable(parser, constant);
+    } while (match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block(parser);
+
+  ObjFunction* function = endCompiler(parser);
+  uint16_t constant = makeConstant(parser, OBJ_VAL(function));
+
+  // A wide closure also has 16-bit upvalue indexes.
+  bool wide = constant > UINT8_MAX;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    if (compiler.upvalues[i].index > UINT8_MAX) wide = true;
   }
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  block();
 
-  ObjFunction* function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  if (wide) emitByte(parser, OP_WIDE);
+  emitByte(parser, OP_CLOSURE);
+  if (wide) {
+    emitShort(parser, constant);
+  } else {
+    emitByte(parser, (uint8_t)constant);
+  }
 
   for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    // 0 is an upvalue of ours, 1 a local and 2 a local captured by
+    // value, which resolveCaptures() patches in later.
+    if (compiler.upvalues[i].isLocal) {
+      addCaptureSite(parser, compiler.upvalues[i].index);
+    }
+    emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+    if (wide) {
+      emitShort(parser, compiler.upvalues[i].index);
+    } else {
+      emitByte(parser, (uint8_t)compiler.upvalues[i].index);
+    }
   }
 }
 
-static void method(void) {
-  consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifierConstant(&parser.previous);
+static void method(Parser* parser) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+  uint16_t constant = identifierConstant(parser, &parser->previous);
 
   FunctionType type = TYPE_METHOD;
-  if (parser.previous.length == 4 &&
-      memcmp(parser.previous.start, "init", 4) == 0) {
+  if (parser->previous.length == 4 &&
+      memcmp(parser->previous.start, "init", 4) == 0) {
     type = TYPE_INITIALIZER;
   }
   
-  function(type);
-  emitBytes(OP_METHOD, constant);
+  function(parser, type);
+  emitArg(parser, OP_METHOD, constant);
 }
 
-static void classDeclaration(void) {
-  consume(TOKEN_IDENTIFIER, "Expect class name.");
-  Token className = parser.previous;
-  uint8_t nameConstant = identifierConstant(&parser.previous);
-  declareVariable();
+static void classDeclaration(Parser* parser) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = parser->previous;
+  uint16_t nameConstant = identifierConstant(parser, &parser->previous);
+  declareVariable(parser);
 
-  emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  emitArg(parser, OP_CLASS, nameConstant);
+  uint16_t global = parser->compiler->scopeDepth > 0
+      ? 0 : globalVariable(parser, &className);
+  defineVariable(parser, global);
 
   ClassCompiler classCompiler;
   classCompiler.hasSuperclass = false;
-  classCompiler.enclosing = currentClass;
-  currentClass = &classCompiler;
+  classCompiler.enclosing = parser->currentClass;
+  parser->currentClass = &classCompiler;
 
-  if (match(TOKEN_LESS)) {
-    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
-    variable(false);
+  if (match(parser, TOKEN_LESS)) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(parser, false);
 
-    if (identifiersEqual(&className, &parser.previous)) {
-      error("A class can't inherit from itself.");
+    if (identifiersEqual(&className, &parser->previous)) {
+      error(parser, "A class can't inherit from itself.");
     }
 
-    beginScope();
-    addLocal(syntheticToken("super"));
-    defineVariable(0);
+    beginScope(parser);
+    addLocal(parser, syntheticToken("super"));
+    defineVariable(parser, 0);
     
-    namedVariable(className, false);
-    emitByte(OP_INHERIT);
+    namedVariable(parser, className, false);
+    emitByte(parser, OP_INHERIT);
     classCompiler.hasSuperclass = true;
   }
   
-  namedVariable(className, false);
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    method();
+  namedVariable(parser, className, false);
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    method(parser);
   }
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-  emitByte(OP_POP);
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(parser, OP_POP);
 
   if (classCompiler.hasSuperclass) {
-    endScope();
+    endScope(parser);
   }
 
-  currentClass = currentClass->enclosing;
+  parser->currentClass = parser->currentClass->enclosing;
 }
 
-static void funDeclaration(void) {
-  uint8_t global = parseVariable("Expect function name.");
-  markInitialized();
-  function(TYPE_FUNCTION);
-  defineVariable(global);
+static void funDeclaration(Parser* parser) {
+  uint16_t global = parseVariable(parser, "Expect function name.");
+  markInitialized(parser);
+  function(parser, TYPE_FUNCTION);
+  defineVariable(parser, global);
 }
 
-static void varDeclaration(void) {
-  uint8_t global = parseVariable("Expect variable name.");
+static void varDeclaration(Parser* parser) {
+  uint16_t global = parseVariable(parser, "Expect variable name.");
 
-  if (match(TOKEN_EQUAL)) {
-    expression();
+  if (match(parser, TOKEN_EQUAL)) {
+    expression(parser);
   } else {
-    emitByte(OP_NIL);
+    emitByte(parser, OP_NIL);
   }
-  consume(TOKEN_SEMICOLON,
+  consume(parser, TOKEN_SEMICOLON,
           "Expect ';' after variable declaration.");
 
-  defineVariable(global);
+  defineVariable(parser, global);
 }
 
-static void expressionStatement(void) {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  emitByte(OP_POP);
+static void expressionStatement(Parser* parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+  popExpression(parser);
 }
 
-static void forStatement(void) {
-  beginScope();
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-  if (match(TOKEN_SEMICOLON)) {
+static void forStatement(Parser* parser) {
+  beginScope(parser);
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (match(parser, TOKEN_SEMICOLON)) {
     // No initializer.
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
   } else {
-    expressionStatement();
+    expressionStatement(parser);
   }
 
-  int loopStart = currentChunk()->count;
+  int loopStart = currentChunk(parser)->count;
   int exitJump = -1;
-  if (!match(TOKEN_SEMICOLON)) {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-
-    // Jump out of the loop if the condition is false.
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // Condition.
+  bool runs = true;
+  DeadCode dead;
+  if (!match(parser, TOKEN_SEMICOLON)) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+    Value condition;
+    if (popConstant(parser, &condition)) {
+      // The rest of a loop that never runs is dead.
+      runs = !isFalsey(condition);
+      if (!runs) beginDeadCode(parser, &dead);
+    } else {
+      // Jump out of the loop if the condition is false.
+      exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+      emitByte(parser, OP_POP); // Condition.
+    }
   }
 
-  if (!match(TOKEN_RIGHT_PAREN)) {
-    int bodyJump = emitJump(OP_JUMP);
-    int incrementStart = currentChunk()->count;
-    expression();
-    emitByte(OP_POP);
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+  if (!match(parser, TOKEN_RIGHT_PAREN)) {
+    int bodyJump = emitJump(parser, OP_JUMP);
+    int incrementStart = currentChunk(parser)->count;
+    expression(parser);
+    popExpression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-    emitLoop(loopStart);
+    emitLoop(parser, loopStart);
     loopStart = incrementStart;
-    patchJump(bodyJump);
+    patchJump(parser, bodyJump);
   }
 
-  statement();
-  emitLoop(loopStart);
+  statement(parser);
+  emitLoop(parser, loopStart);
 
   if (exitJump != -1) {
-    patchJump(exitJump);
-    emitByte(OP_POP); // Condition.
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP); // Condition.
   }
 
-  endScope();
+  if (!runs) endDeadCode(parser, &dead);
+  endScope(parser);
 }
 
-static void ifStatement(void) {
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void ifStatement(Parser* parser) {
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  Value condition;
+  if (popConstant(parser, &condition)) {
+    bool taken = !isFalsey(condition);
+    branchStatement(parser, taken);
+    if (match(parser, TOKEN_ELSE)) branchStatement(parser, !taken);
+    return;
+  }
 
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  statement();
+  int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  statement(parser);
 
-  int elseJump = emitJump(OP_JUMP);
+  int elseJump = emitJump(parser, OP_JUMP);
 
-  patchJump(thenJump);
-  emitByte(OP_POP);
+  patchJump(parser, thenJump);
+  emitByte(parser, OP_POP);
 
-  if (match(TOKEN_ELSE)) statement();
-  patchJump(elseJump);
+  if (match(parser, TOKEN_ELSE)) statement(parser);
+  patchJump(parser, elseJump);
 }
 
-static void printStatement(void) {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-  emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement(void) {
-  if (current->type == TYPE_SCRIPT) {
-    error("Can't return from top-level code.");
+static void returnStatement(Parser* parser) {
+  if (parser->compiler->type == TYPE_SCRIPT) {
+    error(parser, "Can't return from top-level code.");
   }
 
-  if (match(TOKEN_SEMICOLON)) {
-    emitReturn();
+  if (match(parser, TOKEN_SEMICOLON)) {
+    emitReturn(parser);
   } else {
-    if (current->type == TYPE_INITIALIZER) {
-      error("Can't return a value from an initializer.");
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+      error(parser, "Can't return a value from an initializer.");
     }
 
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-    emitByte(OP_RETURN);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+    emitByte(parser, OP_RETURN);
   }
 }
 
-static void whileStatement(void) {
-  int loopStart = currentChunk()->count;
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void whileStatement(Parser* parser) {
+  int loopStart = currentChunk(parser)->count;
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  statement();
-  emitLoop(loopStart);
+  Value condition;
+  if (popConstant(parser, &condition)) {
+    // Either the body never runs or the loop never checks.
+    bool runs = !isFalsey(condition);
+    branchStatement(parser, runs);
+    if (runs) emitLoop(parser, loopStart);
+    return;
+  }
+
+  int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  statement(parser);
+  emitLoop(parser, loopStart);
 
-  patchJump(exitJump);
-  emitByte(OP_POP);
+  patchJump(parser, exitJump);
+  emitByte(parser, OP_POP);
 }
 
-static void synchronize(void) {
-  parser.panicMode = false;
+static void synchronize(Parser* parser) {
+  parser->panicMode = false;
 
-  while (parser.current.type != TOKEN_EOF) {
-    if (parser.previous.type == TOKEN_SEMICOLON) return;
-    switch (parser.current.type) {
+  while (parser->current.type != TOKEN_EOF) {
+    if (parser->previous.type == TOKEN_SEMICOLON) return;
+    switch (parser->current.type) {
       case TOKEN_CLASS:
       case TOKEN_FUN:
       case TOKEN_VAR:
@@ -900,66 +1612,91 @@ static void synchronize(void) {
         ; // Do nothing.
     }
 
-    advance();
+    advance(parser);
   }
 }
 
-static void declaration(void) {
-  if (match(TOKEN_CLASS)) {
-    classDeclaration();
-  } else if (match(TOKEN_FUN)) {
-    funDeclaration();
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+static void declaration(Parser* parser) {
+  if (match(parser, TOKEN_CLASS)) {
+    classDeclaration(parser);
+  } else if (match(parser, TOKEN_FUN)) {
+    funDeclaration(parser);
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
   } else {
-    statement();
-  }
-
-  if (parser.panicMode) synchronize();
-}
-
-static void statement(void) {
-  if (match(TOKEN_PRINT)) {
-    printStatement();
-  } else if (match(TOKEN_FOR)) {
-    forStatement();
-  } else if (match(TOKEN_IF)) {
-    ifStatement();
-  } else if (match(TOKEN_RETURN)) {
-    returnStatement();
-  } else if (match(TOKEN_WHILE)) {
-    whileStatement();
-  } else if (match(TOKEN_LEFT_BRACE)) {
-    beginScope();
-    block();
-    endScope();
+    statement(parser);
+  }
+
+  if (parser->panicMode) synchronize(parser);
+}
+
+static void statement(Parser* parser) {
+  if (match(parser, TOKEN_PRINT)) {
+    printStatement(parser);
+  } else if (match(parser, TOKEN_FOR)) {
+    forStatement(parser);
+  } else if (match(parser, TOKEN_IF)) {
+    ifStatement(parser);
+  } else if (match(parser, TOKEN_RETURN)) {
+    returnStatement(parser);
+  } else if (match(parser, TOKEN_WHILE)) {
+    whileStatement(parser);
+  } else if (match(parser, TOKEN_LEFT_BRACE)) {
+    beginScope(parser);
+    block(parser);
+    endScope(parser);
   } else {
-    expressionStatement();
+    expressionStatement(parser);
   }
 }
 
-ObjFunction* compile(const char* source) {
-  initScanner(source);
-  Compiler compiler;
-  initCompiler(&compiler, TYPE_SCRIPT);
+// Compiles the script [parser]'s scanner has been set up to read.
+static ObjFunction* compileScript(VM* vm, Parser* parser) {
+  parser->vm = vm;
+  parser->compiler = NULL;
+  parser->currentClass = NULL;
+  parser->hadError = false;
+  parser->panicMode = false;
+  vm->parser = parser;
 
-  parser.hadError = false;
-  parser.panicMode = false;
+  Compiler compiler;
+  initCompiler(parser, &compiler, TYPE_SCRIPT);
 
-  advance();
+  advance(parser);
 
-  while (!match(TOKEN_EOF)) {
-    declaration();
+  while (!match(parser, TOKEN_EOF)) {
+    declaration(parser);
+    // Nothing before the last token is needed anymore.
+    releaseSource(&parser->scanner, parser->previous.start);
   }
 
-  ObjFunction* function = endCompiler();
-  return parser.hadError ? NULL : function;
+  ObjFunction* function = endCompiler(parser);
+  vm->parser = NULL;
+  freeScanner(&parser->scanner);
+  return parser->hadError ? NULL : function;
+}
+
+ObjFunction* compile(VM* vm, const char* source, size_t length) {
+  Parser parser;
+  initScanner(&parser.scanner, source, length);
+  return compileScript(vm, &parser);
 }
 
-void markCompilerRoots(void) {
-  Compiler* compiler = current;
+ObjFunction* compileStream(VM* vm, SourceReader reader, void* context) {
+  Parser parser;
+  initStreamScanner(&parser.scanner, reader, context);
+  return compileScript(vm, &parser);
+}
+
+void markCompilerRoots(VM* vm) {
+  if (vm->parser == NULL) return;
+
+  Compiler* compiler = vm->parser->compiler;
   while (compiler != NULL) {
-    markObject((Obj*)compiler->function);
+    // Functions being compiled are written to without barriers, so
+    // make sure a young collection always rescans them.
+    writeBarrier(vm, (Obj*)compiler->function);
+    markObject(vm, (Obj*)compiler->function);
     compiler = compiler->enclosing;
   }
 }
@@ -2,9 +2,14 @@
 #define clox_compiler_h
 
 #include "object.h"
+#include "scanner.h"
 #include "vm.h"
 
-ObjFunction* compile(const char* source);
-void markCompilerRoots(void);
+ObjFunction* compile(VM* vm, const char* source, size_t length);
+
+// Compiles a script read a block at a time from [reader], so the whole
+// source never has to be in memory at once.
+ObjFunction* compileStream(VM* vm, SourceReader reader, void* context);
+void markCompilerRoots(VM* vm);
 
 #endif
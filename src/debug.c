@@ -3,32 +3,56 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
-void disassembleChunk(Chunk* chunk, const char* name) {
+void disassembleChunk(VM* vm, Chunk* chunk, const char* name) {
   printf("== %s ==\n", name);
   
   for (int offset = 0; offset < chunk->count;) {
-    offset = disassembleInstruction(chunk, offset);
+    offset = disassembleInstruction(vm, chunk, offset);
   }
 }
 
-static int constantInstruction(const char* name, Chunk* chunk,
+static int constantInstruction(VM* vm, const char* name, Chunk* chunk,
                                int offset) {
-  uint8_t constant = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  uint8_t constant = chunk->code[offset + 1];
+  printf("%-16s %4d '", name, constant);
+  printValue(vm, chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 2;
+}
+
+static int propertyInstruction(VM* vm, const char* name, Chunk* chunk,
+                               int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+  cache |= chunk->code[offset + 3];
   printf("%-16s %4d '", name, constant);
-  printValue(chunk->constants.values[constant]);
+  printValue(vm, chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 4;
+}
+
+static int globalInstruction(VM* vm, const char* name, Chunk* chunk,
+                             int offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d '", name, slot);
+  printValue(vm, vm->globalNames.values[slot]);
   printf("'\n");
   return offset + 3;
 }
 
-static int invokeInstruction(const char* name, Chunk* chunk,
-                                int offset) {
+static int cachedInvokeInstruction(VM* vm, const char* name, Chunk* chunk,
+                                   int offset) {
   uint8_t constant = chunk->code[offset + 1];
   uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+  cache |= chunk->code[offset + 4];
   printf("%-16s (%d args) %4d '", name, argCount, constant);
-  printValue(chunk->constants.values[constant]);
-  printf("'\n");
-  return offset + 3;
+  printValue(vm, chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 5;
 }
 
 static int simpleInstruction(const char* name, int offset) {
@@ -52,19 +76,146 @@ static int jumpInstruction(const char* name, int sign,
   return offset + 3;
 }
 
-int disassembleInstruction(Chunk* chunk, int offset) {
+static int localsInstruction(const char* name, Chunk* chunk,
+                             int offset) {
+  uint8_t a = chunk->code[offset + 1];
+  uint8_t b = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, a, b);
+  return offset + 3;
+}
+
+static int localConstantInstruction(VM* vm, const char* name, Chunk* chunk,
+                                    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(vm, chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static int storeInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t dst = chunk->code[offset + 1];
+  uint8_t a = chunk->code[offset + 2];
+  uint8_t b = chunk->code[offset + 3];
+  printf("%-16s %4d %4d %4d\n", name, dst, a, b);
+  return offset + 4;
+}
+
+static int storeConstantInstruction(VM* vm, const char* name, Chunk* chunk,
+                                    int offset) {
+  uint8_t dst = chunk->code[offset + 1];
+  uint8_t slot = chunk->code[offset + 2];
+  uint8_t constant = chunk->code[offset + 3];
+  printf("%-16s %4d %4d %4d '", name, dst, slot, constant);
+  printValue(vm, chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int compareJumpInstruction(VM* vm, const char* name, Chunk* chunk,
+                                  int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+  jump |= chunk->code[offset + 4];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(vm, chunk->constants.values[constant]);
+  printf("' -> %d\n", offset + 5 + jump);
+  return offset + 5;
+}
+
+static int localPropertyInstruction(VM* vm, const char* name, Chunk* chunk,
+                                    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+  cache |= chunk->code[offset + 4];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(vm, chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 5;
+}
+
+static const char* captureKind(int isLocal) {
+  switch (isLocal) {
+    case 0: return "upvalue";
+    case 2: return "value";
+    default: return "local";
+  }
+}
+
+static const char* opcodeNames[] = {
+  #define OPCODE(op) "OP_" #op,
+  #include "opcodes.h"
+  #undef OPCODE
+};
+
+static int wideInstruction(VM* vm, Chunk* chunk, int offset) {
+  uint8_t instruction = chunk->code[offset + 1];
+  uint16_t arg = (uint16_t)(chunk->code[offset + 2] << 8);
+  arg |= chunk->code[offset + 3];
+  printf("OP_WIDE %-8s %4d", opcodeNames[instruction] + 3, arg);
+
+  switch (instruction) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+      printf("\n");
+      return offset + 4;
+
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      printf(" (%d args)", chunk->code[offset + 4]);
+      break;
+
+    default:
+      break;
+  }
+
+  printf(" '");
+  printValue(vm, chunk->constants.values[arg]);
+  printf("'");
+
+  if (instruction == OP_GET_PROPERTY || instruction == OP_SET_PROPERTY ||
+      instruction == OP_GET_SUPER || instruction == OP_INVOKE ||
+      instruction == OP_SUPER_INVOKE) {
+    bool hasArgs = instruction == OP_INVOKE ||
+                   instruction == OP_SUPER_INVOKE;
+    int cacheOffset = offset + (hasArgs ? 5 : 4);
+    uint16_t cache = (uint16_t)(chunk->code[cacheOffset] << 8);
+    cache |= chunk->code[cacheOffset + 1];
+    printf(" (cache %d)", cache);
+  }
+  printf("\n");
+
+  if (instruction == OP_CLOSURE) {
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[arg]);
+    int upvalue = offset + 4;
+    for (int j = 0; j < function->upvalueCount; j++, upvalue += 3) {
+      int isLocal = chunk->code[upvalue];
+      int index = (chunk->code[upvalue + 1] << 8) |
+                  chunk->code[upvalue + 2];
+      printf("%04d      |                     %s %d\n",
+             upvalue, captureKind(isLocal), index);
+    }
+  }
+
+  return offset + instructionLength(chunk, offset);
+}
+
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 &&
-      chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
   
   uint8_t instruction = chunk->code[offset];
   switch (instruction) {
     case OP_CONSTANT:
-      return constantInstruction("OP_CONSTANT", chunk, offset);
+      return constantInstruction(vm, "OP_CONSTANT", chunk, offset);
     case OP_NIL:
       return simpleInstruction("OP_NIL", offset);
     case OP_TRUE:
@@ -78,22 +229,21 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_SET_LOCAL:
       return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
-      return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+      return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-      return constantInstruction("OP_DEFINE_GLOBAL", chunk,
-                                 offset);
+      return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-      return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+      return globalInstruction(vm, "OP_SET_GLOBAL", chunk, offset);
     case OP_GET_UPVALUE:
       return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
       return byteInstruction("OP_SET_UPVALUE", chunk, offset);
     case OP_GET_PROPERTY:
-      return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+      return propertyInstruction(vm, "OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-      return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+      return propertyInstruction(vm, "OP_SET_PROPERTY", chunk, offset);
     case OP_GET_SUPER:
-      return constantInstruction("OP_GET_SUPER", chunk, offset);
+      return propertyInstruction(vm, "OP_GET_SUPER", chunk, offset);
     case OP_EQUAL:
       return simpleInstruction("OP_EQUAL", offset);
     case OP_GREATER:
@@ -123,14 +273,14 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
     case OP_INVOKE:
-      return invokeInstruction("OP_INVOKE", chunk, offset);
+      return cachedInvokeInstruction(vm, "OP_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE:
-      return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+      return cachedInvokeInstruction(vm, "OP_SUPER_INVOKE", chunk, offset);
     case OP_CLOSURE: {
       offset++;
       uint8_t constant = chunk->code[offset++];
       printf("%-16s %4d ", "OP_CLOSURE", constant);
-      printValue(chunk->constants.values[constant]);
+      printValue(vm, chunk->constants.values[constant]);
       printf("\n");
 
       ObjFunction* function = AS_FUNCTION(
@@ -139,7 +289,7 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         int isLocal = chunk->code[offset++];
         int index = chunk->code[offset++];
         printf("%04d      |                     %s %d\n",
-               offset - 2, isLocal ? "local" : "upvalue", index);
+               offset - 2, captureKind(isLocal), index);
       }
       
       return offset;
@@ -149,11 +299,107 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_RETURN:
       return simpleInstruction("OP_RETURN", offset);
     case OP_CLASS:
-      return constantInstruction("OP_CLASS", chunk, offset);
+      return constantInstruction(vm, "OP_CLASS", chunk, offset);
     case OP_INHERIT:
       return simpleInstruction("OP_INHERIT", offset);
     case OP_METHOD:
-      return constantInstruction("OP_METHOD", chunk, offset);
+      return constantInstruction(vm, "OP_METHOD", chunk, offset);
+    case OP_SET_LOCAL_POP:
+      return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_ADD_RR:
+      return localsInstruction("OP_ADD_RR", chunk, offset);
+    case OP_INCREMENT_LOCAL:
+      return localConstantInstruction(vm, "OP_INCREMENT_LOCAL", chunk,
+                                      offset);
+    case OP_LESS_LOCAL_CONSTANT_JUMP:
+      return compareJumpInstruction(vm, "OP_LESS_LOCAL_CONSTANT_JUMP",
+                                    chunk, offset);
+    case OP_GREATER_LOCAL_CONSTANT_JUMP:
+      return compareJumpInstruction(vm, "OP_GREATER_LOCAL_CONSTANT_JUMP",
+                                    chunk, offset);
+    case OP_JUMP_IF_FALSE_POP:
+      return jumpInstruction("OP_JUMP_IF_FALSE_POP", 1, chunk, offset);
+    case OP_GET_LOCAL_PROPERTY:
+      return localPropertyInstruction(vm, "OP_GET_LOCAL_PROPERTY", chunk,
+                                      offset);
+    case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", chunk, offset);
+    case OP_TAIL_INVOKE:
+      return cachedInvokeInstruction(vm, "OP_TAIL_INVOKE", chunk, offset);
+    case OP_ADD_NUMBER:
+      return simpleInstruction("OP_ADD_NUMBER", offset);
+    case OP_ADD_STRING:
+      return simpleInstruction("OP_ADD_STRING", offset);
+    case OP_SUBTRACT_NUMBER:
+      return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+    case OP_MULTIPLY_NUMBER:
+      return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+    case OP_DIVIDE_NUMBER:
+      return simpleInstruction("OP_DIVIDE_NUMBER", offset);
+    case OP_GREATER_NUMBER:
+      return simpleInstruction("OP_GREATER_NUMBER", offset);
+    case OP_LESS_NUMBER:
+      return simpleInstruction("OP_LESS_NUMBER", offset);
+    case OP_WIDE:
+      return wideInstruction(vm, chunk, offset);
+    case OP_BUILD_LIST:
+      return byteInstruction("OP_BUILD_LIST", chunk, offset);
+    case OP_EXTEND_LIST:
+      return byteInstruction("OP_EXTEND_LIST", chunk, offset);
+    case OP_BUILD_MAP:
+      return byteInstruction("OP_BUILD_MAP", chunk, offset);
+    case OP_EXTEND_MAP:
+      return byteInstruction("OP_EXTEND_MAP", chunk, offset);
+    case OP_GET_INDEX:
+      return simpleInstruction("OP_GET_INDEX", offset);
+    case OP_SET_INDEX:
+      return simpleInstruction("OP_SET_INDEX", offset);
+    case OP_ADD_RK:
+      return localConstantInstruction(vm, "OP_ADD_RK", chunk, offset);
+    case OP_SUBTRACT_RR:
+      return localsInstruction("OP_SUBTRACT_RR", chunk, offset);
+    case OP_SUBTRACT_RK:
+      return localConstantInstruction(vm, "OP_SUBTRACT_RK", chunk, offset);
+    case OP_MULTIPLY_RR:
+      return localsInstruction("OP_MULTIPLY_RR", chunk, offset);
+    case OP_MULTIPLY_RK:
+      return localConstantInstruction(vm, "OP_MULTIPLY_RK", chunk, offset);
+    case OP_DIVIDE_RR:
+      return localsInstruction("OP_DIVIDE_RR", chunk, offset);
+    case OP_DIVIDE_RK:
+      return localConstantInstruction(vm, "OP_DIVIDE_RK", chunk, offset);
+    case OP_LESS_RR:
+      return localsInstruction("OP_LESS_RR", chunk, offset);
+    case OP_LESS_RK:
+      return localConstantInstruction(vm, "OP_LESS_RK", chunk, offset);
+    case OP_GREATER_RR:
+      return localsInstruction("OP_GREATER_RR", chunk, offset);
+    case OP_GREATER_RK:
+      return localConstantInstruction(vm, "OP_GREATER_RK", chunk, offset);
+    case OP_STORE_ADD_RR:
+      return storeInstruction("OP_STORE_ADD_RR", chunk, offset);
+    case OP_STORE_ADD_RK:
+      return storeConstantInstruction(vm, "OP_STORE_ADD_RK", chunk,
+                                      offset);
+    case OP_STORE_SUBTRACT_RR:
+      return storeInstruction("OP_STORE_SUBTRACT_RR", chunk, offset);
+    case OP_STORE_SUBTRACT_RK:
+      return storeConstantInstruction(vm, "OP_STORE_SUBTRACT_RK", chunk,
+                                      offset);
+    case OP_STORE_MULTIPLY_RR:
+      return storeInstruction("OP_STORE_MULTIPLY_RR", chunk, offset);
+    case OP_STORE_MULTIPLY_RK:
+      return storeConstantInstruction(vm, "OP_STORE_MULTIPLY_RK", chunk,
+                                      offset);
+    case OP_STORE_DIVIDE_RR:
+      return storeInstruction("OP_STORE_DIVIDE_RR", chunk, offset);
+    case OP_STORE_DIVIDE_RK:
+      return storeConstantInstruction(vm, "OP_STORE_DIVIDE_RK", chunk,
+                                      offset);
+    case OP_MOVE:
+      return localsInstruction("OP_MOVE", chunk, offset);
+    case OP_LOADK:
+      return localConstantInstruction(vm, "OP_LOADK", chunk, offset);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
@@ -0,0 +1,775 @@
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "vm.h"
+
+// The compiled code works on NaN boxed values directly and follows the
+// System V calling convention, so that's the only place it runs.
+#if defined(__x86_64__) && NAN_BOXING && !defined(_WIN32)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Each instruction becomes a fixed template of machine code that works
+// on the same stack and locals as the interpreter. The values stay in
+// memory, but the frame's state lives in registers for as long as the
+// compiled code runs:
+//
+//   rbx  the top of the value stack
+//   r12  the frame's slots
+//   r13  the VM
+//   r14  the running closure
+//   r15  QNAN, for checking that a value is a number
+//
+// Anything a template doesn't handle, like a call, a value of the wrong
+// type or an error, stores the stack top back and returns the offset of
+// the instruction to the interpreter which then runs it itself. Since
+// both agree on the layout of the frame, the interpreter can jump back
+// into the compiled code at any instruction that has a template, after
+// a call returns or at the start of a long running loop.
+typedef enum {
+  RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+  R12 = 12, R13 = 13, R14 = 14, R15 = 15
+} Register;
+
+#define STACK_TOP RBX
+#define SLOTS R12
+#define VM_REG R13
+#define CLOSURE R14
+#define QNAN_REG R15
+
+typedef enum {
+  CC_E = 0x4,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_P = 0xa
+} Condition;
+
+// A rel32 in the code that has to point at the machine code for the
+// bytecode at [offset], or leave to the interpreter there for guards.
+typedef struct {
+  int position;
+  int offset;
+} Fixup;
+
+typedef struct {
+  uint8_t* code;
+  int count;
+  int capacity;
+
+  Fixup* jumps;
+  int jumpCount;
+  int jumpCapacity;
+
+  Fixup* guards;
+  int guardCount;
+  int guardCapacity;
+} Assembler;
+
+// Where a number operand comes from, a slot in memory or a constant.
+typedef struct {
+  bool isConstant;
+  Register base;
+  int32_t disp;
+  Value value;
+} Source;
+
+// The fewest instructions the compiled code has to get through from an
+// entry before it leaves, unless it loops.
+#define MIN_RUN 4
+
+typedef int (*NativeCode)(VM* vm, Value* slots, ObjClosure* closure,
+                          void* entry);
+
+static void* growArray(void* array, int* capacity, size_t size) {
+  *capacity = *capacity < 64 ? 64 : *capacity * 2;
+  array = realloc(array, size * *capacity);
+  if (array == NULL) exit(1);
+  return array;
+}
+
+static void emit(Assembler* as, uint8_t byte) {
+  if (as->count + 1 > as->capacity) {
+    as->code = growArray(as->code, &as->capacity, 1);
+  }
+  as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+  for (int i = 0; i < 4; i++) emit(as, (value >> (i * 8)) & 0xff);
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+  for (int i = 0; i < 8; i++) emit(as, (value >> (i * 8)) & 0xff);
+}
+
+static void addFixup(Fixup** fixups, int* count, int* capacity,
+                     int position, int offset) {
+  if (*count + 1 > *capacity) {
+    *fixups = growArray(*fixups, capacity, sizeof(Fixup));
+  }
+  (*fixups)[*count].position = position;
+  (*fixups)[*count].offset = offset;
+  (*count)++;
+}
+
+static void patchRel32(Assembler* as, int position, int target) {
+  int32_t rel = target - (position + 4);
+  memcpy(as->code + position, &rel, 4);
+}
+
+// Encoding helpers. [reg] goes in the ModRM reg field, [base] or [rm]
+// in the r/m field. Memory operands always use a 32-bit displacement.
+static void rex(Assembler* as, bool wide, int reg, int rm) {
+  uint8_t byte = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+  if (byte != 0x40) emit(as, byte);
+}
+
+static void modrmMemory(Assembler* as, int reg, int base, int32_t disp) {
+  emit(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) emit(as, 0x24);
+  emit32(as, (uint32_t)disp);
+}
+
+static void modrmRegister(Assembler* as, int reg, int rm) {
+  emit(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// mov dst, [base + disp]
+static void load(Assembler* as, Register dst, Register base, int32_t disp) {
+  rex(as, true, dst, base);
+  emit(as, 0x8b);
+  modrmMemory(as, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void store(Assembler* as, Register base, int32_t disp, Register src) {
+  rex(as, true, src, base);
+  emit(as, 0x89);
+  modrmMemory(as, src, base, disp);
+}
+
+// mov dst, imm64
+static void loadImmediate(Assembler* as, Register dst, uint64_t value) {
+  rex(as, true, 0, dst);
+  emit(as, 0xb8 + (dst & 7));
+  emit64(as, value);
+}
+
+// mov dst, src
+static void move(Assembler* as, Register dst, Register src) {
+  rex(as, true, src, dst);
+  emit(as, 0x89);
+  modrmRegister(as, src, dst);
+}
+
+// and dst, src (0x21) or cmp dst, src (0x39).
+static void arithmetic(Assembler* as, uint8_t op, Register dst,
+                       Register src) {
+  rex(as, true, src, dst);
+  emit(as, op);
+  modrmRegister(as, src, dst);
+}
+
+// add reg, imm8 (/0) or sub reg, imm8 (/5).
+static void addImmediate(Assembler* as, Register reg, int8_t value) {
+  rex(as, true, 0, reg);
+  emit(as, 0x83);
+  modrmRegister(as, value < 0 ? 5 : 0, reg);
+  emit(as, (uint8_t)(value < 0 ? -value : value));
+}
+
+// cmovcc dst, src
+static void conditionalMove(Assembler* as, Condition cc, Register dst,
+                            Register src) {
+  rex(as, true, dst, src);
+  emit(as, 0x0f);
+  emit(as, 0x40 + cc);
+  modrmRegister(as, dst, src);
+}
+
+// An SSE2 instruction on xmm[reg] and a memory operand.
+static void sseMemory(Assembler* as, uint8_t prefix, uint8_t op, int reg,
+                      Register base, int32_t disp) {
+  emit(as, prefix);
+  rex(as, false, reg, base);
+  emit(as, 0x0f);
+  emit(as, op);
+  modrmMemory(as, reg, base, disp);
+}
+
+// An SSE2 instruction on xmm[reg] and xmm[rm].
+static void sseRegister(Assembler* as, uint8_t prefix, uint8_t op, int reg,
+                        int rm) {
+  emit(as, prefix);
+  emit(as, 0x0f);
+  emit(as, op);
+  modrmRegister(as, reg, rm);
+}
+
+// movq xmm[reg], src
+static void moveToXmm(Assembler* as, int reg, Register src) {
+  emit(as, 0x66);
+  rex(as, true, reg, src);
+  emit(as, 0x0f);
+  emit(as, 0x6e);
+  modrmRegister(as, reg, src);
+}
+
+#define MOVSD 0x10
+#define MOVSD_STORE 0x11
+#define ADDSD 0x58
+#define MULSD 0x59
+#define SUBSD 0x5c
+#define DIVSD 0x5e
+#define UCOMISD 0x2e
+
+#define AND 0x21
+#define CMP 0x39
+
+// jcc rel32 to the machine code for the bytecode at [offset], or a jmp
+// if [cc] is -1.
+static void jumpTo(Assembler* as, int cc, int offset) {
+  if (cc == -1) {
+    emit(as, 0xe9);
+  } else {
+    emit(as, 0x0f);
+    emit(as, 0x80 + cc);
+  }
+  addFixup(&as->jumps, &as->jumpCount, &as->jumpCapacity, as->count,
+           offset);
+  emit32(as, 0);
+}
+
+// jcc rel32 back to the interpreter at the bytecode at [offset].
+static void guard(Assembler* as, Condition cc, int offset) {
+  emit(as, 0x0f);
+  emit(as, 0x80 + cc);
+  addFixup(&as->guards, &as->guardCount, &as->guardCapacity, as->count,
+           offset);
+  emit32(as, 0);
+}
+
+static Source stackSource(int depth) {
+  Source source = {false, STACK_TOP, -8 * depth, 0};
+  return source;
+}
+
+static Source slotSource(int slot) {
+  Source source = {false, SLOTS, 8 * slot, 0};
+  return source;
+}
+
+static Source constantSource(Value value) {
+  Source source = {true, RAX, 0, value};
+  return source;
+}
+
+static void pushRegister(Assembler* as, Register reg) {
+  store(as, STACK_TOP, 0, reg);
+  addImmediate(as, STACK_TOP, 8);
+}
+
+// Leaves to the interpreter at [offset] unless [source] is a number.
+static void guardNumber(Assembler* as, Source source, int offset) {
+  if (source.isConstant) return;
+  load(as, RAX, source.base, source.disp);
+  arithmetic(as, AND, RAX, QNAN_REG);
+  arithmetic(as, CMP, RAX, QNAN_REG);
+  guard(as, CC_E, offset);
+}
+
+static void loadNumber(Assembler* as, int xmm, Source source) {
+  if (source.isConstant) {
+    loadImmediate(as, RAX, source.value);
+    moveToXmm(as, xmm, RAX);
+  } else {
+    sseMemory(as, 0xf2, MOVSD, xmm, source.base, source.disp);
+  }
+}
+
+// Computes [a] [op] [b] into xmm0 once both are known to be numbers.
+static void numberOp(Assembler* as, uint8_t op, Source a, Source b,
+                     int offset) {
+  guardNumber(as, a, offset);
+  guardNumber(as, b, offset);
+  loadNumber(as, 0, a);
+  loadNumber(as, 1, b);
+  sseRegister(as, 0xf2, op, 0, 1);
+}
+
+// Compares [a] and [b] and returns the condition that holds when [a]
+// [op] [b] is true. Comparisons with NaN are false either way.
+static Condition compare(Assembler* as, uint8_t op, Source a, Source b,
+                         int offset) {
+  guardNumber(as, a, offset);
+  guardNumber(as, b, offset);
+  loadNumber(as, 0, a);
+  loadNumber(as, 1, b);
+  switch (op) {
+    case OP_LESS:
+      sseRegister(as, 0x66, UCOMISD, 1, 0);
+      return CC_A;
+    case OP_GREATER:
+      sseRegister(as, 0x66, UCOMISD, 0, 1);
+      return CC_A;
+    default:
+      sseRegister(as, 0x66, UCOMISD, 0, 1);
+      return CC_E;
+  }
+}
+
+// Turns the flags of a comparison made by compare() into a Lox bool in
+// rax.
+static void boolResult(Assembler* as, uint8_t op, Condition cc) {
+  loadImmediate(as, RAX, FALSE_VAL);
+  loadImmediate(as, RDX, TRUE_VAL);
+  conditionalMove(as, cc, RAX, RDX);
+  if (op == OP_EQUAL) {
+    // Unordered means one of them was NaN.
+    loadImmediate(as, RCX, FALSE_VAL);
+    conditionalMove(as, CC_P, RAX, RCX);
+  }
+}
+
+// Jumps to [target] if the value in rax is falsey.
+static void jumpIfFalsey(Assembler* as, int target) {
+  loadImmediate(as, RCX, FALSE_VAL);
+  arithmetic(as, CMP, RAX, RCX);
+  jumpTo(as, CC_E, target);
+  loadImmediate(as, RCX, NIL_VAL);
+  arithmetic(as, CMP, RAX, RCX);
+  jumpTo(as, CC_E, target);
+}
+
+static uint8_t sseOp(uint8_t op) {
+  switch (op) {
+    case OP_ADD:      return ADDSD;
+    case OP_SUBTRACT: return SUBSD;
+    case OP_MULTIPLY: return MULSD;
+    default:          return DIVSD;
+  }
+}
+
+// Binary stack instructions, their quickened variants and the register
+// forms all boil down to one of these.
+static uint8_t baseOp(uint8_t instruction) {
+  switch (instruction) {
+    case OP_ADD: case OP_ADD_NUMBER: case OP_ADD_RR: case OP_ADD_RK:
+    case OP_STORE_ADD_RR: case OP_STORE_ADD_RK:
+      return OP_ADD;
+    case OP_SUBTRACT: case OP_SUBTRACT_NUMBER: case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK: case OP_STORE_SUBTRACT_RR:
+    case OP_STORE_SUBTRACT_RK:
+      return OP_SUBTRACT;
+    case OP_MULTIPLY: case OP_MULTIPLY_NUMBER: case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK: case OP_STORE_MULTIPLY_RR:
+    case OP_STORE_MULTIPLY_RK:
+      return OP_MULTIPLY;
+    case OP_DIVIDE: case OP_DIVIDE_NUMBER: case OP_DIVIDE_RR:
+    case OP_DIVIDE_RK: case OP_STORE_DIVIDE_RR: case OP_STORE_DIVIDE_RK:
+      return OP_DIVIDE;
+    case OP_LESS: case OP_LESS_NUMBER: case OP_LESS_RR: case OP_LESS_RK:
+    case OP_LESS_LOCAL_CONSTANT_JUMP:
+      return OP_LESS;
+    case OP_GREATER: case OP_GREATER_NUMBER: case OP_GREATER_RR:
+    case OP_GREATER_RK: case OP_GREATER_LOCAL_CONSTANT_JUMP:
+      return OP_GREATER;
+    default:
+      return instruction;
+  }
+}
+
+static bool isRegisterConstant(uint8_t instruction) {
+  switch (instruction) {
+    case OP_ADD_RK: case OP_SUBTRACT_RK: case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK: case OP_LESS_RK: case OP_GREATER_RK:
+    case OP_STORE_ADD_RK: case OP_STORE_SUBTRACT_RK:
+    case OP_STORE_MULTIPLY_RK: case OP_STORE_DIVIDE_RK:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool isStoreForm(uint8_t instruction) {
+  switch (instruction) {
+    case OP_STORE_ADD_RR: case OP_STORE_ADD_RK:
+    case OP_STORE_SUBTRACT_RR: case OP_STORE_SUBTRACT_RK:
+    case OP_STORE_MULTIPLY_RR: case OP_STORE_MULTIPLY_RK:
+    case OP_STORE_DIVIDE_RR: case OP_STORE_DIVIDE_RK:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static int jumpOperand(uint8_t* code) {
+  return (code[0] << 8) | code[1];
+}
+
+// Emits the template for the instruction at [offset]. Returns false
+// without emitting anything if there is none.
+static bool translate(Assembler* as, Chunk* chunk, int offset) {
+  uint8_t* code = chunk->code + offset;
+  Value* constants = chunk->constants.values;
+  uint8_t instruction = code[0];
+
+  switch (instruction) {
+    case OP_CONSTANT:
+      loadImmediate(as, RAX, constants[code[1]]);
+      pushRegister(as, RAX);
+      return true;
+
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      loadImmediate(as, RAX, instruction == OP_NIL ? NIL_VAL
+          : instruction == OP_TRUE ? TRUE_VAL : FALSE_VAL);
+      pushRegister(as, RAX);
+      return true;
+
+    case OP_POP:
+      addImmediate(as, STACK_TOP, -8);
+      return true;
+
+    case OP_GET_LOCAL:
+      load(as, RAX, SLOTS, 8 * code[1]);
+      pushRegister(as, RAX);
+      return true;
+
+    case OP_SET_LOCAL:
+      load(as, RAX, STACK_TOP, -8);
+      store(as, SLOTS, 8 * code[1], RAX);
+      return true;
+
+    case OP_SET_LOCAL_POP:
+      addImmediate(as, STACK_TOP, -8);
+      load(as, RAX, STACK_TOP, 0);
+      store(as, SLOTS, 8 * code[1], RAX);
+      return true;
+
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL: {
+      // The array grows when globals get declared, so it's looked up
+      // every time.
+      int32_t slot = 8 * ((code[1] << 8) | code[2]);
+      load(as, RCX, VM_REG, offsetof(VM, globalValues.values));
+      load(as, RAX, RCX, slot);
+      loadImmediate(as, RDX, UNDEFINED_VAL);
+      arithmetic(as, CMP, RAX, RDX);
+      guard(as, CC_E, offset);
+      if (instruction == OP_GET_GLOBAL) {
+        pushRegister(as, RAX);
+      } else {
+        load(as, RAX, STACK_TOP, -8);
+        store(as, RCX, slot, RAX);
+      }
+      return true;
+    }
+
+    case OP_GET_UPVALUE:
+      load(as, RAX, CLOSURE, offsetof(ObjClosure, upvalues));
+      load(as, RAX, RAX, 8 * code[1]);
+      load(as, RAX, RAX, offsetof(ObjUpvalue, location));
+      load(as, RAX, RAX, 0);
+      pushRegister(as, RAX);
+      return true;
+
+    case OP_EQUAL:
+    case OP_LESS:
+    case OP_LESS_NUMBER:
+    case OP_GREATER:
+    case OP_GREATER_NUMBER: {
+      uint8_t op = baseOp(instruction);
+      Condition cc = compare(as, op, stackSource(2), stackSource(1), offset);
+      boolResult(as, op, cc);
+      store(as, STACK_TOP, -16, RAX);
+      addImmediate(as, STACK_TOP, -8);
+      return true;
+    }
+
+    case OP_ADD:
+    case OP_ADD_NUMBER:
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUMBER:
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUMBER:
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUMBER:
+      numberOp(as, sseOp(baseOp(instruction)), stackSource(2),
+               stackSource(1), offset);
+      sseMemory(as, 0xf2, MOVSD_STORE, 0, STACK_TOP, -16);
+      addImmediate(as, STACK_TOP, -8);
+      return true;
+
+    case OP_NOT:
+      load(as, RAX, STACK_TOP, -8);
+      loadImmediate(as, RDX, TRUE_VAL);
+      loadImmediate(as, RCX, FALSE_VAL);
+      move(as, RSI, RCX);
+      arithmetic(as, CMP, RAX, RCX);
+      conditionalMove(as, CC_E, RSI, RDX);
+      loadImmediate(as, RCX, NIL_VAL);
+      arithmetic(as, CMP, RAX, RCX);
+      conditionalMove(as, CC_E, RSI, RDX);
+      store(as, STACK_TOP, -8, RSI);
+      return true;
+
+    case OP_NEGATE:
+      guardNumber(as, stackSource(1), offset);
+      load(as, RAX, STACK_TOP, -8);
+      // btc rax, 63
+      emit(as, 0x48);
+      emit(as, 0x0f);
+      emit(as, 0xba);
+      emit(as, 0xf8);
+      emit(as, 63);
+      store(as, STACK_TOP, -8, RAX);
+      return true;
+
+    case OP_JUMP:
+      jumpTo(as, -1, offset + 3 + jumpOperand(code + 1));
+      return true;
+
+    case OP_LOOP:
+      jumpTo(as, -1, offset + 3 - jumpOperand(code + 1));
+      return true;
+
+    case OP_JUMP_IF_FALSE:
+      load(as, RAX, STACK_TOP, -8);
+      jumpIfFalsey(as, offset + 3 + jumpOperand(code + 1));
+      return true;
+
+    case OP_JUMP_IF_FALSE_POP:
+      addImmediate(as, STACK_TOP, -8);
+      load(as, RAX, STACK_TOP, 0);
+      jumpIfFalsey(as, offset + 3 + jumpOperand(code + 1));
+      return true;
+
+    case OP_INCREMENT_LOCAL: {
+      Source local = slotSource(code[1]);
+      numberOp(as, ADDSD, local, constantSource(constants[code[2]]),
+               offset);
+      sseMemory(as, 0xf2, MOVSD_STORE, 0, local.base, local.disp);
+      return true;
+    }
+
+    case OP_LESS_LOCAL_CONSTANT_JUMP:
+    case OP_GREATER_LOCAL_CONSTANT_JUMP: {
+      compare(as, baseOp(instruction), slotSource(code[1]),
+              constantSource(constants[code[2]]), offset);
+      // Unordered sets the carry flag, so a NaN jumps too.
+      jumpTo(as, CC_BE, offset + 5 + jumpOperand(code + 3));
+      return true;
+    }
+
+    case OP_ADD_RR: case OP_ADD_RK:
+    case OP_SUBTRACT_RR: case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RR: case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RR: case OP_DIVIDE_RK:
+    case OP_LESS_RR: case OP_LESS_RK:
+    case OP_GREATER_RR: case OP_GREATER_RK:
+    case OP_STORE_ADD_RR: case OP_STORE_ADD_RK:
+    case OP_STORE_SUBTRACT_RR: case OP_STORE_SUBTRACT_RK:
+    case OP_STORE_MULTIPLY_RR: case OP_STORE_MULTIPLY_RK:
+    case OP_STORE_DIVIDE_RR: case OP_STORE_DIVIDE_RK: {
+      bool stores = isStoreForm(instruction);
+      uint8_t* operands = code + (stores ? 2 : 1);
+      Source a = slotSource(operands[0]);
+      Source b = slotSource(operands[1]);
+      if (isRegisterConstant(instruction)) {
+        // Strings are left to the interpreter.
+        Value constant = constants[operands[1]];
+        if (!IS_NUMBER(constant)) return false;
+        b = constantSource(constant);
+      }
+
+      uint8_t op = baseOp(instruction);
+      if (op == OP_LESS || op == OP_GREATER) {
+        boolResult(as, op, compare(as, op, a, b, offset));
+        pushRegister(as, RAX);
+        return true;
+      }
+
+      numberOp(as, sseOp(op), a, b, offset);
+      if (stores) {
+        sseMemory(as, 0xf2, MOVSD_STORE, 0, SLOTS, 8 * code[1]);
+      } else {
+        sseMemory(as, 0xf2, MOVSD_STORE, 0, STACK_TOP, 0);
+        addImmediate(as, STACK_TOP, 8);
+      }
+      return true;
+    }
+
+    case OP_MOVE:
+      load(as, RAX, SLOTS, 8 * code[2]);
+      store(as, SLOTS, 8 * code[1], RAX);
+      return true;
+
+    case OP_LOADK:
+      loadImmediate(as, RAX, constants[code[2]]);
+      store(as, SLOTS, 8 * code[1], RAX);
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+// mov eax, [offset]; jmp [exitCode]
+static void leave(Assembler* as, int offset, int exitCode) {
+  emit(as, 0xb8);
+  emit32(as, (uint32_t)offset);
+  emit(as, 0xe9);
+  emit32(as, 0);
+  patchRel32(as, as->count - 4, exitCode);
+}
+
+bool compileJit(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  Assembler as;
+  memset(&as, 0, sizeof(as));
+
+  uint32_t* entries = (uint32_t*)calloc(chunk->count, sizeof(uint32_t));
+  int* labels = (int*)malloc(sizeof(int) * (chunk->count + 1));
+  int* starts = (int*)malloc(sizeof(int) * (chunk->count + 1));
+  if (entries == NULL || labels == NULL || starts == NULL) exit(1);
+
+  // int code(VM* vm, Value* slots, ObjClosure* closure, void* entry)
+  emit(&as, 0x55);                             // push rbp
+  emit(&as, 0x53);                             // push rbx
+  emit(&as, 0x41); emit(&as, 0x54);            // push r12
+  emit(&as, 0x41); emit(&as, 0x55);            // push r13
+  emit(&as, 0x41); emit(&as, 0x56);            // push r14
+  emit(&as, 0x41); emit(&as, 0x57);            // push r15
+  addImmediate(&as, RSP, -8);                  // Keep rsp aligned.
+  move(&as, VM_REG, RDI);
+  move(&as, SLOTS, RSI);
+  move(&as, CLOSURE, RDX);
+  load(&as, STACK_TOP, VM_REG, offsetof(VM, stackTop));
+  loadImmediate(&as, QNAN_REG, QNAN);
+  emit(&as, 0xff); emit(&as, 0xe1);            // jmp rcx
+
+  // The exit comes first so that every leave() can jump back to it.
+  int exitCode = as.count;
+  store(&as, VM_REG, offsetof(VM, stackTop), STACK_TOP);
+  addImmediate(&as, RSP, 8);
+  emit(&as, 0x41); emit(&as, 0x5f);            // pop r15
+  emit(&as, 0x41); emit(&as, 0x5e);            // pop r14
+  emit(&as, 0x41); emit(&as, 0x5d);            // pop r13
+  emit(&as, 0x41); emit(&as, 0x5c);            // pop r12
+  emit(&as, 0x5b);                             // pop rbx
+  emit(&as, 0x5d);                             // pop rbp
+  emit(&as, 0xc3);                             // ret
+
+  int instructionCount = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    starts[instructionCount++] = offset;
+    labels[offset] = as.count;
+    if (translate(&as, chunk, offset)) {
+      entries[offset] = (uint32_t)labels[offset];
+    } else {
+      leave(&as, offset, exitCode);
+    }
+  }
+
+  // Going in and out of the machine code costs about as much as running
+  // a few instructions, so it's only entered where it gets to run for a
+  // while before leaving again.
+  int run = 0;
+  bool loops = false;
+  for (int i = instructionCount - 1; i >= 0; i--) {
+    int offset = starts[i];
+    if (entries[offset] == 0) {
+      run = 0;
+      loops = false;
+      continue;
+    }
+
+    run++;
+    if (chunk->code[offset] == OP_LOOP) loops = true;
+    if (run < MIN_RUN && !loops) entries[offset] = 0;
+  }
+
+  for (int i = 0; i < as.jumpCount; i++) {
+    patchRel32(&as, as.jumps[i].position, labels[as.jumps[i].offset]);
+  }
+
+  // Every failed guard leaves at the start of its own instruction.
+  int stub = -1;
+  for (int i = 0; i < as.guardCount; i++) {
+    if (i == 0 || as.guards[i].offset != as.guards[i - 1].offset) {
+      stub = as.count;
+      leave(&as, as.guards[i].offset, exitCode);
+    }
+    patchRel32(&as, as.guards[i].position, stub);
+  }
+
+  long pageSize = sysconf(_SC_PAGESIZE);
+  size_t size = ((size_t)as.count + pageSize - 1) & ~(size_t)(pageSize - 1);
+  void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  bool compiled = memory != MAP_FAILED;
+  if (compiled) {
+    memcpy(memory, as.code, as.count);
+    compiled = mprotect(memory, size, PROT_READ | PROT_EXEC) == 0;
+    if (!compiled) munmap(memory, size);
+  }
+
+  free(as.code);
+  free(as.jumps);
+  free(as.guards);
+  free(labels);
+  free(starts);
+
+  if (!compiled) {
+    free(entries);
+    function->hotness = INT_MIN;
+    return false;
+  }
+
+  Jit* jit = (Jit*)malloc(sizeof(Jit));
+  if (jit == NULL) exit(1);
+  jit->code = (uint8_t*)memory;
+  jit->size = size;
+  jit->entries = entries;
+  function->jit = jit;
+  return true;
+}
+
+int runJit(VM* vm, ObjClosure* closure, Value* slots, int offset) {
+  Jit* jit = closure->function->jit;
+  uint32_t entry = jit->entries[offset];
+  if (entry == 0) return -1;
+
+  NativeCode code = (NativeCode)(void*)jit->code;
+  return code(vm, slots, closure, jit->code + entry);
+}
+
+void freeJit(Jit* jit) {
+  if (jit == NULL) return;
+  munmap(jit->code, jit->size);
+  free(jit->entries);
+  free(jit);
+}
+
+#else
+
+bool compileJit(ObjFunction* function) {
+  function->hotness = INT_MIN;
+  return false;
+}
+
+int runJit(VM* vm, ObjClosure* closure, Value* slots, int offset) {
+  return -1;
+}
+
+void freeJit(Jit* jit) {
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "object.h"
+
+// How many calls plus loop iterations it takes before a function gets
+// compiled to machine code.
+#define JIT_THRESHOLD 1000
+
+typedef struct Jit {
+  uint8_t* code;
+  size_t size;
+  // Where the machine code for the instruction at each bytecode offset
+  // starts, or 0 if that instruction only goes back to the interpreter.
+  uint32_t* entries;
+} Jit;
+
+// Compiles [function] to machine code. Returns false if that isn't
+// supported here, in which case it won't be tried again.
+bool compileJit(ObjFunction* function);
+
+// Runs [closure] as machine code from the bytecode at [offset] until it
+// reaches an instruction the compiled code leaves to the interpreter.
+// Returns the offset to carry on at, or -1 if it couldn't start there.
+int runJit(VM* vm, ObjClosure* closure, Value* slots, int offset);
+
+void freeJit(Jit* jit);
+
+#endif
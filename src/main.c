@@ -1,76 +1,341 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "common.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
+#include "profiler.h"
+#include "serialize.h"
 #include "vm.h"
 
-static void repl(void) {
-  char line[1024];
-  for (;;) {
-    printf("> ");
+static bool useBytecodeCache = false;
 
-    if (!fgets(line, sizeof(line), stdin)) {
-      printf("\n");
-      break;
-    }
+// What the REPL has read of the statement it's reading.
+typedef struct {
+  // Whether a line has been read yet or the last read stopped in the
+  // middle of one.
+  bool started;
+  bool midLine;
+  // Set once stdin is closed.
+  bool done;
+} ReplInput;
+
+// Reads lines until they add up to whole statements, however long the
+// lines are or however many of them it takes.
+static size_t readLine(void* context, char* buffer, size_t size,
+                       bool complete) {
+  ReplInput* input = (ReplInput*)context;
+  if (input->done) return 0;
+  if (complete && input->started && !input->midLine) return 0;
+
+  if (!input->midLine) {
+    printf(input->started ? "... " : "> ");
+    fflush(stdout);
+  }
+
+  if (size > INT_MAX) size = INT_MAX;
+  if (!fgets(buffer, (int)size, stdin)) {
+    printf("\n");
+    input->done = true;
+    return 0;
+  }
 
-    interpret(line);
+  size_t length = strlen(buffer);
+  input->started = true;
+  input->midLine = length > 0 && buffer[length - 1] != '\n';
+  return length;
+}
+
+static void repl(VM* vm) {
+  ReplInput input;
+  input.done = false;
+  while (!input.done) {
+    input.started = false;
+    input.midLine = false;
+
+    ObjFunction* function = compileStream(vm, readLine, &input);
+    if (function != NULL) interpretFunction(vm, function);
   }
 }
 
-static char* readFile(const char* path) {
-  FILE* file = fopen(path, "rb");
-  if (file == NULL) {
+// A script, mapped into memory when it's a regular file and read a
+// block at a time from [stream] when it's a pipe or stdin.
+typedef struct {
+  const char* path;
+  const char* source;
+  size_t length;
+  bool mapped;
+  FILE* stream;
+} SourceFile;
+
+static void openSource(SourceFile* file, const char* path) {
+  file->path = path;
+  file->source = NULL;
+  file->length = 0;
+  file->mapped = false;
+  file->stream = NULL;
+
+  if (strcmp(path, "-") == 0) {
+    file->stream = stdin;
+    return;
+  }
+
+#ifndef _WIN32
+  int descriptor = open(path, O_RDONLY);
+  if (descriptor < 0) {
     fprintf(stderr, "Could not open file \"%s\".\n", path);
     exit(74);
   }
 
-  fseek(file, 0L, SEEK_END);
-  size_t fileSize = ftell(file);
-  rewind(file);
+  struct stat info;
+  if (fstat(descriptor, &info) == 0 && S_ISREG(info.st_mode)) {
+    file->length = (size_t)info.st_size;
+    if (file->length == 0) {
+      // There's nothing to map.
+      file->source = "";
+      close(descriptor);
+      return;
+    }
+
+    void* mapping = mmap(NULL, file->length, PROT_READ, MAP_PRIVATE,
+                         descriptor, 0);
+    if (mapping != MAP_FAILED) {
+      posix_madvise(mapping, file->length, POSIX_MADV_SEQUENTIAL);
+      file->source = (const char*)mapping;
+      file->mapped = true;
+      close(descriptor);
+      return;
+    }
+  }
 
-  char* buffer = (char*)malloc(fileSize + 1);
-  if (buffer == NULL) {
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+  file->stream = fdopen(descriptor, "rb");
+#else
+  file->stream = fopen(path, "rb");
+#endif
+  if (file->stream == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
     exit(74);
   }
-  
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
+}
+
+static void closeSource(SourceFile* file) {
+#ifndef _WIN32
+  if (file->mapped) munmap((void*)file->source, file->length);
+#endif
+  if (file->stream != NULL && file->stream != stdin) fclose(file->stream);
+}
+
+static size_t readStream(void* context, char* buffer, size_t size,
+                         bool complete) {
+  (void)complete;
+  SourceFile* file = (SourceFile*)context;
+  size_t bytesRead = fread(buffer, sizeof(char), size, file->stream);
+  if (bytesRead == 0 && ferror(file->stream)) {
+    fprintf(stderr, "Could not read file \"%s\".\n", file->path);
     exit(74);
   }
-  
-  buffer[bytesRead] = '\0';
+  return bytesRead;
+}
+
+// Loads [source] from the compiled "foo.loxc" next to "foo.lox" if it
+// was compiled from the same source, otherwise compiles it and writes
+// the cache for next time.
+static ObjFunction* compileCached(VM* vm, const char* path,
+                                  const char* source, size_t sourceLength) {
+  size_t length = strlen(path);
+  bool isLox = length > 4 && strcmp(path + length - 4, ".lox") == 0;
+  char* cachePath = (char*)malloc(length + 6);
+  if (cachePath == NULL) exit(1);
+  sprintf(cachePath, isLox ? "%sc" : "%s.loxc", path);
 
-  fclose(file);
-  return buffer;
+  uint64_t hash = hashSource(source, sourceLength);
+  ObjFunction* function = readBytecode(vm, cachePath, hash);
+  if (function == NULL) {
+    function = compile(vm, source, sourceLength);
+    if (function != NULL) writeBytecode(vm, cachePath, function, hash);
+  }
+  free(cachePath);
+  return function;
+}
+
+static InterpretResult runFile(VM* vm, const char* path) {
+  SourceFile file;
+  openSource(&file, path);
+
+  // Only a whole source can be hashed, so streamed ones aren't cached.
+  ObjFunction* function;
+  if (file.stream != NULL) {
+    function = compileStream(vm, readStream, &file);
+  } else if (useBytecodeCache) {
+    function = compileCached(vm, path, file.source, file.length);
+  } else {
+    function = compile(vm, file.source, file.length);
+  }
+  closeSource(&file);
+
+  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+  return interpretFunction(vm, function);
 }
 
-static void runFile(const char* path) {
-  char* source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source);
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: clox [options] [path, or - for stdin]\n"
+          "  --incremental-gc[=budget]\n"
+          "  --gc-initial-heap=bytes  (or CLOX_GC_INITIAL_HEAP)\n"
+          "  --gc-growth=factor       (or CLOX_GC_GROWTH)\n"
+          "  --gc-max-heap=bytes      (or CLOX_GC_MAX_HEAP)\n"
+          "  --gc-target=fraction     (or CLOX_GC_TARGET)\n"
+          "  --gc-threads=count       (or CLOX_GC_THREADS)\n"
+          "  --cache\n"
+          "  --profile=output\n"
+          "  --gc-stats\n"
+          "  --opcode-stats\n");
+  exit(64);
+}
+
+// Parses a number of bytes with an optional k, m or g suffix.
+static bool parseSize(const char* text, size_t* size) {
+  char* end;
+  double value = strtod(text, &end);
+  if (end == text) return false;
+  switch (*end) {
+    case 'k': case 'K': value *= 1024; end++; break;
+    case 'm': case 'M': value *= 1024 * 1024; end++; break;
+    case 'g': case 'G': value *= 1024 * 1024 * 1024; end++; break;
+  }
 
-  if (result == INTERPRET_COMPILE_ERROR) exit(65);
-  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+  if (*end != '\0' || value < 0) return false;
+  *size = (size_t)value;
+  return true;
+}
+
+static bool parseNumber(const char* text, double* number) {
+  char* end;
+  *number = strtod(text, &end);
+  return end != text && *end == '\0';
+}
+
+// Sets the heap sizing option [name], returns false if [value] isn't
+// valid for it or there's no such option.
+static bool setGCOption(VM* vm, const char* name, const char* value) {
+  if (strcmp(name, "initial-heap") == 0) {
+    return parseSize(value, &vm->gcInitialHeap) && vm->gcInitialHeap > 0;
+  } else if (strcmp(name, "growth") == 0) {
+    return parseNumber(value, &vm->gcGrowFactor) && vm->gcGrowFactor > 1;
+  } else if (strcmp(name, "max-heap") == 0) {
+    return parseSize(value, &vm->gcMaxHeap);
+  } else if (strcmp(name, "threads") == 0) {
+    double threads;
+    if (!parseNumber(value, &threads) || threads < 1 ||
+        threads > GC_MAX_THREADS || threads != (int)threads) {
+      return false;
+    }
+#if !PARALLEL_GC
+    if (threads > 1) return false;
+#endif
+    vm->gcThreads = (int)threads;
+    return true;
+  } else if (strcmp(name, "target") == 0) {
+    return parseNumber(value, &vm->gcTarget) &&
+           vm->gcTarget >= 0 && vm->gcTarget < 1;
+  }
+
+  return false;
+}
+
+// Picks up heap options from the environment, the command line can
+// still override them.
+static void readGCEnvironment(VM* vm) {
+  static const char* options[][2] = {
+    {"initial-heap", "CLOX_GC_INITIAL_HEAP"},
+    {"growth", "CLOX_GC_GROWTH"},
+    {"max-heap", "CLOX_GC_MAX_HEAP"},
+    {"target", "CLOX_GC_TARGET"},
+    {"threads", "CLOX_GC_THREADS"},
+  };
+
+  for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+    const char* value = getenv(options[i][1]);
+    if (value != NULL && !setGCOption(vm, options[i][0], value)) {
+      fprintf(stderr, "Invalid value \"%s\" for %s.\n",
+              value, options[i][1]);
+      exit(64);
+    }
+  }
 }
 
 int main(int argc, const char* argv[]) {
-  initVM();
+  VM vm;
+  initVM(&vm);
+  readGCEnvironment(&vm);
+
+  const char* path = NULL;
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--incremental-gc", 16) == 0) {
+      vm.gcIncremental = true;
+      if (arg[16] == '=') {
+        vm.gcSliceBudget = atoi(arg + 17);
+        if (vm.gcSliceBudget <= 0) usage();
+      } else if (arg[16] != '\0') {
+        usage();
+      }
+    } else if (strncmp(arg, "--gc-", 5) == 0 && strchr(arg, '=') != NULL) {
+      const char* equals = strchr(arg, '=');
+      char name[32];
+      size_t length = (size_t)(equals - arg - 5);
+      if (length >= sizeof(name)) usage();
+      memcpy(name, arg + 5, length);
+      name[length] = '\0';
+      if (!setGCOption(&vm, name, equals + 1)) usage();
+    } else if (strcmp(arg, "--cache") == 0) {
+      useBytecodeCache = true;
+    } else if (strncmp(arg, "--profile=", 10) == 0) {
+      if (arg[10] == '\0' || !startProfiler(&vm, arg + 10)) usage();
+    } else if (strcmp(arg, "--gc-stats") == 0) {
+      vm.reportGCStats = true;
+    } else if (strcmp(arg, "--opcode-stats") == 0) {
+#if PROFILE_OPCODES
+      vm.reportOpcodeStats = true;
+#else
+      fprintf(stderr, "Build with -DPROFILE_OPCODES=1 for opcode stats.\n");
+      exit(64);
+#endif
+    } else if (path == NULL && (arg[0] != '-' || arg[1] == '\0')) {
+      path = arg;
+    } else {
+      usage();
+    }
+  }
+
+  // The first collection happens once the heap reaches the initial
+  // size, or the limit if that's smaller.
+  vm.nextGC = vm.gcInitialHeap;
+  if (vm.gcMaxHeap != 0 && vm.nextGC > vm.gcMaxHeap) {
+    vm.nextGC = vm.gcMaxHeap;
+  }
 
-  if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+  InterpretResult result = INTERPRET_OK;
+  if (path == NULL) {
+    repl(&vm);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    result = runFile(&vm, path);
   }
   
-  freeVM();
+  // Freeing the VM also writes out the profile.
+  freeVM(&vm);
+  if (result == INTERPRET_COMPILE_ERROR) return 65;
+  if (result == INTERPRET_RUNTIME_ERROR) return 70;
   return 0;
 }
@@ -1,113 +1,481 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
+#include "parallel.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+// The adaptive policy never lets the heap grow past this many times
+// what survived the last collection.
+#define GC_MAX_GROWTH 4
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-  vm.bytesAllocated += newSize - oldSize;
-  if (newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
-    collectGarbage();
+// Roughly how many surviving objects a parallel sweep gives each thread
+// at a time.
+#define SWEEP_SEGMENT_SIZE 4096
+#define GC_NURSERY_SIZE (256 * 1024)
+#define GC_SLICE_STEP (64 * 1024)
+
+static void collectYoung(VM* vm);
+static void beginCycle(VM* vm);
+static void finishCycle(VM* vm);
+static void collectSlice(VM* vm);
+
+double gcClock(void) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return (double)now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Picks the heap size the next major collection starts at. The heap
+// grows by [gcGrowFactor] over what survived, and if a GC time target
+// is set, far enough that the mutator gets to run long enough to keep
+// collecting below that fraction of the time since the last one.
+static void resizeHeap(VM* vm, double now) {
+  GCStats* stats = &vm->gcStats;
+  GCStats* last = &vm->gcLastStats;
+  double live = (double)vm->bytesAllocated;
+  double next = live * vm->gcGrowFactor;
+
+  // Young collections cost the same however big the heap is, only the
+  // time spent in major ones counts.
+  double paused = (stats->totalPause - stats->minorPause) -
+                  (last->totalPause - last->minorPause);
+  double mutator = now - vm->gcLastCycle -
+                   (stats->totalPause - last->totalPause);
+  if (vm->gcTarget > 0 && paused > 0 && mutator > 0) {
+    double rate = (stats->totalAllocated - last->totalAllocated) / mutator;
+    double headroom = rate * paused * (1 - vm->gcTarget) / vm->gcTarget;
+    if (live + headroom > next) next = live + headroom;
+    if (next > live * GC_MAX_GROWTH) next = live * GC_MAX_GROWTH;
+  }
+
+  if (next < vm->gcInitialHeap) next = (double)vm->gcInitialHeap;
+  if (vm->gcMaxHeap != 0 && next > vm->gcMaxHeap) {
+    next = (double)vm->gcMaxHeap;
+  }
+  vm->nextGC = (size_t)next;
+
+  vm->gcLastCycle = now;
+  *last = *stats;
+
+#ifdef DEBUG_LOG_GC
+  printf("   next gc at %zu\n", vm->nextGC);
 #endif
+}
 
-    if (vm.bytesAllocated > vm.nextGC) {
-      collectGarbage();
-    }
+// A collection being timed for the stats.
+typedef struct {
+  double start;
+  size_t before;
+  int minorCollections;
+  int majorCollections;
+} Pause;
+
+static Pause beginPause(VM* vm) {
+  Pause pause;
+  pause.start = gcClock();
+  pause.before = vm->bytesAllocated;
+  pause.minorCollections = vm->gcStats.minorCollections;
+  pause.majorCollections = vm->gcStats.majorCollections;
+  return pause;
+}
+
+static void endPause(VM* vm, Pause* pause) {
+  double now = gcClock();
+  double seconds = now - pause->start;
+
+  GCStats* stats = &vm->gcStats;
+  stats->totalPause += seconds;
+  if (seconds > stats->maxPause) stats->maxPause = seconds;
+  if (stats->minorCollections != pause->minorCollections) {
+    stats->minorPause += seconds;
   }
+  if (pause->before > vm->bytesAllocated) {
+    stats->bytesFreed += pause->before - vm->bytesAllocated;
+  }
+
+  // Once a major collection is done we know how much survived it.
+  if (stats->majorCollections != pause->majorCollections) {
+    resizeHeap(vm, now);
+  }
+}
+
+#if PARALLEL_GC
+// Sweeping threads free into one of these, which is added to the VM
+// once the sweep is done.
+typedef struct {
+  size_t freed;
+  PoolBlock* pools[POOL_COUNT];
+  PoolBlock* poolTails[POOL_COUNT];
+} Sweeper;
+
+// The parallel mark or sweep worker running on this thread, if any.
+static _Thread_local int markWorker = -1;
+static _Thread_local Sweeper* sweeper = NULL;
+
+static void sweeperFree(void* pointer, size_t size);
+#endif
+
+static inline int poolIndex(size_t size) {
+  if (size == 0 || size > POOL_MAX_SIZE) return -1;
+  return (int)((size - 1) / POOL_GRANULARITY);
+}
+
+// Carves a fresh slab into blocks for [pool]. The free list is built in
+// address order so consecutive allocations end up next to each other.
+static void refillPool(VM* vm, int pool) {
+  Slab* slab = (Slab*)malloc(SLAB_SIZE);
+  if (slab == NULL) exit(1);
+  slab->next = vm->slabs;
+  vm->slabs = slab;
+
+  size_t blockSize = (size_t)(pool + 1) * POOL_GRANULARITY;
+  char* start = (char*)slab + POOL_GRANULARITY;
+  size_t count = (SLAB_SIZE - POOL_GRANULARITY) / blockSize;
 
-  if (newSize == 0) {
+  PoolBlock* head = vm->pools[pool];
+  for (size_t i = count; i > 0; i--) {
+    PoolBlock* block = (PoolBlock*)(start + (i - 1) * blockSize);
+    block->next = head;
+    head = block;
+  }
+  vm->pools[pool] = head;
+}
+
+static void* poolAllocate(VM* vm, size_t size) {
+  int pool = poolIndex(size);
+  if (pool == -1) {
+    void* result = malloc(size);
+    if (result == NULL) exit(1);
+    return result;
+  }
+
+  if (vm->pools[pool] == NULL) refillPool(vm, pool);
+  PoolBlock* block = vm->pools[pool];
+  vm->pools[pool] = block->next;
+  return block;
+}
+
+static void poolFree(VM* vm, void* pointer, size_t size) {
+  int pool = poolIndex(size);
+  if (pool == -1) {
     free(pointer);
-    return NULL;
+    return;
+  }
+
+  PoolBlock* block = (PoolBlock*)pointer;
+  block->next = vm->pools[pool];
+  vm->pools[pool] = block;
+}
+
+static void* poolReallocate(VM* vm, void* pointer, size_t oldSize,
+                            size_t newSize) {
+  int oldPool = poolIndex(oldSize);
+  int newPool = poolIndex(newSize);
+
+  if (pointer != NULL && oldPool == -1 && newPool == -1) {
+    if (newSize == 0) {
+      free(pointer);
+      return NULL;
+    }
+
+    void* result = realloc(pointer, newSize);
+    if (result == NULL) exit(1);
+    return result;
+  }
+
+  // Still fits in the block it already has.
+  if (pointer != NULL && newPool != -1 && oldPool == newPool) {
+    return pointer;
+  }
+
+  void* result = NULL;
+  if (newSize > 0) result = poolAllocate(vm, newSize);
+
+  if (pointer != NULL) {
+    if (result != NULL) {
+      memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    }
+    poolFree(vm, pointer, oldSize);
   }
 
-  void* result = realloc(pointer, newSize);
-  if (result == NULL) exit(1);
   return result;
 }
 
-void markObject(Obj* object) {
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
+#if PARALLEL_GC
+  // A parallel sweep only ever frees.
+  if (sweeper != NULL) {
+    sweeperFree(pointer, oldSize);
+    return NULL;
+  }
+#endif
+
+  vm->bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize) {
+    vm->youngAllocated += newSize - oldSize;
+    vm->sliceAllocated += newSize - oldSize;
+    vm->gcStats.totalAllocated += newSize - oldSize;
+    if (vm->bytesAllocated > vm->gcStats.peakHeap) {
+      vm->gcStats.peakHeap = vm->bytesAllocated;
+    }
+
+#ifdef DEBUG_STRESS_GC
+    if (vm->gcIncremental) {
+      if (vm->gcPhase == GC_PHASE_IDLE) beginCycle(vm);
+      collectSlice(vm);
+      if (vm->gcPhase != GC_PHASE_MARK) collectYoung(vm);
+    } else {
+      // Alternate so both the roots and the write barriers get
+      // exercised.
+      vm->stressFull = !vm->stressFull;
+      if (vm->stressFull) {
+        collectGarbage(vm);
+      } else {
+        collectYoung(vm);
+      }
+    }
+#endif
+
+    if (vm->gcPhase != GC_PHASE_IDLE) {
+      if (vm->bytesAllocated > vm->nextGC * vm->gcGrowFactor) {
+        // We're falling behind the mutator, catch up at once.
+        Pause pause = beginPause(vm);
+        finishCycle(vm);
+        endPause(vm, &pause);
+      } else if (vm->sliceAllocated > GC_SLICE_STEP) {
+        collectSlice(vm);
+      }
+    } else if (vm->bytesAllocated > vm->nextGC) {
+      if (vm->gcIncremental) {
+        beginCycle(vm);
+      } else {
+        collectGarbage(vm);
+      }
+    }
+
+    // Young collections have to wait while an incremental cycle is
+    // marking. The sweep only ever unlinks objects from the old list,
+    // so promoting survivors in the middle of it is fine.
+    if (vm->gcPhase != GC_PHASE_MARK &&
+        vm->youngAllocated > GC_NURSERY_SIZE) {
+      collectYoung(vm);
+    }
+
+    if (vm->gcMaxHeap != 0 && vm->bytesAllocated > vm->gcMaxHeap) {
+      // Everything unreachable has to go before we give up.
+      collectGarbage(vm);
+      if (vm->bytesAllocated > vm->gcMaxHeap) {
+        fprintf(stderr, "Out of memory, the heap is limited to %zu bytes.\n",
+                vm->gcMaxHeap);
+        exit(1);
+      }
+    }
+  }
+
+  return poolReallocate(vm, pointer, oldSize, newSize);
+}
+
+#if PARALLEL_GC
+// Workers mark objects while others may be reading or marking them,
+// so during a parallel mark the header is only touched atomically.
+static inline bool loadMark(Obj* object) {
+#if COMPACT_OBJECTS
+  return (__atomic_load_n(&object->header, __ATOMIC_RELAXED) &
+          OBJ_MARKED_BIT) != 0;
+#else
+  return __atomic_load_n(&object->isMarked, __ATOMIC_RELAXED);
+#endif
+}
+
+// Sets [object]'s mark, returns whether it was this worker that did.
+static inline bool claimMark(VM* vm, Obj* object) {
+#if COMPACT_OBJECTS
+  uint64_t before = vm->markValue
+      ? __atomic_fetch_or(&object->header, OBJ_MARKED_BIT,
+                          __ATOMIC_RELAXED)
+      : __atomic_fetch_and(&object->header, ~OBJ_MARKED_BIT,
+                           __ATOMIC_RELAXED);
+  return ((before & OBJ_MARKED_BIT) != 0) != vm->markValue;
+#else
+  return __atomic_exchange_n(&object->isMarked, vm->markValue,
+                             __ATOMIC_RELAXED) != vm->markValue;
+#endif
+}
+#endif
+
+// The type of an object that's being blackened. With the type packed
+// in with the mark bit another worker may be setting, that takes an
+// atomic load too.
+static inline ObjType loadType(Obj* object) {
+#if PARALLEL_GC && COMPACT_OBJECTS
+  return (ObjType)(__atomic_load_n(&object->header, __ATOMIC_RELAXED) >>
+                   OBJ_TYPE_SHIFT);
+#else
+  return objType(object);
+#endif
+}
+
+void markObject(VM* vm, Obj* object) {
   if (object == NULL) return;
-  if (object->isMarked) return;
+#if PARALLEL_GC
+  if (markWorker != -1) {
+    if (loadMark(object) != vm->markValue) grayObject(vm, object);
+    return;
+  }
+#endif
+  if (IS_MARKED(vm, object)) return;
 
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void*)object);
-  printValue(OBJ_VAL(object));
+  printValue(vm, OBJ_VAL(object));
   printf("\n");
 #endif
 
-  object->isMarked = true;
+  grayObject(vm, object);
+}
+
+void grayObject(VM* vm, Obj* object) {
+#if PARALLEL_GC
+  if (markWorker != -1) {
+    // Another worker may have reached the object at the same time, only
+    // the one that gets to flip its mark grays it.
+    if (claimMark(vm, object)) pushGray(vm->gcWorkers, markWorker, object);
+    return;
+  }
+#endif
+
+  setObjMark(object, vm->markValue);
 
-  if (vm.grayCapacity < vm.grayCount + 1) {
-    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-    vm.grayStack = (Obj**)realloc(vm.grayStack,
-                                  sizeof(Obj*) * vm.grayCapacity);
+  if (vm->grayCapacity < vm->grayCount + 1) {
+    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+    vm->grayStack = (Obj**)realloc(vm->grayStack,
+                                  sizeof(Obj*) * vm->grayCapacity);
 
-    if (vm.grayStack == NULL) exit(1);
+    if (vm->grayStack == NULL) exit(1);
   }
 
-  vm.grayStack[vm.grayCount++] = object;
+  vm->grayStack[vm->grayCount++] = object;
+}
+
+void markValue(VM* vm, Value value) {
+  if (IS_OBJ(value)) markObject(vm, AS_OBJ(value));
 }
 
-void markValue(Value value) {
-  if (IS_OBJ(value)) markObject(AS_OBJ(value));
+void rememberObject(VM* vm, Obj* object) {
+  setRemembered(object, true);
+
+  if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+    vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+    vm->remembered = (Obj**)realloc(vm->remembered,
+        sizeof(Obj*) * vm->rememberedCapacity);
+
+    if (vm->remembered == NULL) exit(1);
+  }
+
+  vm->remembered[vm->rememberedCount++] = object;
 }
 
-static void markArray(ValueArray* array) {
+static void markArray(VM* vm, ValueArray* array) {
   for (int i = 0; i < array->count; i++) {
-    markValue(array->values[i]);
+    markValue(vm, array->values[i]);
+  }
+}
+
+static void markCaches(VM* vm, Chunk* chunk) {
+  for (int i = 0; i < chunk->cacheCount; i++) {
+    InlineCache* cache = &chunk->caches[i];
+    for (int j = 0; j < INLINE_CACHE_WAYS; j++) {
+      markObject(vm, (Obj*)cache->entries[j].shape);
+      markObject(vm, (Obj*)cache->entries[j].target);
+      markValue(vm, cache->entries[j].method);
+    }
   }
 }
 
-static void blackenObject(Obj* object) {
+static void blackenObject(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void*)object);
-  printValue(OBJ_VAL(object));
+  printValue(vm, OBJ_VAL(object));
   printf("\n");
 #endif
 
-  switch (object->type) {
+  switch (loadType(object)) {
     case OBJ_BOUND_METHOD: {
       ObjBoundMethod* bound = (ObjBoundMethod*)object;
-      markValue(bound->receiver);
-      markObject((Obj*)bound->method);
+      markValue(vm, bound->receiver);
+      markObject(vm, (Obj*)bound->method);
       break;
     }
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
-      markObject((Obj*)klass->name);
-      markTable(&klass->methods);
+      markObject(vm, (Obj*)klass->name);
+      markTable(vm, &klass->methods);
+      markObject(vm, (Obj*)klass->rootShape);
+      markObject(vm, (Obj*)klass->initializer);
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
-      markObject((Obj*)closure->function);
+      markObject(vm, (Obj*)closure->function);
       for (int i = 0; i < closure->upvalueCount; i++) {
-        markObject((Obj*)closure->upvalues[i]);
+        ObjUpvalue* upvalue = closure->upvalues[i];
+        // Values captured in place aren't objects of their own.
+        if (upvalue != NULL && isValueCapture(closure, upvalue)) {
+          markValue(vm, upvalue->closed);
+        } else {
+          markObject(vm, (Obj*)upvalue);
+        }
       }
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
-      markObject((Obj*)function->name);
-      markArray(&function->chunk.constants);
+      markObject(vm, (Obj*)function->name);
+      markArray(vm, &function->chunk.constants);
+      markCaches(vm, &function->chunk);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
-      markObject((Obj*)instance->klass);
-      markTable(&instance->fields);
+      markObject(vm, (Obj*)instance->klass);
+      markObject(vm, (Obj*)instance->shape);
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        markValue(vm, instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_LIST:
+      markArray(vm, &((ObjList*)object)->items);
+      break;
+    case OBJ_MAP:
+      markValueTable(vm, &((ObjMap*)object)->table);
+      break;
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*)object;
+      markObject(vm, rope->left);
+      markObject(vm, rope->right);
+      markObject(vm, (Obj*)rope->flat);
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      markObject(vm, (Obj*)shape->klass);
+      markObject(vm, (Obj*)shape->parent);
+      markObject(vm, (Obj*)shape->name);
+      markTable(vm, &shape->transitions);
       break;
     }
     case OBJ_UPVALUE:
-      markValue(((ObjUpvalue*)object)->closed);
+      markValue(vm, ((ObjUpvalue*)object)->closed);
       break;
     case OBJ_NATIVE:
     case OBJ_STRING:
@@ -115,132 +483,574 @@ static void blackenObject(Obj* object) {
   }
 }
 
-static void freeObject(Obj* object) {
+static void freeObject(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
-  printf("%p free type %d\n", (void*)object, object->type);
+  printf("%p free type %d\n", (void*)object, objType(object));
 #endif
 
-  switch (object->type) {
+  switch (objType(object)) {
     case OBJ_BOUND_METHOD:
-      FREE(ObjBoundMethod, object);
+      FREE(vm, ObjBoundMethod, object);
       break;
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
-      freeTable(&klass->methods);
-      FREE(ObjClass, object);
+      freeTable(vm, &klass->methods);
+      FREE(vm, ObjClass, object);
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
-      FREE_ARRAY(ObjUpvalue*, closure->upvalues,
-                 closure->upvalueCount);
-      FREE(ObjClosure, object);
+      reallocate(vm, closure->upvalues, closureUpvaluesSize(closure), 0);
+      FREE(vm, ObjClosure, object);
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
-      freeChunk(&function->chunk);
-      FREE(ObjFunction, object);
+      freeChunk(vm, &function->chunk);
+      freeJit(function->jit);
+      FREE(vm, ObjFunction, object);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
-      freeTable(&instance->fields);
-      FREE(ObjInstance, object);
+      FREE_ARRAY(vm, Value, instance->fields, instance->fieldCapacity);
+      FREE(vm, ObjInstance, object);
+      break;
+    }
+    case OBJ_LIST: {
+      ObjList* list = (ObjList*)object;
+      freeValueArray(vm, &list->items);
+      FREE(vm, ObjList, object);
+      break;
+    }
+    case OBJ_MAP: {
+      ObjMap* map = (ObjMap*)object;
+      freeValueTable(vm, &map->table);
+      FREE(vm, ObjMap, object);
       break;
     }
     case OBJ_NATIVE:
-      FREE(ObjNative, object);
+      FREE(vm, ObjNative, object);
+      break;
+    case OBJ_ROPE:
+      FREE(vm, ObjRope, object);
+      break;
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      freeTable(vm, &shape->transitions);
+      FREE(vm, ObjShape, object);
       break;
+    }
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+      reallocate(vm, object, STRING_SIZE(string->length), 0);
       break;
     }
     case OBJ_UPVALUE:
-      FREE(ObjUpvalue, object);
+      FREE(vm, ObjUpvalue, object);
       break;
   }
 }
 
-static void markRoots(void) {
-  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-    markValue(*slot);
+static void markRoots(VM* vm) {
+  for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+    markValue(vm, *slot);
   }
 
-  for (int i = 0; i < vm.frameCount; i++) {
-    markObject((Obj*)vm.frames[i].closure);
+  for (int i = 0; i < vm->frameCount; i++) {
+    markObject(vm, (Obj*)vm->frames[i].closure);
   }
 
-  for (ObjUpvalue* upvalue = vm.openUpvalues;
+  for (ObjUpvalue* upvalue = vm->openUpvalues;
        upvalue != NULL;
        upvalue = upvalue->next) {
-    markObject((Obj*)upvalue);
+    markObject(vm, (Obj*)upvalue);
+  }
+
+  markTable(vm, &vm->globals);
+  markArray(vm, &vm->globalValues);
+  markArray(vm, &vm->globalNames);
+  markCompilerRoots(vm);
+  markObject(vm, (Obj*)vm->initString);
+}
+
+static void removeWhiteBoundMethods(VM* vm) {
+  for (int i = 0; i < BOUND_CACHE_SIZE; i++) {
+    ObjBoundMethod* bound = vm->boundMethods[i];
+    if (bound != NULL && !IS_MARKED(vm, &bound->obj)) {
+      vm->boundMethods[i] = NULL;
+    }
+  }
+}
+
+static void traceReferences(VM* vm) {
+  while (vm->grayCount > 0) {
+    Obj* object = vm->grayStack[--vm->grayCount];
+    blackenObject(vm, object);
   }
+}
 
-  markTable(&vm.globals);
-  markCompilerRoots();
-  markObject((Obj*)vm.initString);
+#if PARALLEL_GC
+static void markTask(VM* vm, void* data, int worker) {
+  // The roots were marked on one thread, every worker starts out with
+  // its share of them.
+  markWorker = worker;
+  for (int i = worker; i < vm->grayCount; i += vm->gcThreads) {
+    pushGray(vm->gcWorkers, worker, vm->grayStack[i]);
+  }
+
+  Obj* object;
+  while ((object = popGray(vm->gcWorkers, worker)) != NULL) {
+    blackenObject(vm, object);
+  }
+  markWorker = -1;
 }
+#endif
 
-static void traceReferences(void) {
-  while (vm.grayCount > 0) {
-    Obj* object = vm.grayStack[--vm.grayCount];
-    blackenObject(object);
+// Full collections trace on every GC thread there is.
+static void traceAll(VM* vm) {
+#if PARALLEL_GC
+  if (vm->gcThreads > 1) {
+    runGCWorkers(vm, markTask, NULL);
+    vm->grayCount = 0;
+    return;
   }
+#endif
+
+  traceReferences(vm);
 }
 
-static void sweep(void) {
+// Lists are unlinked through the object before, [previous] being NULL
+// stands for the head of the old list.
+static inline Obj* linkedObject(VM* vm, Obj* previous) {
+  return previous == NULL ? vm->objects : objNext(previous);
+}
+
+static inline void setLink(VM* vm, Obj* previous, Obj* object) {
+  if (previous == NULL) {
+    vm->objects = object;
+  } else {
+    setObjNext(previous, object);
+  }
+}
+
+#if PARALLEL_GC
+// A parallel sweep splits the old object list at objects that survived
+// the last one, which are still around since only a sweep frees old
+// objects. Each stretch in between is swept by one thread, which picks
+// out the objects to split at next time.
+typedef struct {
+  // The last object left in the stretch once it's swept, or the one
+  // before the stretch if none are.
+  Obj* end;
+  Obj** boundaries;
+  int boundaryCount;
+  int boundaryCapacity;
+} SweepSegment;
+
+typedef struct {
+  SweepSegment* segments;
+  int segmentCount;
+  int next;
+  Sweeper* sweepers;
+} SweepWork;
+
+static void sweeperFree(void* pointer, size_t size) {
+  if (pointer == NULL) return;
+  sweeper->freed += size;
+
+  int pool = poolIndex(size);
+  if (pool == -1) {
+    free(pointer);
+    return;
+  }
+
+  PoolBlock* block = (PoolBlock*)pointer;
+  block->next = sweeper->pools[pool];
+  if (block->next == NULL) sweeper->poolTails[pool] = block;
+  sweeper->pools[pool] = block;
+}
+
+static void addBoundary(SweepSegment* segment, Obj* object) {
+  if (segment->boundaryCapacity < segment->boundaryCount + 1) {
+    segment->boundaryCapacity = GROW_CAPACITY(segment->boundaryCapacity);
+    segment->boundaries = (Obj**)realloc(segment->boundaries,
+        sizeof(Obj*) * segment->boundaryCapacity);
+    if (segment->boundaries == NULL) exit(1);
+  }
+
+  segment->boundaries[segment->boundaryCount++] = object;
+}
+
+static void sweepSegment(VM* vm, SweepSegment* segment, int index) {
+  Obj* previous = index == 0 ? NULL : vm->sweepBoundaries[index - 1];
+  Obj* end = index < vm->sweepBoundaryCount
+      ? vm->sweepBoundaries[index] : NULL;
+
+  int survivors = 0;
+  Obj* object;
+  while ((object = linkedObject(vm, previous)) != end) {
+    if (IS_MARKED(vm, object)) {
+      if (++survivors % SWEEP_SEGMENT_SIZE == 0) {
+        addBoundary(segment, object);
+      }
+      previous = object;
+    } else {
+      setLink(vm, previous, objNext(object));
+      freeObject(vm, object);
+    }
+  }
+
+  segment->end = previous;
+}
+
+static void sweepTask(VM* vm, void* data, int worker) {
+  SweepWork* work = (SweepWork*)data;
+  sweeper = &work->sweepers[worker];
+  for (;;) {
+    int index = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+    if (index >= work->segmentCount) break;
+    sweepSegment(vm, &work->segments[index], index);
+  }
+  sweeper = NULL;
+}
+
+static void sweepParallel(VM* vm) {
+  SweepWork work;
+  work.segmentCount = vm->sweepBoundaryCount + 1;
+  work.segments = (SweepSegment*)calloc(work.segmentCount,
+                                        sizeof(SweepSegment));
+  work.sweepers = (Sweeper*)calloc(vm->gcThreads, sizeof(Sweeper));
+  if (work.segments == NULL || work.sweepers == NULL) exit(1);
+  work.next = 0;
+
+  runGCWorkers(vm, sweepTask, &work);
+
+  for (int i = 0; i < vm->gcThreads; i++) {
+    Sweeper* done = &work.sweepers[i];
+    vm->bytesAllocated -= done->freed;
+    for (int pool = 0; pool < POOL_COUNT; pool++) {
+      if (done->pools[pool] == NULL) continue;
+      done->poolTails[pool]->next = vm->pools[pool];
+      vm->pools[pool] = done->pools[pool];
+    }
+  }
+
+  // The objects the segments were split at haven't been looked at yet.
+  // Unlinking a dead one joins its segment to the one before.
+  int count = 0;
+  for (int i = 0; i < work.segmentCount; i++) {
+    SweepSegment* segment = &work.segments[i];
+    count += segment->boundaryCount;
+    if (i == 0) continue;
+
+    Obj* boundary = vm->sweepBoundaries[i - 1];
+    if (!IS_MARKED(vm, boundary)) {
+      Obj* link = work.segments[i - 1].end;
+      setLink(vm, link, objNext(boundary));
+      if (segment->end == boundary) segment->end = link;
+      freeObject(vm, boundary);
+    }
+  }
+
+  if (vm->sweepBoundaryCapacity < count) {
+    vm->sweepBoundaryCapacity = count;
+    vm->sweepBoundaries = (Obj**)realloc(vm->sweepBoundaries,
+                                         sizeof(Obj*) * count);
+    if (vm->sweepBoundaries == NULL) exit(1);
+  }
+
+  vm->sweepBoundaryCount = 0;
+  for (int i = 0; i < work.segmentCount; i++) {
+    SweepSegment* segment = &work.segments[i];
+    for (int j = 0; j < segment->boundaryCount; j++) {
+      vm->sweepBoundaries[vm->sweepBoundaryCount++] =
+          segment->boundaries[j];
+    }
+    free(segment->boundaries);
+  }
+
+  free(work.segments);
+  free(work.sweepers);
+}
+#endif
+
+static void sweep(VM* vm) {
+#if PARALLEL_GC
+  if (vm->gcThreads > 1) {
+    sweepParallel(vm);
+    return;
+  }
+  vm->sweepBoundaryCount = 0;
+#endif
+
   Obj* previous = NULL;
-  Obj* object = vm.objects;
+  Obj* object = vm->objects;
   while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = false;
+    if (IS_MARKED(vm, object)) {
       previous = object;
-      object = object->next;
+      object = objNext(object);
     } else {
       Obj* unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm.objects = object;
+      object = objNext(object);
+      setLink(vm, previous, object);
+
+      freeObject(vm, unreached);
+    }
+  }
+}
+
+// Frees the young objects that weren't reached and promotes the rest
+// by moving them to the old list. They are already marked, so they
+// stay old until the next full collection.
+static void sweepYoung(VM* vm) {
+  Obj* object = vm->youngObjects;
+  while (object != NULL) {
+    Obj* next = objNext(object);
+    if (IS_MARKED(vm, object)) {
+      setObjNext(object, vm->objects);
+      vm->objects = object;
+    } else {
+      // The strings table is weak, drop dead strings from it here
+      // instead of walking the whole table.
+      if (objType(object) == OBJ_STRING) {
+        tableDelete(&vm->strings, (ObjString*)object);
       }
+      freeObject(vm, object);
+    }
+    object = next;
+  }
+
+  vm->youngObjects = NULL;
+}
+
+static void forgetRemembered(VM* vm) {
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    setRemembered(vm->remembered[i], false);
+  }
+  vm->rememberedCount = 0;
+}
+
+// A minor collection only traces young objects. Old objects count as
+// marked, so marking stops as soon as it reaches one, and the old
+// objects the write barrier remembered are rescanned to find the young
+// objects only they point to.
+static void collectYoung(VM* vm) {
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm->bytesAllocated;
+#endif
+  Pause pause = beginPause(vm);
+
+  markRoots(vm);
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    blackenObject(vm, vm->remembered[i]);
+  }
+  forgetRemembered(vm);
+  traceReferences(vm);
+  removeWhiteBoundMethods(vm);
+  sweepYoung(vm);
+
+  vm->youngAllocated = 0;
+  vm->gcStats.minorCollections++;
+  endPause(vm, &pause);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu)\n",
+         before - vm->bytesAllocated, before, vm->bytesAllocated);
+#endif
+}
+
+// Flipping the mark value turns every old object white. Young objects
+// have to keep looking unmarked, so they are moved to the old list with
+// their mark flipped along.
+static void flipMarks(VM* vm) {
+  while (vm->youngObjects != NULL) {
+    Obj* object = vm->youngObjects;
+    vm->youngObjects = objNext(object);
+    setObjMark(object, vm->markValue);
+    setObjNext(object, vm->objects);
+    vm->objects = object;
+  }
+  vm->markValue = !vm->markValue;
+  forgetRemembered(vm);
+}
+
+// An incremental cycle marks the heap in slices interleaved with the
+// mutator. Objects the write barrier remembers while marking may have
+// been given a white reference after they were blackened, keeping the
+// tri-color invariant just means rescanning them before marking ends.
+// Objects allocated during marking start out gray, so the final pass
+// doesn't have to trace everything the mutator built in the meantime.
+static void beginCycle(VM* vm) {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc cycle begin\n");
+#endif
+
+  Pause pause = beginPause(vm);
+  flipMarks(vm);
+  markRoots(vm);
+  vm->gcPhase = GC_PHASE_MARK;
+  vm->sliceAllocated = 0;
+  endPause(vm, &pause);
+}
+
+// Blackens gray objects and rescans remembered ones until [budget]
+// runs out, returns how much of it is left.
+static int markSlice(VM* vm, int budget) {
+  for (;;) {
+    if (vm->grayCount > 0) {
+      blackenObject(vm, vm->grayStack[--vm->grayCount]);
+    } else if (vm->rememberedCount > 0) {
+      Obj* object = vm->remembered[--vm->rememberedCount];
+      setRemembered(object, false);
+      blackenObject(vm, object);
+    } else {
+      break;
+    }
+
+    if (--budget <= 0) break;
+  }
 
-      freeObject(unreached);
+  return budget;
+}
+
+static void finishMark(VM* vm) {
+  // The roots are mutated without barriers, so they're marked again
+  // before the final (and this time unbounded) pass.
+  markRoots(vm);
+  while (vm->grayCount > 0 || vm->rememberedCount > 0) {
+    markSlice(vm, INT32_MAX);
+  }
+
+  tableRemoveWhite(vm, &vm->strings);
+  removeWhiteBoundMethods(vm);
+
+  // Objects allocated while marking are already gray, move them over
+  // from the young list so they're treated like any other survivor.
+  while (vm->youngObjects != NULL) {
+    Obj* object = vm->youngObjects;
+    vm->youngObjects = objNext(object);
+    setObjNext(object, vm->objects);
+    vm->objects = object;
+  }
+
+  vm->sweepPrevious = NULL;
+  vm->gcPhase = GC_PHASE_SWEEP;
+  // The lazy sweep frees old objects the parallel one may split at.
+  vm->sweepBoundaryCount = 0;
+}
+
+// Frees up to [budget] unreached objects. Young collections may promote
+// objects in between slices, but those are only ever pushed onto the
+// head of the old list so the cursor stays valid.
+static void sweepSlice(VM* vm, int budget) {
+  Obj* object;
+  while ((object = linkedObject(vm, vm->sweepPrevious)) != NULL &&
+         budget-- > 0) {
+    if (IS_MARKED(vm, object)) {
+      vm->sweepPrevious = object;
+    } else {
+      setLink(vm, vm->sweepPrevious, objNext(object));
+      freeObject(vm, object);
     }
   }
+
+  if (object == NULL) {
+    vm->sweepPrevious = NULL;
+    vm->gcPhase = GC_PHASE_IDLE;
+    vm->gcStats.majorCollections++;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc cycle end\n");
+    printf("   %zu bytes in use\n", vm->bytesAllocated);
+#endif
+  }
+}
+
+static void collectSlice(VM* vm) {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc slice (%s)\n",
+         vm->gcPhase == GC_PHASE_MARK ? "mark" : "sweep");
+#endif
+
+  Pause pause = beginPause(vm);
+  int budget = vm->gcSliceBudget;
+  if (vm->gcPhase == GC_PHASE_MARK) {
+    budget = markSlice(vm, budget);
+    if (vm->grayCount == 0 && vm->rememberedCount == 0) finishMark(vm);
+  }
+
+  if (vm->gcPhase == GC_PHASE_SWEEP && budget > 0) {
+    sweepSlice(vm, budget);
+  }
+
+  vm->sliceAllocated = 0;
+  vm->gcStats.slices++;
+  endPause(vm, &pause);
 }
 
-void collectGarbage(void) {
+static void finishCycle(VM* vm) {
+  if (vm->gcPhase == GC_PHASE_MARK) finishMark(vm);
+  if (vm->gcPhase == GC_PHASE_SWEEP) sweepSlice(vm, INT32_MAX);
+}
+
+void collectGarbage(VM* vm) {
+  Pause pause = beginPause(vm);
+  // Complete any incremental cycle in flight first. It leaves the heap
+  // in a consistent state for the full collection to start from.
+  finishCycle(vm);
+
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
-  size_t before = vm.bytesAllocated;
+  size_t before = vm->bytesAllocated;
 #endif
 
-  markRoots();
-  traceReferences();
-  tableRemoveWhite(&vm.strings);
-  sweep();
+  flipMarks(vm);
+  markRoots(vm);
+  traceAll(vm);
+  tableRemoveWhite(vm, &vm->strings);
+  removeWhiteBoundMethods(vm);
+  sweep(vm);
 
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm->youngAllocated = 0;
+  vm->gcStats.majorCollections++;
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
-  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated,
-         vm.nextGC);
+  printf("   collected %zu bytes (from %zu to %zu)\n",
+         before - vm->bytesAllocated, before, vm->bytesAllocated);
 #endif
+  endPause(vm, &pause);
 }
 
-void freeObjects(void) {
-  Obj* object = vm.objects;
+static void freeList(VM* vm, Obj* object) {
   while (object != NULL) {
-    Obj* next = object->next;
-    freeObject(object);
+    Obj* next = objNext(object);
+    freeObject(vm, object);
     object = next;
   }
+}
 
-  free(vm.grayStack);
+void freeObjects(VM* vm) {
+  freeList(vm, vm->objects);
+  freeList(vm, vm->youngObjects);
+
+  free(vm->grayStack);
+  free(vm->remembered);
+  free(vm->sweepBoundaries);
+
+  // Every pooled block is back on a free list at this point, so the
+  // slabs can go all at once.
+  Slab* slab = vm->slabs;
+  while (slab != NULL) {
+    Slab* next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  vm->slabs = NULL;
+  for (int i = 0; i < POOL_COUNT; i++) {
+    vm->pools[i] = NULL;
+  }
 }
@@ -3,26 +3,42 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-    (type*)reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount) \
+    (type*)reallocate(vm, pointer, sizeof(type) * (oldCount), \
         sizeof(type) * (newCount))
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
-
-void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void markObject(Obj* object);
-void markValue(Value value);
-void collectGarbage(void);
-void freeObjects(void);
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+    reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
+
+#define IS_MARKED(vm, object) (objMark(object) == (vm)->markValue)
+
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize);
+void markObject(VM* vm, Obj* object);
+void grayObject(VM* vm, Obj* object);
+void markValue(VM* vm, Value value);
+void rememberObject(VM* vm, Obj* object);
+void collectGarbage(VM* vm);
+// Seconds since some point in the past, for timing collections.
+double gcClock(void);
+void freeObjects(VM* vm);
+
+// Must be called after storing a reference into [object]. Old objects
+// are not traced by a young collection, so any old object that may now
+// point to a young one is remembered and rescanned by the next one.
+static inline void writeBarrier(VM* vm, Obj* object) {
+  if (IS_MARKED(vm, object) && !isRemembered(object)) {
+    rememberObject(vm, object);
+  }
+}
 
 #endif
@@ -7,16 +7,15 @@
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocateObject(vm, sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
-  object->type = type;
-  object->isMarked = false;
-  
-  object->next = vm.objects;
-  vm.objects = object;
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+  Obj* object = (Obj*)reallocate(vm, NULL, 0, size);
+  initObjHeader(object, type, !vm->markValue, vm->youngObjects);
+  vm->youngObjects = object;
+
+  if (vm->gcPhase == GC_PHASE_MARK) grayObject(vm, object);
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -25,107 +24,343 @@ static Obj* allocateObject(size_t size, ObjType type) {
   return object;
 }
 
-ObjBoundMethod* newBoundMethod(Value receiver,
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver,
                                ObjClosure* method) {
-  ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod,
+  ObjBoundMethod* bound = ALLOCATE_OBJ(vm, ObjBoundMethod,
                                        OBJ_BOUND_METHOD);
   bound->receiver = receiver;
   bound->method = method;
   return bound;
 }
 
-ObjClass* newClass(ObjString* name) {
-  ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+ObjClass* newClass(VM* vm, ObjString* name) {
+  ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
   klass->name = name;
+  klass->rootShape = NULL;
+  klass->initializer = NULL;
   initTable(&klass->methods);
+
+  push(vm, OBJ_VAL(klass));
+  klass->rootShape = newShape(vm, klass, NULL, NULL);
+  writeBarrier(vm, (Obj*)klass);
+  pop(vm);
   return klass;
 }
 
-ObjClosure* newClosure(ObjFunction* function) {
-  ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*,
-                                   function->upvalueCount);
-  for (int i = 0; i < function->upvalueCount; i++) {
+static size_t upvaluesSize(int count, bool hasValues) {
+  size_t size = sizeof(ObjUpvalue*) * count;
+  if (hasValues) size += sizeof(ObjUpvalue) * count;
+  return size;
+}
+
+ObjClosure* newClosure(VM* vm, ObjFunction* function, bool hasValues) {
+  int count = function->upvalueCount;
+  ObjUpvalue** upvalues = (ObjUpvalue**)reallocate(vm, NULL, 0,
+      upvaluesSize(count, hasValues));
+  for (int i = 0; i < count; i++) {
     upvalues[i] = NULL;
   }
 
-  ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  ObjClosure* closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
   closure->function = function;
   closure->upvalues = upvalues;
-  closure->upvalueCount = function->upvalueCount;
+  closure->values = hasValues ? (ObjUpvalue*)(upvalues + count) : NULL;
+  closure->upvalueCount = count;
   return closure;
 }
 
-ObjFunction* newFunction(void) {
-  ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+size_t closureUpvaluesSize(ObjClosure* closure) {
+  return upvaluesSize(closure->upvalueCount, closure->values != NULL);
+}
+
+bool isValueCapture(ObjClosure* closure, ObjUpvalue* upvalue) {
+  return closure->values != NULL && upvalue >= closure->values &&
+         upvalue < closure->values + closure->upvalueCount;
+}
+
+ObjFunction* newFunction(VM* vm) {
+  ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxSlots = 0;
   function->name = NULL;
+  function->hotness = 0;
+  function->jit = NULL;
   initChunk(&function->chunk);
   return function;
 }
 
-ObjInstance* newInstance(ObjClass* klass) {
-  ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+ObjInstance* newInstance(VM* vm, ObjClass* klass) {
+  ObjInstance* instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
   instance->klass = klass;
-  initTable(&instance->fields);
+  instance->shape = klass->rootShape;
+  instance->fields = NULL;
+  instance->fieldCapacity = 0;
   return instance;
 }
 
-ObjNative* newNative(NativeFn function) {
-  ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjList* newList(VM* vm) {
+  ObjList* list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+  initValueArray(&list->items);
+  return list;
+}
+
+ObjMap* newMap(VM* vm) {
+  ObjMap* map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+  initValueTable(&map->table);
+  return map;
+}
+
+ObjNative* newNative(VM* vm, NativeFn function, int arity, void* context) {
+  ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->arity = arity;
+  native->context = context;
   return native;
 }
 
-static ObjString* allocateString(char* chars, int length,
+static Obj* ropePiece(Obj* piece) {
+  // Point straight at the flattened string so the old pieces can go.
+  if (objType(piece) == OBJ_ROPE && ((ObjRope*)piece)->flat != NULL) {
+    return (Obj*)((ObjRope*)piece)->flat;
+  }
+  return piece;
+}
+
+ObjRope* newRope(VM* vm, Obj* left, Obj* right, int length) {
+  ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = ropePiece(left);
+  rope->right = ropePiece(right);
+  rope->flat = NULL;
+  return rope;
+}
+
+ObjString* flattenRope(VM* vm, ObjRope* rope) {
+  if (rope->flat != NULL) return rope->flat;
+
+  char* chars = ALLOCATE(vm, char, rope->length + 1);
+  chars[rope->length] = '\0';
+
+  // The buffer is filled from the back, so the left leaning ropes made
+  // by appending in a loop only ever have a couple of pieces pending.
+  int capacity = 8;
+  int count = 0;
+  Obj** pending = ALLOCATE(vm, Obj*, capacity);
+  pending[count++] = (Obj*)rope;
+
+  int end = rope->length;
+  while (count > 0) {
+    Obj* piece = pending[--count];
+    ObjString* string;
+    if (objType(piece) == OBJ_STRING) {
+      string = (ObjString*)piece;
+    } else if (((ObjRope*)piece)->flat != NULL) {
+      string = ((ObjRope*)piece)->flat;
+    } else {
+      if (count + 2 > capacity) {
+        int oldCapacity = capacity;
+        capacity = GROW_CAPACITY(oldCapacity);
+        pending = GROW_ARRAY(vm, Obj*, pending, oldCapacity, capacity);
+      }
+      pending[count++] = ((ObjRope*)piece)->left;
+      pending[count++] = ((ObjRope*)piece)->right;
+      continue;
+    }
+
+    end -= string->length;
+    memcpy(chars + end, string->chars, string->length);
+  }
+  FREE_ARRAY(vm, Obj*, pending, capacity);
+
+  ObjString* flat = takeString(vm, chars, rope->length);
+  rope->flat = flat;
+  rope->left = NULL;
+  rope->right = NULL;
+  writeBarrier(vm, (Obj*)rope);
+  return flat;
+}
+
+ObjShape* newShape(VM* vm, ObjClass* klass, ObjShape* parent,
+                   ObjString* name) {
+  ObjShape* shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+  shape->klass = klass;
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+  initTable(&shape->transitions);
+  return shape;
+}
+
+int shapeLookup(ObjShape* shape, ObjString* name) {
+  for (; shape->name != NULL; shape = shape->parent) {
+    if (shape->name == name) return shape->fieldCount - 1;
+  }
+
+  return -1;
+}
+
+ObjShape* shapeTransition(VM* vm, ObjShape* shape, ObjString* name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) {
+    return AS_SHAPE(next);
+  }
+
+  ObjShape* child = newShape(vm, shape->klass, shape, name);
+  push(vm, OBJ_VAL(child));
+  tableSet(vm, &shape->transitions, name, OBJ_VAL(child));
+  writeBarrier(vm, (Obj*)shape);
+  pop(vm);
+  return child;
+}
+
+void instanceSetShape(VM* vm, ObjInstance* instance, ObjShape* shape) {
+  if (instance->fieldCapacity < shape->fieldCount) {
+    int oldCapacity = instance->fieldCapacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    while (capacity < shape->fieldCount) capacity *= 2;
+
+    instance->fields = GROW_ARRAY(vm, Value, instance->fields,
+                                  oldCapacity, capacity);
+    instance->fieldCapacity = capacity;
+  }
+
+  instance->shape = shape;
+}
+
+static ObjString* allocateString(VM* vm, const char* chars, int length,
                                  uint32_t hash) {
-  ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+  ObjString* string = (ObjString*)allocateObject(vm, STRING_SIZE(length),
+                                                 OBJ_STRING);
   string->length = length;
-  string->chars = chars;
   string->hash = hash;
+  memcpy(string->chars, chars, length);
+  string->chars[length] = '\0';
 
-  push(OBJ_VAL(string));
-  tableSet(&vm.strings, string, NIL_VAL);
-  pop();
+  push(vm, OBJ_VAL(string));
+  tableSet(vm, &vm->strings, string, NIL_VAL);
+  pop(vm);
 
   return string;
 }
 
-static uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
-  }
-  return hash;
+// Multiplies two 64 bit words into 128 bits, leaving the low half in
+// [a] and the high half in [b].
+static inline void hashMultiply(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32;
+  uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
 }
 
-ObjString* takeString(char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length,
-                                        hash);
-  if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned;
+static inline uint64_t hashMix(uint64_t a, uint64_t b) {
+  hashMultiply(&a, &b);
+  return a ^ b;
+}
+
+static inline uint64_t read64(const char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t read32(const char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// wyhash, which eats 16 to 48 bytes per step instead of FNV-1a's one.
+// Strings of up to 16 bytes are read as a few overlapping words without
+// looping at all.
+static uint32_t hashString(const char* key, int length) {
+  static const uint64_t secret[4] = {
+    UINT64_C(0xa0761d6478bd642f), UINT64_C(0xe7037ed1a0b428db),
+    UINT64_C(0x8ebc6af09c88c6e3), UINT64_C(0x589965cc75374cc3)
+  };
+
+  const char* p = key;
+  uint64_t seed = hashMix(secret[0], secret[1]);
+  uint64_t a, b;
+
+  if (length <= 16) {
+    if (length >= 4) {
+      int middle = (length >> 3) << 2;
+      a = (read32(p) << 32) | read32(p + middle);
+      b = (read32(p + length - 4) << 32) |
+          read32(p + length - 4 - middle);
+    } else if (length > 0) {
+      a = ((uint64_t)(uint8_t)p[0] << 16) |
+          ((uint64_t)(uint8_t)p[length >> 1] << 8) |
+          (uint8_t)p[length - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    int i = length;
+    if (i > 48) {
+      // Three independent lanes keep the multiplier busy.
+      uint64_t seed1 = seed, seed2 = seed;
+      do {
+        seed = hashMix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+        seed1 = hashMix(read64(p + 16) ^ secret[2],
+                        read64(p + 24) ^ seed1);
+        seed2 = hashMix(read64(p + 32) ^ secret[3],
+                        read64(p + 40) ^ seed2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= seed1 ^ seed2;
+    }
+
+    while (i > 16) {
+      seed = hashMix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+
+    a = read64(p + i - 16);
+    b = read64(p + i - 8);
   }
 
-  return allocateString(chars, length, hash);
+  a ^= secret[1];
+  b ^= seed;
+  hashMultiply(&a, &b);
+  return (uint32_t)hashMix(a ^ secret[0] ^ (uint64_t)length,
+                           b ^ secret[1]);
 }
 
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM* vm, const char* chars, int length) {
   uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length,
+  ObjString* interned = tableFindString(&vm->strings, chars, length,
                                         hash);
   if (interned != NULL) return interned;
 
-  char* heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  return allocateString(vm, chars, length, hash);
 }
 
-ObjUpvalue* newUpvalue(Value* slot) {
-  ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+ObjString* takeString(VM* vm, char* chars, int length) {
+  // The characters live inside the string so the buffer still gets
+  // copied, this just saves the caller freeing it.
+  ObjString* string = copyString(vm, chars, length);
+  FREE_ARRAY(vm, char, chars, length + 1);
+  return string;
+}
+
+ObjUpvalue* newUpvalue(VM* vm, Value* slot) {
+  ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
   upvalue->closed = NIL_VAL;
   upvalue->location = slot;
   upvalue->next = NULL;
@@ -140,7 +375,32 @@ static void printFunction(ObjFunction* function) {
   printf("<fn %s>", function->name->chars);
 }
 
-void printObject(Value value) {
+static void printList(VM* vm, ObjList* list) {
+  printf("[");
+  for (int i = 0; i < list->items.count; i++) {
+    if (i > 0) printf(", ");
+    printValue(vm, list->items.values[i]);
+  }
+  printf("]");
+}
+
+static void printMap(VM* vm, ObjMap* map) {
+  printf("{");
+  bool first = true;
+  for (int i = 0; i < map->table.capacity; i++) {
+    ValueEntry* entry = &map->table.entries[i];
+    if (IS_UNDEFINED(entry->key)) continue;
+
+    if (!first) printf(", ");
+    first = false;
+    printValue(vm, entry->key);
+    printf(": ");
+    printValue(vm, entry->value);
+  }
+  printf("}");
+}
+
+void printObject(VM* vm, Value value) {
   switch (OBJ_TYPE(value)) {
     case OBJ_BOUND_METHOD:
       printFunction(AS_BOUND_METHOD(value)->method->function);
@@ -158,9 +418,21 @@ void printObject(Value value) {
       printf("%s instance",
              AS_INSTANCE(value)->klass->name->chars);
       break;
+    case OBJ_LIST:
+      printList(vm, AS_LIST(value));
+      break;
+    case OBJ_MAP:
+      printMap(vm, AS_MAP(value));
+      break;
     case OBJ_NATIVE:
       printf("<native fn>");
       break;
+    case OBJ_ROPE:
+      printf("%s", flattenRope(vm, AS_ROPE(value))->chars);
+      break;
+    case OBJ_SHAPE:
+      printf("shape");
+      break;
     case OBJ_STRING:
       printf("%s", AS_CSTRING(value));
       break;
@@ -6,14 +6,18 @@
 #include "table.h"
 #include "value.h"
 
-#define OBJ_TYPE(value)        (AS_OBJ(value)->type)
+#define OBJ_TYPE(value)        (objType(AS_OBJ(value)))
 
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value)        isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value)         isObjType(value, OBJ_LIST)
+#define IS_MAP(value)          isObjType(value, OBJ_MAP)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value)         isObjType(value, OBJ_ROPE)
+#define IS_SHAPE(value)        isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
@@ -21,8 +25,11 @@
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
-#define AS_NATIVE(value) \
-    (((ObjNative*)AS_OBJ(value))->function)
+#define AS_LIST(value)         ((ObjList*)AS_OBJ(value))
+#define AS_MAP(value)          ((ObjMap*)AS_OBJ(value))
+#define AS_NATIVE(value)       ((ObjNative*)AS_OBJ(value))
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 
@@ -32,39 +39,166 @@ typedef enum {
   OBJ_CLOSURE,
   OBJ_FUNCTION,
   OBJ_INSTANCE,
+  OBJ_LIST,
+  OBJ_MAP,
   OBJ_NATIVE,
+  OBJ_ROPE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_UPVALUE
 } ObjType;
 
+// An object is marked when its mark matches the VM's markValue.
+// Survivors of a collection stay marked, which is what makes them old.
+#if COMPACT_OBJECTS
+// The next object in its list takes the low 48 bits, which is all of an
+// address that's used, with the GC's bits and the type above. The type
+// has the top byte to itself so reading it is a single load.
+#define OBJ_NEXT_MASK      ((UINT64_C(1) << 48) - 1)
+#define OBJ_MARKED_BIT     (UINT64_C(1) << 48)
+#define OBJ_REMEMBERED_BIT (UINT64_C(1) << 49)
+#define OBJ_TYPE_SHIFT     56
+
+struct Obj {
+  uint64_t header;
+};
+
+static inline ObjType objType(Obj* object) {
+  return (ObjType)(object->header >> OBJ_TYPE_SHIFT);
+}
+
+static inline Obj* objNext(Obj* object) {
+  return (Obj*)(uintptr_t)(object->header & OBJ_NEXT_MASK);
+}
+
+static inline void setObjNext(Obj* object, Obj* next) {
+  object->header = (object->header & ~OBJ_NEXT_MASK) |
+                   (uint64_t)(uintptr_t)next;
+}
+
+static inline bool objMark(Obj* object) {
+  return (object->header & OBJ_MARKED_BIT) != 0;
+}
+
+static inline void setObjMark(Obj* object, bool mark) {
+  object->header = mark ? object->header | OBJ_MARKED_BIT
+                        : object->header & ~OBJ_MARKED_BIT;
+}
+
+static inline bool isRemembered(Obj* object) {
+  return (object->header & OBJ_REMEMBERED_BIT) != 0;
+}
+
+static inline void setRemembered(Obj* object, bool remembered) {
+  object->header = remembered ? object->header | OBJ_REMEMBERED_BIT
+                              : object->header & ~OBJ_REMEMBERED_BIT;
+}
+
+static inline void initObjHeader(Obj* object, ObjType type, bool mark,
+                                 Obj* next) {
+  object->header = ((uint64_t)type << OBJ_TYPE_SHIFT) |
+                   (mark ? OBJ_MARKED_BIT : 0) |
+                   (uint64_t)(uintptr_t)next;
+}
+#else
 struct Obj {
-  ObjType type;
-  bool isMarked;
   struct Obj* next;
+  uint8_t type;
+  bool isMarked;
+  bool isRemembered;
 };
 
+static inline ObjType objType(Obj* object) {
+  return (ObjType)object->type;
+}
+
+static inline Obj* objNext(Obj* object) { return object->next; }
+
+static inline void setObjNext(Obj* object, Obj* next) {
+  object->next = next;
+}
+
+static inline bool objMark(Obj* object) { return object->isMarked; }
+
+static inline void setObjMark(Obj* object, bool mark) {
+  object->isMarked = mark;
+}
+
+static inline bool isRemembered(Obj* object) {
+  return object->isRemembered;
+}
+
+static inline void setRemembered(Obj* object, bool remembered) {
+  object->isRemembered = remembered;
+}
+
+static inline void initObjHeader(Obj* object, ObjType type, bool mark,
+                                 Obj* next) {
+  object->type = (uint8_t)type;
+  object->isMarked = mark;
+  object->isRemembered = false;
+  object->next = next;
+}
+#endif
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  // The most locals the function has live at once.
+  int maxSlots;
   Chunk chunk;
   ObjString* name;
+  // Calls plus loop iterations so far, until it gets compiled to [jit].
+  int hotness;
+  struct Jit* jit;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+// A native gets its arguments where they are on the stack, with itself
+// in the slot right before them. It reports an error by returning
+// nativeError().
+typedef Value (*NativeFn)(VM* vm, int argCount, Value* args);
+
+// Calls with any number of arguments are passed through.
+#define NATIVE_VARIADIC -1
 
 typedef struct {
   Obj obj;
   NativeFn function;
+  // The argument count checked before every call.
+  int arity;
+  // Whatever the native was defined with, the GC doesn't look at it.
+  void* context;
 } ObjNative;
 
+// The context of the native that's being called with [args].
+#define NATIVE_CONTEXT(args) (AS_NATIVE((args)[-1])->context)
+
+// The characters are stored inline right after the header, so strings
+// take a single allocation.
 struct ObjString {
   Obj obj;
   int length;
-  char* chars;
   uint32_t hash;
+  char chars[];
 };
 
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
+
+// Concatenations at least this long build a rope instead of copying.
+#define ROPE_MIN_LENGTH 64
+
+// A string built by concatenation that hasn't been flattened yet. The
+// pieces are strings or other ropes, once flattened [flat] holds the
+// interned string and the pieces are dropped.
+typedef struct {
+  Obj obj;
+  int length;
+  Obj* left;
+  Obj* right;
+  ObjString* flat;
+} ObjRope;
+
 typedef struct ObjUpvalue {
   Obj obj;
   Value* location;
@@ -76,6 +210,10 @@ typedef struct {
   Obj obj;
   ObjFunction* function;
   ObjUpvalue** upvalues;
+  // Upvalues for variables captured by value live here instead of on
+  // the heap, in the same allocation as [upvalues]. NULL if the closure
+  // has none.
+  ObjUpvalue* values;
   int upvalueCount;
 } ObjClosure;
 
@@ -83,12 +221,31 @@ typedef struct {
   Obj obj;
   ObjString* name;
   Table methods;
+  ObjShape* rootShape;
+  // The "init" method, looked up once when it's defined or inherited.
+  ObjClosure* initializer;
 } ObjClass;
 
+// A hidden class describing the layout of an instance's fields. Every
+// class owns a tree of shapes rooted at an empty shape, adding a field
+// to an instance moves it along the transition keyed by the field name,
+// so instances that gain the same fields in the same order share the
+// same shape and store each field at the same slot.
+struct ObjShape {
+  Obj obj;
+  ObjClass* klass;
+  ObjShape* parent;
+  ObjString* name;
+  int fieldCount;
+  Table transitions;
+};
+
 typedef struct {
   Obj obj;
   ObjClass* klass;
-  Table fields;
+  ObjShape* shape;
+  Value* fields;
+  int fieldCapacity;
 } ObjInstance;
 
 typedef struct {
@@ -97,20 +254,52 @@ typedef struct {
   ObjClosure* method;
 } ObjBoundMethod;
 
-ObjBoundMethod* newBoundMethod(Value receiver,
+typedef struct {
+  Obj obj;
+  ValueArray items;
+} ObjList;
+
+typedef struct {
+  Obj obj;
+  ValueTable table;
+} ObjMap;
+
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver,
                                ObjClosure* method);
-ObjClass* newClass(ObjString* name);
-ObjClosure* newClosure(ObjFunction* function);
-ObjFunction* newFunction(void);
-ObjInstance* newInstance(ObjClass* klass);
-ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);
-ObjUpvalue* newUpvalue(Value* slot);
-void printObject(Value value);
+ObjClass* newClass(VM* vm, ObjString* name);
+ObjClosure* newClosure(VM* vm, ObjFunction* function, bool hasValues);
+size_t closureUpvaluesSize(ObjClosure* closure);
+bool isValueCapture(ObjClosure* closure, ObjUpvalue* upvalue);
+ObjFunction* newFunction(VM* vm);
+ObjInstance* newInstance(VM* vm, ObjClass* klass);
+ObjList* newList(VM* vm);
+ObjMap* newMap(VM* vm);
+ObjNative* newNative(VM* vm, NativeFn function, int arity, void* context);
+ObjRope* newRope(VM* vm, Obj* left, Obj* right, int length);
+ObjString* flattenRope(VM* vm, ObjRope* rope);
+ObjShape* newShape(VM* vm, ObjClass* klass, ObjShape* parent,
+                   ObjString* name);
+int shapeLookup(ObjShape* shape, ObjString* name);
+ObjShape* shapeTransition(VM* vm, ObjShape* shape, ObjString* name);
+void instanceSetShape(VM* vm, ObjInstance* instance, ObjShape* shape);
+ObjString* takeString(VM* vm, char* chars, int length);
+ObjString* copyString(VM* vm, const char* chars, int length);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot);
+void printObject(VM* vm, Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
-  return IS_OBJ(value) && AS_OBJ(value)->type == type;
+  return IS_OBJ(value) && objType(AS_OBJ(value)) == type;
+}
+
+// Strings and ropes, both work anywhere a string is expected.
+static inline bool isStringLike(Value value) {
+  return IS_OBJ(value) && (objType(AS_OBJ(value)) == OBJ_STRING ||
+                           objType(AS_OBJ(value)) == OBJ_ROPE);
+}
+
+static inline int stringLength(Value value) {
+  return IS_ROPE(value) ? AS_ROPE(value)->length
+                        : AS_STRING(value)->length;
 }
 
 #endif
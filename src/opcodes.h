@@ -36,3 +36,47 @@ OPCODE(RETURN)
 OPCODE(CLASS)
 OPCODE(INHERIT)
 OPCODE(METHOD)
+OPCODE(SET_LOCAL_POP)
+OPCODE(ADD_RR)
+OPCODE(INCREMENT_LOCAL)
+OPCODE(LESS_LOCAL_CONSTANT_JUMP)
+OPCODE(GREATER_LOCAL_CONSTANT_JUMP)
+OPCODE(JUMP_IF_FALSE_POP)
+OPCODE(GET_LOCAL_PROPERTY)
+OPCODE(TAIL_CALL)
+OPCODE(TAIL_INVOKE)
+OPCODE(ADD_NUMBER)
+OPCODE(ADD_STRING)
+OPCODE(SUBTRACT_NUMBER)
+OPCODE(MULTIPLY_NUMBER)
+OPCODE(DIVIDE_NUMBER)
+OPCODE(GREATER_NUMBER)
+OPCODE(LESS_NUMBER)
+OPCODE(WIDE)
+OPCODE(BUILD_LIST)
+OPCODE(EXTEND_LIST)
+OPCODE(BUILD_MAP)
+OPCODE(EXTEND_MAP)
+OPCODE(GET_INDEX)
+OPCODE(SET_INDEX)
+OPCODE(ADD_RK)
+OPCODE(SUBTRACT_RR)
+OPCODE(SUBTRACT_RK)
+OPCODE(MULTIPLY_RR)
+OPCODE(MULTIPLY_RK)
+OPCODE(DIVIDE_RR)
+OPCODE(DIVIDE_RK)
+OPCODE(LESS_RR)
+OPCODE(LESS_RK)
+OPCODE(GREATER_RR)
+OPCODE(GREATER_RK)
+OPCODE(STORE_ADD_RR)
+OPCODE(STORE_ADD_RK)
+OPCODE(STORE_SUBTRACT_RR)
+OPCODE(STORE_SUBTRACT_RK)
+OPCODE(STORE_MULTIPLY_RR)
+OPCODE(STORE_MULTIPLY_RK)
+OPCODE(STORE_DIVIDE_RR)
+OPCODE(STORE_DIVIDE_RK)
+OPCODE(MOVE)
+OPCODE(LOADK)
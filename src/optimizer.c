@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimizer.h"
+
+// The longest sequence a superinstruction replaces.
+#define MAX_WINDOW 5
+
+// A jump that has to be re-patched once the code has been compacted.
+typedef struct {
+  int operand; // New offset of the 16-bit jump operand.
+  int target;  // Old offset of the instruction it lands on.
+} Jump;
+
+static bool isJump(uint8_t instruction) {
+  return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+         instruction == OP_LOOP;
+}
+
+static int jumpTarget(Chunk* chunk, int offset) {
+  uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) |
+                             chunk->code[offset + 2]);
+  if (chunk->code[offset] == OP_LOOP) return offset + 3 - jump;
+  return offset + 3 + jump;
+}
+
+// A conditional jump followed by the POP of its condition can pop in
+// both directions if the jump lands on a POP as well, which it skips.
+static bool popsCondition(Chunk* chunk, int jump, int next) {
+  return chunk->code[next] == OP_POP &&
+         chunk->code[jumpTarget(chunk, jump)] == OP_POP;
+}
+
+// Fuses common instruction sequences into superinstructions. The code
+// is compacted in place, each fused sequence only ever gets shorter,
+// and every jump is re-patched to the new offset of its target
+// afterwards. Sequences never span a jump target.
+void optimizeChunk(Chunk* chunk) {
+  int count = chunk->count;
+  uint8_t* code = chunk->code;
+  Value* constants = chunk->constants.values;
+
+  bool* targets = (bool*)calloc(count + 1, sizeof(bool));
+  int* moved = (int*)malloc(sizeof(int) * (count + 1));
+  Jump* jumps = (Jump*)malloc(sizeof(Jump) * (count / 3 + 1));
+  if (targets == NULL || moved == NULL || jumps == NULL) exit(1);
+  int jumpCount = 0;
+
+  // The line table is rebuilt as the code moves, it can only end up
+  // with fewer runs so it's rewritten in place from a copy.
+  int lineCount = chunk->lineCount;
+  LineStart* lines = (LineStart*)malloc(sizeof(LineStart) * lineCount);
+  if (lineCount > 0 && lines == NULL) exit(1);
+  memcpy(lines, chunk->lines, sizeof(LineStart) * lineCount);
+  chunk->lineCount = 0;
+  int run = 0;
+
+  for (int offset = 0; offset < count;
+       offset += instructionLength(chunk, offset)) {
+    if (isJump(code[offset])) targets[jumpTarget(chunk, offset)] = true;
+  }
+
+  int read = 0;
+  int write = 0;
+  while (read < count) {
+    int at[MAX_WINDOW];
+    int size = 0;
+    for (int offset = read; size < MAX_WINDOW && offset < count;
+         size++) {
+      if (size > 0 && targets[offset]) break;
+      at[size] = offset;
+      offset += instructionLength(chunk, offset);
+    }
+
+#define OP(i) ((i) < size ? code[at[i]] : -1)
+#define ARG(i, n) (code[at[i] + (n)])
+#define NUMBER_ARG(i) IS_NUMBER(constants[ARG(i, 1)])
+
+    uint8_t out[MAX_WINDOW];
+    int length = 0;
+    int last = -1;
+    int jump = -1;
+    int target = 0;
+
+    if (OP(0) == OP_GET_LOCAL && OP(1) == OP_CONSTANT &&
+        NUMBER_ARG(1) && OP(2) == OP_ADD && OP(3) == OP_SET_LOCAL &&
+        ARG(3, 1) == ARG(0, 1) && OP(4) == OP_POP) {
+      // i = i + 1;
+      out[0] = OP_INCREMENT_LOCAL;
+      out[1] = ARG(0, 1);
+      out[2] = ARG(1, 1);
+      length = 3;
+      last = 4;
+    } else if (OP(0) == OP_GET_LOCAL && OP(1) == OP_CONSTANT &&
+               NUMBER_ARG(1) && (OP(2) == OP_LESS || OP(2) == OP_GREATER) &&
+               OP(3) == OP_JUMP_IF_FALSE && size > 4 &&
+               popsCondition(chunk, at[3], at[4])) {
+      // while (i < 10) ...
+      out[0] = OP(2) == OP_LESS
+          ? OP_LESS_LOCAL_CONSTANT_JUMP : OP_GREATER_LOCAL_CONSTANT_JUMP;
+      out[1] = ARG(0, 1);
+      out[2] = ARG(1, 1);
+      length = 5;
+      last = 4;
+      jump = 3;
+      target = jumpTarget(chunk, at[3]) + 1;
+    } else if ((OP(0) == OP_LESS_RK || OP(0) == OP_GREATER_RK) &&
+               IS_NUMBER(constants[ARG(0, 2)]) &&
+               OP(1) == OP_JUMP_IF_FALSE && size > 2 &&
+               popsCondition(chunk, at[1], at[2])) {
+      // The same loop condition compiled to a register instruction.
+      out[0] = OP(0) == OP_LESS_RK
+          ? OP_LESS_LOCAL_CONSTANT_JUMP : OP_GREATER_LOCAL_CONSTANT_JUMP;
+      out[1] = ARG(0, 1);
+      out[2] = ARG(0, 2);
+      length = 5;
+      last = 2;
+      jump = 3;
+      target = jumpTarget(chunk, at[1]) + 1;
+    } else if (OP(0) == OP_GET_LOCAL && OP(1) == OP_GET_LOCAL &&
+               OP(2) == OP_ADD) {
+      out[0] = OP_ADD_RR;
+      out[1] = ARG(0, 1);
+      out[2] = ARG(1, 1);
+      length = 3;
+      last = 2;
+    } else if (OP(0) == OP_GET_LOCAL && OP(1) == OP_GET_PROPERTY) {
+      // this.field
+      out[0] = OP_GET_LOCAL_PROPERTY;
+      out[1] = ARG(0, 1);
+      memcpy(out + 2, &ARG(1, 1), 3);
+      length = 5;
+      last = 1;
+    } else if (OP(0) == OP_CALL && OP(1) == OP_RETURN) {
+      // return f(x);
+      out[0] = OP_TAIL_CALL;
+      out[1] = ARG(0, 1);
+      length = 2;
+      last = 1;
+    } else if (OP(0) == OP_INVOKE && OP(1) == OP_RETURN) {
+      // return this.method(x);
+      out[0] = OP_TAIL_INVOKE;
+      memcpy(out + 1, &ARG(0, 1), 4);
+      length = 5;
+      last = 1;
+    } else if (OP(0) == OP_SET_LOCAL && OP(1) == OP_POP) {
+      out[0] = OP_SET_LOCAL_POP;
+      out[1] = ARG(0, 1);
+      length = 2;
+      last = 1;
+    } else if (OP(0) == OP_JUMP_IF_FALSE && size > 1 &&
+               popsCondition(chunk, at[0], at[1])) {
+      out[0] = OP_JUMP_IF_FALSE_POP;
+      length = 3;
+      last = 1;
+      jump = 1;
+      target = jumpTarget(chunk, at[0]) + 1;
+    }
+
+#undef OP
+#undef ARG
+#undef NUMBER_ARG
+
+    while (run + 1 < lineCount && lines[run + 1].offset <= read) run++;
+    int line = lines[run].line;
+    if (chunk->lineCount == 0 ||
+        chunk->lines[chunk->lineCount - 1].line != line) {
+      chunk->lines[chunk->lineCount].offset = write;
+      chunk->lines[chunk->lineCount].line = line;
+      chunk->lineCount++;
+    }
+
+    int consumed;
+    if (last == -1) {
+      // Nothing to fuse, move the instruction over as it is.
+      length = instructionLength(chunk, read);
+      if (isJump(code[read])) {
+        jump = 1;
+        target = jumpTarget(chunk, read);
+      }
+      memmove(code + write, code + read, length);
+      consumed = length;
+    } else {
+      consumed = at[last] + instructionLength(chunk, at[last]) - read;
+      memcpy(code + write, out, length);
+    }
+
+    if (jump != -1) {
+      jumps[jumpCount].operand = write + jump;
+      jumps[jumpCount].target = target;
+      jumpCount++;
+    }
+
+    for (int i = 0; i < consumed; i++) {
+      moved[read + i] = write;
+    }
+
+    read += consumed;
+    write += length;
+  }
+
+  moved[count] = write;
+  chunk->count = write;
+
+  for (int i = 0; i < jumpCount; i++) {
+    int operand = jumps[i].operand;
+    int distance = abs(moved[jumps[i].target] - (operand + 2));
+    code[operand] = (distance >> 8) & 0xff;
+    code[operand + 1] = distance & 0xff;
+  }
+
+  free(lines);
+  free(targets);
+  free(moved);
+  free(jumps);
+}
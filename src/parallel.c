@@ -0,0 +1,274 @@
+#include <stdlib.h>
+
+#include "parallel.h"
+#include "vm.h"
+
+#if PARALLEL_GC
+#include <pthread.h>
+#include <sched.h>
+
+// A worker with more gray objects than this hands half of them over
+// even if nobody is waiting for work yet.
+#define GRAY_SHARE_THRESHOLD 64
+
+typedef struct {
+  Obj** items;
+  int count;
+  int capacity;
+} GrayStack;
+
+typedef struct {
+  // Only ever touched by the worker itself.
+  GrayStack local;
+  // What the others can steal, guarded by [lock].
+  pthread_mutex_t lock;
+  GrayStack shared;
+  // Read without the lock to skip workers there's nothing to steal from.
+  int sharedCount;
+} GrayWorker;
+
+typedef struct {
+  GCWorkers* workers;
+  int index;
+} WorkerStart;
+
+struct GCWorkers {
+  VM* vm;
+  // Worker 0 is the thread that runs the collection.
+  int count;
+  pthread_t* threads;
+  WorkerStart* starts;
+  GrayWorker* gray;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  int generation;
+  int running;
+  bool quit;
+  GCTask task;
+  void* data;
+
+  // How many workers found nothing to do, marking is over once all of
+  // them have.
+  int idle;
+};
+
+static void pushStack(GrayStack* stack, Obj* object) {
+  if (stack->capacity < stack->count + 1) {
+    stack->capacity = stack->capacity < 64 ? 64 : stack->capacity * 2;
+    stack->items = (Obj**)realloc(stack->items,
+                                  sizeof(Obj*) * stack->capacity);
+    if (stack->items == NULL) exit(1);
+  }
+
+  stack->items[stack->count++] = object;
+}
+
+// Moves the top half of [from] over to [to].
+static void moveHalf(GrayStack* from, GrayStack* to) {
+  int half = (from->count + 1) / 2;
+  for (int i = from->count - half; i < from->count; i++) {
+    pushStack(to, from->items[i]);
+  }
+  from->count -= half;
+}
+
+static void* workerMain(void* argument) {
+  WorkerStart* start = (WorkerStart*)argument;
+  GCWorkers* workers = start->workers;
+
+  int seen = 0;
+  pthread_mutex_lock(&workers->lock);
+  for (;;) {
+    while (workers->generation == seen && !workers->quit) {
+      pthread_cond_wait(&workers->wake, &workers->lock);
+    }
+    if (workers->quit) break;
+
+    seen = workers->generation;
+    GCTask task = workers->task;
+    void* data = workers->data;
+    pthread_mutex_unlock(&workers->lock);
+
+    task(workers->vm, data, start->index);
+
+    pthread_mutex_lock(&workers->lock);
+    if (--workers->running == 0) pthread_cond_signal(&workers->done);
+  }
+  pthread_mutex_unlock(&workers->lock);
+  return NULL;
+}
+
+static GCWorkers* startWorkers(VM* vm, int count) {
+  GCWorkers* workers = (GCWorkers*)calloc(1, sizeof(GCWorkers));
+  if (workers == NULL) exit(1);
+  workers->vm = vm;
+  workers->count = count;
+  workers->threads = (pthread_t*)calloc(count, sizeof(pthread_t));
+  workers->starts = (WorkerStart*)calloc(count, sizeof(WorkerStart));
+  workers->gray = (GrayWorker*)calloc(count, sizeof(GrayWorker));
+  if (workers->threads == NULL || workers->starts == NULL ||
+      workers->gray == NULL) {
+    exit(1);
+  }
+
+  pthread_mutex_init(&workers->lock, NULL);
+  pthread_cond_init(&workers->wake, NULL);
+  pthread_cond_init(&workers->done, NULL);
+  for (int i = 0; i < count; i++) {
+    pthread_mutex_init(&workers->gray[i].lock, NULL);
+  }
+
+  for (int i = 1; i < count; i++) {
+    workers->starts[i].workers = workers;
+    workers->starts[i].index = i;
+    if (pthread_create(&workers->threads[i], NULL, workerMain,
+                       &workers->starts[i]) != 0) {
+      exit(1);
+    }
+  }
+
+  return workers;
+}
+
+void runGCWorkers(VM* vm, GCTask task, void* data) {
+  if (vm->gcWorkers != NULL && vm->gcWorkers->count != vm->gcThreads) {
+    freeGCWorkers(vm);
+  }
+  if (vm->gcWorkers == NULL) {
+    vm->gcWorkers = startWorkers(vm, vm->gcThreads);
+  }
+
+  GCWorkers* workers = vm->gcWorkers;
+  pthread_mutex_lock(&workers->lock);
+  workers->task = task;
+  workers->data = data;
+  workers->idle = 0;
+  workers->running = workers->count - 1;
+  workers->generation++;
+  pthread_cond_broadcast(&workers->wake);
+  pthread_mutex_unlock(&workers->lock);
+
+  task(vm, data, 0);
+
+  pthread_mutex_lock(&workers->lock);
+  while (workers->running > 0) {
+    pthread_cond_wait(&workers->done, &workers->lock);
+  }
+  pthread_mutex_unlock(&workers->lock);
+}
+
+void freeGCWorkers(VM* vm) {
+  GCWorkers* workers = vm->gcWorkers;
+  if (workers == NULL) return;
+
+  pthread_mutex_lock(&workers->lock);
+  workers->quit = true;
+  pthread_cond_broadcast(&workers->wake);
+  pthread_mutex_unlock(&workers->lock);
+
+  for (int i = 1; i < workers->count; i++) {
+    pthread_join(workers->threads[i], NULL);
+  }
+
+  for (int i = 0; i < workers->count; i++) {
+    pthread_mutex_destroy(&workers->gray[i].lock);
+    free(workers->gray[i].local.items);
+    free(workers->gray[i].shared.items);
+  }
+  pthread_mutex_destroy(&workers->lock);
+  pthread_cond_destroy(&workers->wake);
+  pthread_cond_destroy(&workers->done);
+  free(workers->threads);
+  free(workers->starts);
+  free(workers->gray);
+  free(workers);
+  vm->gcWorkers = NULL;
+}
+
+void pushGray(GCWorkers* workers, int worker, Obj* object) {
+  GrayWorker* gray = &workers->gray[worker];
+  pushStack(&gray->local, object);
+
+  // Only hand work over when what was handed over before is gone, so
+  // the lock is rarely taken.
+  if (gray->local.count > 1 &&
+      __atomic_load_n(&gray->sharedCount, __ATOMIC_RELAXED) == 0 &&
+      (gray->local.count > GRAY_SHARE_THRESHOLD ||
+       __atomic_load_n(&workers->idle, __ATOMIC_RELAXED) > 0)) {
+    pthread_mutex_lock(&gray->lock);
+    moveHalf(&gray->local, &gray->shared);
+    __atomic_store_n(&gray->sharedCount, gray->shared.count,
+                     __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&gray->lock);
+  }
+}
+
+// Takes half of what [victim] shared into [worker]'s own stack.
+static bool steal(GCWorkers* workers, int worker, int victim) {
+  GrayWorker* from = &workers->gray[victim];
+  if (__atomic_load_n(&from->sharedCount, __ATOMIC_RELAXED) == 0) {
+    return false;
+  }
+
+  GrayWorker* to = &workers->gray[worker];
+  pthread_mutex_lock(&from->lock);
+  bool found = from->shared.count > 0;
+  if (found) {
+    // Our own shared objects are taken back whole.
+    if (victim == worker) {
+      while (from->shared.count > 0) {
+        pushStack(&to->local, from->shared.items[--from->shared.count]);
+      }
+    } else {
+      moveHalf(&from->shared, &to->local);
+    }
+    __atomic_store_n(&from->sharedCount, from->shared.count,
+                     __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&from->lock);
+  return found;
+}
+
+static bool stealAny(GCWorkers* workers, int worker) {
+  for (int i = 0; i < workers->count; i++) {
+    if (steal(workers, worker, (worker + i) % workers->count)) return true;
+  }
+  return false;
+}
+
+static bool anyShared(GCWorkers* workers) {
+  for (int i = 0; i < workers->count; i++) {
+    if (__atomic_load_n(&workers->gray[i].sharedCount,
+                        __ATOMIC_RELAXED) > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Obj* popGray(GCWorkers* workers, int worker) {
+  GrayStack* local = &workers->gray[worker].local;
+  for (;;) {
+    if (local->count > 0) return local->items[--local->count];
+    if (stealAny(workers, worker)) continue;
+
+    // A worker only goes idle with nothing of its own left, shared or
+    // not, so once they all are there's no gray object anywhere.
+    __atomic_add_fetch(&workers->idle, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n(&workers->idle, __ATOMIC_SEQ_CST) ==
+          workers->count) {
+        return NULL;
+      }
+
+      if (anyShared(workers)) {
+        __atomic_sub_fetch(&workers->idle, 1, __ATOMIC_SEQ_CST);
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+#endif
@@ -0,0 +1,28 @@
+#ifndef clox_parallel_h
+#define clox_parallel_h
+
+#include "common.h"
+#include "object.h"
+
+#if PARALLEL_GC
+typedef struct GCWorkers GCWorkers;
+
+typedef void (*GCTask)(VM* vm, void* data, int worker);
+
+// Runs [task] on [vm->gcThreads] threads, the calling one included as
+// worker 0, and returns once they're all done. The other threads are
+// started the first time and then wait for the next task.
+void runGCWorkers(VM* vm, GCTask task, void* data);
+void freeGCWorkers(VM* vm);
+
+// Every worker has its own stack of gray objects. It hands some of them
+// over to where the others can steal them from whenever it has plenty
+// or someone is out of work.
+void pushGray(GCWorkers* workers, int worker, Obj* object);
+
+// Returns the next gray object [worker] should blacken or NULL once
+// none of the workers have any left.
+Obj* popGray(GCWorkers* workers, int worker);
+#endif
+
+#endif
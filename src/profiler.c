@@ -0,0 +1,264 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profiler.h"
+#include "vm.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+#define PROFILE_MAX_LOAD 0.75
+
+// A distinct call stack, as a folded line like "script:9;fib:3", and
+// how many samples were taken in it.
+typedef struct {
+  char* stack;
+  uint32_t hash;
+  uint64_t count;
+} Sample;
+
+struct Profiler {
+  char* path;
+  int count;
+  int capacity;
+  Sample* samples;
+  // The stack being sampled is folded into this first.
+  char* buffer;
+  size_t bufferCapacity;
+};
+
+// The one piece of process wide state, and on purpose. A signal
+// handler gets nothing but the signal number, so it needs a global to
+// find what to set. It's only the profiled VM's sampleRequested flag,
+// never the VM itself, and since SIGPROF is process wide there can
+// only be one of those at a time anyway.
+static volatile sig_atomic_t* volatile sampleFlag = NULL;
+
+#ifndef _WIN32
+static void handleSignal(int signal) {
+  (void)signal;
+  volatile sig_atomic_t* flag = sampleFlag;
+  if (flag != NULL) *flag = 1;
+}
+
+static void setTimer(long microseconds) {
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = microseconds;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+#endif
+
+bool startProfiler(VM* vm, const char* path) {
+#ifdef _WIN32
+  fprintf(stderr, "Profiling needs SIGPROF, which isn't available here.\n");
+  return false;
+#else
+  if (sampleFlag != NULL) return false;
+
+  Profiler* profiler = (Profiler*)calloc(1, sizeof(Profiler));
+  if (profiler == NULL) exit(1);
+  size_t length = strlen(path);
+  profiler->path = (char*)malloc(length + 1);
+  if (profiler->path == NULL) exit(1);
+  memcpy(profiler->path, path, length + 1);
+
+  vm->profiler = profiler;
+  sampleFlag = &vm->sampleRequested;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handleSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, NULL);
+  setTimer(1000000 / PROFILE_HZ);
+  return true;
+#endif
+}
+
+static void appendFrame(Profiler* profiler, size_t* length,
+                        const char* name, int line) {
+  size_t needed = *length + strlen(name) + 16;
+  if (needed > profiler->bufferCapacity) {
+    profiler->bufferCapacity = needed * 2;
+    profiler->buffer = (char*)realloc(profiler->buffer,
+                                      profiler->bufferCapacity);
+    if (profiler->buffer == NULL) exit(1);
+  }
+
+  *length += sprintf(profiler->buffer + *length, "%s%s:%d",
+                     *length > 0 ? ";" : "", name, line);
+}
+
+static uint32_t hashStack(const char* stack, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)stack[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static Sample* findSample(Sample* samples, int capacity,
+                          const char* stack, uint32_t hash) {
+  uint32_t index = hash & (capacity - 1);
+  for (;;) {
+    Sample* sample = &samples[index];
+    if (sample->stack == NULL ||
+        (sample->hash == hash && strcmp(sample->stack, stack) == 0)) {
+      return sample;
+    }
+
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void growSamples(Profiler* profiler) {
+  int capacity = profiler->capacity < 64 ? 64 : profiler->capacity * 2;
+  Sample* samples = (Sample*)calloc(capacity, sizeof(Sample));
+  if (samples == NULL) exit(1);
+
+  for (int i = 0; i < profiler->capacity; i++) {
+    Sample* sample = &profiler->samples[i];
+    if (sample->stack == NULL) continue;
+    *findSample(samples, capacity, sample->stack, sample->hash) = *sample;
+  }
+
+  free(profiler->samples);
+  profiler->samples = samples;
+  profiler->capacity = capacity;
+}
+
+void takeSample(VM* vm) {
+  vm->sampleRequested = 0;
+  Profiler* profiler = vm->profiler;
+  if (profiler == NULL || vm->frameCount == 0) return;
+
+  size_t length = 0;
+  int first = 0;
+  if (vm->frameCount > PROFILE_MAX_DEPTH) {
+    first = vm->frameCount - PROFILE_MAX_DEPTH;
+    appendFrame(profiler, &length, "...", 0);
+  }
+
+  for (int i = first; i < vm->frameCount; i++) {
+    CallFrame* frame = &vm->frames[i];
+    ObjFunction* function = frame->closure->function;
+    int instruction = (int)(frame->ip - function->chunk.code - 1);
+    if (instruction < 0) instruction = 0;
+    appendFrame(profiler, &length,
+                function->name == NULL ? "script" : function->name->chars,
+                getLine(&function->chunk, instruction));
+  }
+
+  if (profiler->count + 1 > profiler->capacity * PROFILE_MAX_LOAD) {
+    growSamples(profiler);
+  }
+
+  uint32_t hash = hashStack(profiler->buffer, length);
+  Sample* sample = findSample(profiler->samples, profiler->capacity,
+                              profiler->buffer, hash);
+  if (sample->stack == NULL) {
+    sample->stack = (char*)malloc(length + 1);
+    if (sample->stack == NULL) exit(1);
+    memcpy(sample->stack, profiler->buffer, length + 1);
+    sample->hash = hash;
+    profiler->count++;
+  }
+  sample->count++;
+}
+
+void stopProfiler(VM* vm) {
+  Profiler* profiler = vm->profiler;
+  if (profiler == NULL) return;
+
+#ifndef _WIN32
+  // A signal that's already on its way would kill the process.
+  setTimer(0);
+  signal(SIGPROF, SIG_IGN);
+#endif
+  sampleFlag = NULL;
+  vm->profiler = NULL;
+  vm->sampleRequested = 0;
+
+  FILE* file = fopen(profiler->path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not write profile \"%s\".\n", profiler->path);
+  }
+
+  for (int i = 0; i < profiler->capacity; i++) {
+    Sample* sample = &profiler->samples[i];
+    if (sample->stack == NULL) continue;
+    if (file != NULL) {
+      fprintf(file, "%s %" PRIu64 "\n", sample->stack, sample->count);
+    }
+    free(sample->stack);
+  }
+
+  if (file != NULL) fclose(file);
+  free(profiler->samples);
+  free(profiler->buffer);
+  free(profiler->path);
+  free(profiler);
+}
+
+void printGCStats(VM* vm, FILE* out) {
+  GCStats* stats = &vm->gcStats;
+  fprintf(out, "gc: %d minor, %d major, %d slices\n",
+          stats->minorCollections, stats->majorCollections, stats->slices);
+  fprintf(out, "gc: %.3f ms paused, %.3f ms longest pause\n",
+          stats->totalPause * 1000, stats->maxPause * 1000);
+  fprintf(out, "gc: %zu bytes freed, %zu bytes peak heap\n",
+          stats->bytesFreed, stats->peakHeap);
+}
+
+#if PROFILE_OPCODES
+static const char* opcodeNames[] = {
+  #define OPCODE(op) #op,
+  #include "opcodes.h"
+  #undef OPCODE
+};
+
+void printOpcodeStats(VM* vm, FILE* out) {
+  int order[OPCODE_COUNT];
+  uint64_t total = 0;
+  uint64_t totalTicks = 0;
+  for (int i = 0; i < OPCODE_COUNT; i++) {
+    order[i] = i;
+    total += vm->opcodeCounts[i];
+    totalTicks += vm->opcodeTicks[i];
+  }
+
+  // Most executed first.
+  for (int i = 1; i < OPCODE_COUNT; i++) {
+    int opcode = order[i];
+    int j = i;
+    while (j > 0 &&
+           vm->opcodeCounts[order[j - 1]] < vm->opcodeCounts[opcode]) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = opcode;
+  }
+
+  fprintf(out, "%-28s %14s %7s %16s %9s\n",
+          "opcode", "count", "%", "ticks", "ticks/op");
+  for (int i = 0; i < OPCODE_COUNT; i++) {
+    int opcode = order[i];
+    uint64_t count = vm->opcodeCounts[opcode];
+    if (count == 0) break;
+
+    fprintf(out, "%-28s %14" PRIu64 " %6.2f%% %16" PRIu64 " %9.1f\n",
+            opcodeNames[opcode], count, 100.0 * count / total,
+            vm->opcodeTicks[opcode],
+            (double)vm->opcodeTicks[opcode] / count);
+  }
+  fprintf(out, "%-28s %14" PRIu64 " %7s %16" PRIu64 "\n",
+          "total", total, "", totalTicks);
+}
+#endif
@@ -0,0 +1,54 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "chunk.h"
+
+// How many samples a second the sampling profiler takes.
+#define PROFILE_HZ 1000
+
+// Samples of deeper call stacks only keep this many innermost frames.
+#define PROFILE_MAX_DEPTH 64
+
+typedef struct Profiler Profiler;
+
+// Starts sampling the call stack of [vm], written to [path] when the VM
+// is freed. Only one VM per process can be profiled at a time.
+bool startProfiler(VM* vm, const char* path);
+
+// Records the current call stack of [vm]. The interpreter calls this
+// at the next loop or call after the profiling timer fired.
+void takeSample(VM* vm);
+
+// Stops sampling and writes out the samples as folded stacks, one line
+// per distinct stack with how often it was seen.
+void stopProfiler(VM* vm);
+
+// Prints what gcStats() returns, for --gc-stats.
+void printGCStats(VM* vm, FILE* out);
+
+#if PROFILE_OPCODES
+// Timestamps to measure instructions with, read on every dispatch. The
+// time stamp counter on x86-64, nanoseconds elsewhere.
+#if defined(__x86_64__) && !defined(_MSC_VER)
+#include <x86intrin.h>
+
+static inline uint64_t profileTicks(void) {
+  return __rdtsc();
+}
+#else
+#include <time.h>
+
+static inline uint64_t profileTicks(void) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+#endif
+
+void printOpcodeStats(VM* vm, FILE* out);
+#endif
+
+#endif
@@ -1,21 +1,112 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-  const char* start;
-  const char* current;
-  int line;
-} Scanner;
+// A block with less room than this left isn't worth reading into.
+#define SOURCE_MIN_READ 64
+
+void initScanner(Scanner* scanner, const char* source, size_t length) {
+  scanner->start = source;
+  scanner->current = source;
+  scanner->end = source + length;
+  scanner->line = 1;
+  scanner->reader = NULL;
+  scanner->context = NULL;
+  scanner->blocks = NULL;
+  scanner->lastBlock = NULL;
+  scanner->depth = 0;
+  scanner->lastType = TOKEN_EOF;
+  scanner->hadError = false;
+}
+
+void initStreamScanner(Scanner* scanner, SourceReader reader,
+                       void* context) {
+  initScanner(scanner, NULL, 0);
+  scanner->reader = reader;
+  scanner->context = context;
+}
+
+void freeScanner(Scanner* scanner) {
+  SourceBlock* block = scanner->blocks;
+  while (block != NULL) {
+    SourceBlock* next = block->next;
+    free(block);
+    block = next;
+  }
+  scanner->blocks = NULL;
+  scanner->lastBlock = NULL;
+}
+
+void releaseSource(Scanner* scanner, const char* keep) {
+  while (scanner->blocks != scanner->lastBlock) {
+    SourceBlock* block = scanner->blocks;
+    if (keep >= block->bytes && keep < block->bytes + block->capacity) {
+      break;
+    }
+
+    scanner->blocks = block->next;
+    free(block);
+  }
+}
+
+// Whether the source so far stops between two statements.
+static bool isComplete(Scanner* scanner) {
+  if (scanner->start != scanner->current) return false;
+  if (scanner->hadError) return true;
+  return scanner->depth == 0 &&
+         (scanner->lastType == TOKEN_SEMICOLON ||
+          scanner->lastType == TOKEN_RIGHT_BRACE ||
+          scanner->lastType == TOKEN_EOF);
+}
+
+// Reads more of a streamed source until there are at least [needed]
+// bytes left to scan, returns false if it ran out first. The token
+// being scanned is moved to the start of a new block when the current
+// one is full, which leaves the tokens before it where they are.
+static bool refill(Scanner* scanner, size_t needed) {
+  while ((size_t)(scanner->end - scanner->current) < needed) {
+    if (scanner->reader == NULL) return false;
+
+    SourceBlock* block = scanner->lastBlock;
+    if (block == NULL ||
+        block->bytes + block->capacity - scanner->end < SOURCE_MIN_READ) {
+      size_t kept = (size_t)(scanner->end - scanner->start);
+      size_t capacity = SOURCE_BLOCK_SIZE;
+      while (capacity < kept + SOURCE_MIN_READ) capacity *= 2;
+
+      block = (SourceBlock*)malloc(sizeof(SourceBlock) + capacity);
+      if (block == NULL) exit(1);
+      block->next = NULL;
+      block->capacity = capacity;
+      if (kept > 0) memcpy(block->bytes, scanner->start, kept);
+
+      if (scanner->lastBlock == NULL) {
+        scanner->blocks = block;
+      } else {
+        scanner->lastBlock->next = block;
+      }
+      scanner->lastBlock = block;
+
+      scanner->current = block->bytes + (scanner->current - scanner->start);
+      scanner->start = block->bytes;
+      scanner->end = block->bytes + kept;
+    }
 
-Scanner scanner;
+    char* end = (char*)scanner->end;
+    size_t read = scanner->reader(scanner->context, end,
+                                  block->bytes + block->capacity - end,
+                                  isComplete(scanner));
+    if (read == 0) {
+      scanner->reader = NULL;
+      return false;
+    }
+    scanner->end += read;
+  }
 
-void initScanner(const char* source) {
-  scanner.start = source;
-  scanner.current = source;
-  scanner.line = 1;
+  return true;
 }
 
 static bool isAlpha(char c) {
@@ -28,66 +119,90 @@ static bool isDigit(char c) {
   return c >= '0' && c <= '9';
 }
 
-static bool isAtEnd(void) {
-  return *scanner.current == '\0';
+static bool isAtEnd(Scanner* scanner) {
+  return scanner->current == scanner->end && !refill(scanner, 1);
 }
 
-static char advance(void) {
-  scanner.current++;
-  return scanner.current[-1];
+static char advance(Scanner* scanner) {
+  scanner->current++;
+  return scanner->current[-1];
 }
 
-static char peek(void) {
-  return *scanner.current;
+static char peek(Scanner* scanner) {
+  if (isAtEnd(scanner)) return '\0';
+  return *scanner->current;
 }
 
-static char peekNext(void) {
-  if (isAtEnd()) return '\0';
-  return scanner.current[1];
+static char peekNext(Scanner* scanner) {
+  if (scanner->end - scanner->current < 2 && !refill(scanner, 2)) {
+    return '\0';
+  }
+  return scanner->current[1];
 }
 
-static bool match(char expected) {
-  if (isAtEnd()) return false;
-  if (*scanner.current != expected) return false;
-  scanner.current++;
+static bool match(Scanner* scanner, char expected) {
+  if (isAtEnd(scanner)) return false;
+  if (*scanner->current != expected) return false;
+  scanner->current++;
   return true;
 }
 
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner* scanner, TokenType type) {
   Token token;
   token.type = type;
-  token.start = scanner.start;
-  token.length = (int)(scanner.current - scanner.start);
-  token.line = scanner.line;
+  token.start = scanner->start;
+  token.length = (int)(scanner->current - scanner->start);
+  token.line = scanner->line;
+
+  switch (type) {
+    case TOKEN_LEFT_PAREN:
+    case TOKEN_LEFT_BRACE:
+    case TOKEN_LEFT_BRACKET:
+      scanner->depth++;
+      break;
+    case TOKEN_RIGHT_PAREN:
+    case TOKEN_RIGHT_BRACE:
+    case TOKEN_RIGHT_BRACKET:
+      if (scanner->depth > 0) scanner->depth--;
+      break;
+    default:
+      break;
+  }
+  scanner->lastType = type;
   return token;
 }
 
-static Token errorToken(const char* message) {
+static Token errorToken(Scanner* scanner, const char* message) {
   Token token;
   token.type = TOKEN_ERROR;
   token.start = message;
   token.length = (int)strlen(message);
-  token.line = scanner.line;
+  token.line = scanner->line;
   return token;
 }
 
-static void skipWhitespace(void) {
+static void skipWhitespace(Scanner* scanner) {
   for (;;) {
-    char c = peek();
+    // Nothing skipped needs to be kept when the source is refilled.
+    scanner->start = scanner->current;
+    char c = peek(scanner);
     switch (c) {
       case ' ':
       case '\r':
       case '\t':
-        advance();
+        advance(scanner);
         break;
       case '\n':
-        scanner.line++;
-        advance();
+        scanner->line++;
+        advance(scanner);
         break;
       case '/':
-        if (peekNext() == '/') {
+        if (peekNext(scanner) == '/') {
           // A comment goes until the end of the line.
-          while (peek() != '\n' && !isAtEnd()) advance();
+          while (peek(scanner) != '\n' && !isAtEnd(scanner)) {
+            advance(scanner);
+            scanner->start = scanner->current;
+          }
         } else {
           return;
         }
@@ -101,97 +216,99 @@ static void skipWhitespace(void) {
 
 #include "lex.def"
 
-static TokenType identifierType(void) {
-  int length = scanner.current - scanner.start;
+static TokenType identifierType(Scanner* scanner) {
+  int length = scanner->current - scanner->start;
 
-  const struct keyword *kw = checkKeyword(scanner.start, length);
+  const struct keyword *kw = checkKeyword(scanner->start, length);
   if (kw != NULL) return kw->token;
 
   return TOKEN_IDENTIFIER;
 }
 
-static Token identifier(void) {
-  while (isAlpha(peek()) || isDigit(peek())) advance();
-  return makeToken(identifierType());
+static Token identifier(Scanner* scanner) {
+  while (isAlpha(peek(scanner)) || isDigit(peek(scanner))) advance(scanner);
+  return makeToken(scanner, identifierType(scanner));
 }
 
 static bool isHex(char c) {
   return (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
 }
 
-static Token number(void) {
-  char c = scanner.current[-1];
+static Token number(Scanner* scanner) {
+  char c = scanner->current[-1];
 
   // If we see a an x after a 0, parse a hexadecimal number.
-  if (c == '0' && (peek() == 'x' || peek() == 'X')) {
-    advance(); // consume the 'x'
-    while (isDigit(peek()) || isHex(peek())) advance();
+  if (c == '0' && (peek(scanner) == 'x' || peek(scanner) == 'X')) {
+    advance(scanner); // consume the 'x'
+    while (isDigit(peek(scanner)) || isHex(peek(scanner))) advance(scanner);
   } else {
-    while (isDigit(peek())) advance();
+    while (isDigit(peek(scanner))) advance(scanner);
 
     // Look for a fractional part.
-    if (peek() == '.' && isDigit(peekNext())) {
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
       // Consume the ".".
-      advance();
+      advance(scanner);
 
-      while (isDigit(peek())) advance();
+      while (isDigit(peek(scanner))) advance(scanner);
     }
   }
 
-  return makeToken(TOKEN_NUMBER);
+  return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static Token string(void) {
-  while (peek() != '"' && !isAtEnd()) {
-    if (peek() == '\n') scanner.line++;
-    advance();
+static Token string(Scanner* scanner) {
+  while (peek(scanner) != '"' && !isAtEnd(scanner)) {
+    if (peek(scanner) == '\n') scanner->line++;
+    advance(scanner);
   }
 
-  if (isAtEnd()) return errorToken("Unterminated string.");
+  if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
   // The closing quote.
-  advance();
-  return makeToken(TOKEN_STRING);
+  advance(scanner);
+  return makeToken(scanner, TOKEN_STRING);
 }
 
-Token scanToken(void) {
-  skipWhitespace();
-  scanner.start = scanner.current;
+Token scanToken(Scanner* scanner) {
+  skipWhitespace(scanner);
+  scanner->start = scanner->current;
 
-  if (isAtEnd()) return makeToken(TOKEN_EOF);
+  if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
   
-  char c = advance();
-  if (isAlpha(c)) return identifier();
-  if (isDigit(c)) return number();
+  char c = advance(scanner);
+  if (isAlpha(c)) return identifier(scanner);
+  if (isDigit(c)) return number(scanner);
 
   switch (c) {
-    case '(': return makeToken(TOKEN_LEFT_PAREN);
-    case ')': return makeToken(TOKEN_RIGHT_PAREN);
-    case '{': return makeToken(TOKEN_LEFT_BRACE);
-    case '}': return makeToken(TOKEN_RIGHT_BRACE);
-    case ';': return makeToken(TOKEN_SEMICOLON);
-    case ',': return makeToken(TOKEN_COMMA);
-    case '.': return makeToken(TOKEN_DOT);
-    case '-': return makeToken(TOKEN_MINUS);
-    case '+': return makeToken(TOKEN_PLUS);
-    case '/': return makeToken(TOKEN_SLASH);
-    case '*': return makeToken(TOKEN_STAR);
-    case '?': return makeToken(TOKEN_QUESTION);
-    case ':': return makeToken(TOKEN_COLON);
+    case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+    case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+    case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+    case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+    case '[': return makeToken(scanner, TOKEN_LEFT_BRACKET);
+    case ']': return makeToken(scanner, TOKEN_RIGHT_BRACKET);
+    case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+    case ',': return makeToken(scanner, TOKEN_COMMA);
+    case '.': return makeToken(scanner, TOKEN_DOT);
+    case '-': return makeToken(scanner, TOKEN_MINUS);
+    case '+': return makeToken(scanner, TOKEN_PLUS);
+    case '/': return makeToken(scanner, TOKEN_SLASH);
+    case '*': return makeToken(scanner, TOKEN_STAR);
+    case '?': return makeToken(scanner, TOKEN_QUESTION);
+    case ':': return makeToken(scanner, TOKEN_COLON);
     case '!':
-      return makeToken(
-          match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+      return makeToken(scanner,
+          match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=':
-      return makeToken(
-          match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+      return makeToken(scanner,
+          match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
-      return makeToken(
-          match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+      return makeToken(scanner,
+          match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
-      return makeToken(
-          match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-    case '"': return string();
+      return makeToken(scanner,
+          match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+    case '"': return string(scanner);
   }
 
-  return errorToken("Unexpected character.");
+  return errorToken(scanner, "Unexpected character.");
 }
@@ -1,10 +1,17 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "common.h"
+
+// How big the blocks a streamed source is read into are, tokens are
+// never split across them.
+#define SOURCE_BLOCK_SIZE 16384
+
 typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR, TOKEN_COLON,
   TOKEN_QUESTION,
@@ -31,7 +38,52 @@ typedef struct {
   int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken(void);
+// Reads up to [size] more bytes of source into [buffer] and returns how
+// many it read, 0 once there's nothing left. [complete] says whether the
+// source read so far ends between two statements, so the REPL knows
+// when to stop asking for more lines.
+typedef size_t (*SourceReader)(void* context, char* buffer, size_t size,
+                               bool complete);
+
+typedef struct SourceBlock {
+  struct SourceBlock* next;
+  size_t capacity;
+  char bytes[];
+} SourceBlock;
+
+typedef struct {
+  const char* start;
+  const char* current;
+  // One past the last byte of source there is so far.
+  const char* end;
+  int line;
+
+  // Where a streamed source comes from and the blocks it's been read
+  // into, oldest first. Those stay put so tokens can point into them.
+  SourceReader reader;
+  void* context;
+  SourceBlock* blocks;
+  SourceBlock* lastBlock;
+
+  // How many brackets are open and what the last token was, to tell
+  // whether a statement is finished.
+  int depth;
+  TokenType lastType;
+  // Set by the compiler after a syntax error, there's no point reading
+  // on to the end of the statement then.
+  bool hadError;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source, size_t length);
+void initStreamScanner(Scanner* scanner, SourceReader reader,
+                       void* context);
+void freeScanner(Scanner* scanner);
+
+// Frees the blocks of a streamed source that came before the one [keep]
+// points into. Only safe between declarations at the top level, where
+// nothing else points into them anymore.
+void releaseSource(Scanner* scanner, const char* keep);
+
+Token scanToken(Scanner* scanner);
 
 #endif
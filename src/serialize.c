@@ -0,0 +1,730 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define NO_MMAP
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "memory.h"
+#include "serialize.h"
+#include "table.h"
+#include "vm.h"
+
+// A .loxc file is laid out as:
+//
+//   "LOXC", version, opcode count, hash of the source, hash of the rest
+//   string table: count, then a length and the bytes of each string
+//   global names: count, then a string index for each global slot
+//   the top level function
+//
+// A function is its arity, upvalue count, max slots and name index,
+// then its constants (nested functions inline), code, the run-length
+// encoded line table and the number of inline caches. Numbers are in
+// native byte order, the file is only meant to be read back by the
+// same build.
+#define BYTECODE_MAGIC "LOXC"
+#define BYTECODE_VERSION 4
+
+#define NO_NAME UINT32_MAX
+
+typedef enum {
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION
+} ConstantKind;
+
+static const uint32_t opcodeCount = 0
+  #define OPCODE(op) + 1
+  #include "opcodes.h"
+  #undef OPCODE
+  ;
+
+#define FNV_OFFSET UINT64_C(14695981039346656037)
+
+// 64-bit FNV-1a, continuing from [hash] so a hash can cover several
+// buffers.
+static uint64_t hashBytes(uint64_t hash, const void* bytes, size_t size) {
+  const uint8_t* data = (const uint8_t*)bytes;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= UINT64_C(1099511628211);
+  }
+  return hash;
+}
+
+uint64_t hashSource(const char* source, size_t length) {
+  return hashBytes(FNV_OFFSET, source, length);
+}
+
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+} Buffer;
+
+typedef struct {
+  Buffer strings;
+  Buffer functions;
+  Table stringIndex;
+  uint32_t stringCount;
+} Writer;
+
+static void writeBytes(Buffer* buffer, const void* bytes, size_t size) {
+  if (buffer->capacity < buffer->count + size) {
+    size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+    while (capacity < buffer->count + size) capacity *= 2;
+    buffer->bytes = (uint8_t*)realloc(buffer->bytes, capacity);
+    if (buffer->bytes == NULL) exit(1);
+    buffer->capacity = capacity;
+  }
+
+  memcpy(buffer->bytes + buffer->count, bytes, size);
+  buffer->count += size;
+}
+
+static void writeByte(Buffer* buffer, uint8_t byte) {
+  writeBytes(buffer, &byte, 1);
+}
+
+static void writeU32(Buffer* buffer, uint32_t value) {
+  writeBytes(buffer, &value, sizeof(value));
+}
+
+static uint32_t stringIndex(VM* vm, Writer* writer, ObjString* string) {
+  Value index;
+  if (tableGet(&writer->stringIndex, string, &index)) {
+    return (uint32_t)AS_NUMBER(index);
+  }
+
+  writeU32(&writer->strings, (uint32_t)string->length);
+  writeBytes(&writer->strings, string->chars, string->length);
+  tableSet(vm, &writer->stringIndex, string,
+           NUMBER_VAL((double)writer->stringCount));
+  return writer->stringCount++;
+}
+
+static void writeFunction(VM* vm, Writer* writer, ObjFunction* function) {
+  Buffer* out = &writer->functions;
+  Chunk* chunk = &function->chunk;
+
+  writeU32(out, (uint32_t)function->arity);
+  writeU32(out, (uint32_t)function->upvalueCount);
+  writeU32(out, (uint32_t)function->maxSlots);
+  writeU32(out, function->name == NULL
+      ? NO_NAME : stringIndex(vm, writer, function->name));
+
+  writeU32(out, (uint32_t)chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_NUMBER(constant)) {
+      double number = AS_NUMBER(constant);
+      writeByte(out, CONSTANT_NUMBER);
+      writeBytes(out, &number, sizeof(number));
+    } else if (IS_STRING(constant)) {
+      uint32_t index = stringIndex(vm, writer, AS_STRING(constant));
+      writeByte(out, CONSTANT_STRING);
+      writeU32(out, index);
+    } else {
+      writeByte(out, CONSTANT_FUNCTION);
+      writeFunction(vm, writer, AS_FUNCTION(constant));
+    }
+  }
+
+  writeU32(out, (uint32_t)chunk->count);
+  writeBytes(out, chunk->code, chunk->count);
+  writeU32(out, (uint32_t)chunk->lineCount);
+  writeBytes(out, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+  writeU32(out, (uint32_t)chunk->cacheCount);
+}
+
+bool writeBytecode(VM* vm, const char* path, ObjFunction* function,
+                   uint64_t sourceHash) {
+  Writer writer;
+  memset(&writer, 0, sizeof(writer));
+  initTable(&writer.stringIndex);
+
+  // Growing the index table can trigger a collection.
+  push(vm, OBJ_VAL(function));
+
+  Buffer globals = {NULL, 0, 0};
+  writeU32(&globals, (uint32_t)vm->globalNames.count);
+  for (int i = 0; i < vm->globalNames.count; i++) {
+    writeU32(&globals,
+             stringIndex(vm, &writer, AS_STRING(vm->globalNames.values[i])));
+  }
+
+  writeFunction(vm, &writer, function);
+  pop(vm);
+
+  uint64_t payloadHash = hashBytes(FNV_OFFSET, &writer.stringCount,
+                                   sizeof(uint32_t));
+  payloadHash = hashBytes(payloadHash, writer.strings.bytes,
+                          writer.strings.count);
+  payloadHash = hashBytes(payloadHash, globals.bytes, globals.count);
+  payloadHash = hashBytes(payloadHash, writer.functions.bytes,
+                          writer.functions.count);
+
+  bool ok = false;
+  FILE* file = fopen(path, "wb");
+  if (file != NULL) {
+    fwrite(BYTECODE_MAGIC, 1, 4, file);
+    uint32_t header[2] = {BYTECODE_VERSION, opcodeCount};
+    fwrite(header, sizeof(header), 1, file);
+    fwrite(&sourceHash, sizeof(sourceHash), 1, file);
+    fwrite(&payloadHash, sizeof(payloadHash), 1, file);
+    fwrite(&writer.stringCount, sizeof(uint32_t), 1, file);
+    fwrite(writer.strings.bytes, 1, writer.strings.count, file);
+    fwrite(globals.bytes, 1, globals.count, file);
+    fwrite(writer.functions.bytes, 1, writer.functions.count, file);
+    ok = ferror(file) == 0;
+    ok = fclose(file) == 0 && ok;
+  }
+
+  freeTable(vm, &writer.stringIndex);
+  free(writer.strings.bytes);
+  free(writer.functions.bytes);
+  free(globals.bytes);
+  return ok;
+}
+
+typedef struct {
+  const uint8_t* bytes;
+  size_t size;
+  size_t offset;
+  bool failed;
+
+  uint32_t stringCount;
+  size_t* stringOffsets;
+  uint32_t globalCount;
+  uint32_t* globalNames;
+  int* globalSlots;
+} Reader;
+
+static const uint8_t* readBytes(Reader* reader, size_t size) {
+  if (reader->failed || reader->size - reader->offset < size) {
+    reader->failed = true;
+    return NULL;
+  }
+
+  const uint8_t* bytes = reader->bytes + reader->offset;
+  reader->offset += size;
+  return bytes;
+}
+
+static uint32_t readU32(Reader* reader) {
+  uint32_t value = 0;
+  const uint8_t* bytes = readBytes(reader, sizeof(value));
+  if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+static uint64_t readU64(Reader* reader) {
+  uint64_t value = 0;
+  const uint8_t* bytes = readBytes(reader, sizeof(value));
+  if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+static ObjString* stringAt(VM* vm, Reader* reader, uint32_t index) {
+  if (reader->failed || index >= reader->stringCount) {
+    reader->failed = true;
+    return NULL;
+  }
+
+  // The string is copied straight out of the mapping, interning
+  // takes care of giving every use the same object.
+  size_t offset = reader->stringOffsets[index];
+  uint32_t length;
+  memcpy(&length, reader->bytes + offset, sizeof(length));
+  return copyString(vm, (const char*)reader->bytes + offset + sizeof(length),
+                    (int)length);
+}
+
+static ObjString* readString(VM* vm, Reader* reader) {
+  return stringAt(vm, reader, readU32(reader));
+}
+
+// The checksum catches a damaged file, the checks below make sure that
+// whatever made it past still can't send the VM outside its chunk, its
+// constants, its frame or the globals.
+
+static bool isConstant(Chunk* chunk, int index) {
+  return index < chunk->constants.count;
+}
+
+static bool isStringConstant(Chunk* chunk, int index) {
+  return isConstant(chunk, index) &&
+         IS_STRING(chunk->constants.values[index]);
+}
+
+static bool isNumberConstant(Chunk* chunk, int index) {
+  return isConstant(chunk, index) &&
+         IS_NUMBER(chunk->constants.values[index]);
+}
+
+static bool isCache(Chunk* chunk, int index) {
+  return index < chunk->cacheCount;
+}
+
+static bool canBeWide(OpCode op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+    case OP_METHOD:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Returns the length of the instruction at [offset] if it fits in the
+// chunk and all its operands are valid, or 0.
+static int verifyInstruction(ObjFunction* function, uint32_t globalCount,
+                             int offset) {
+  Chunk* chunk = &function->chunk;
+  int left = chunk->count - offset;
+  const uint8_t* ip = chunk->code + offset;
+
+  bool wide = ip[0] == OP_WIDE;
+  if (wide && (left < 2 || !canBeWide((OpCode)ip[1]))) return 0;
+  if (ip[wide ? 1 : 0] >= OPCODE_COUNT) return 0;
+  OpCode op = (OpCode)ip[wide ? 1 : 0];
+
+  // An instruction's length only depends on its opcode, except for a
+  // closure where it's the upvalue count of the function constant.
+  if (op == OP_CLOSURE) {
+    if (left < (wide ? 4 : 2)) return 0;
+    int constant = wide ? (ip[2] << 8) | ip[3] : ip[1];
+    if (!isConstant(chunk, constant) ||
+        !IS_FUNCTION(chunk->constants.values[constant])) {
+      return 0;
+    }
+  }
+
+  int length = instructionLength(chunk, offset);
+  if (length > left) return 0;
+
+  // Past the opcode, with the first operand taking another byte when
+  // it's wide.
+  const uint8_t* operands = ip + (wide ? 2 : 1);
+  int arg = length == 1 ? 0
+          : wide ? (operands[0] << 8) | operands[1] : operands[0];
+  const uint8_t* rest = operands + (wide ? 2 : 1);
+#define OPERAND_SHORT(at) ((at)[0] << 8 | (at)[1])
+
+  switch (op) {
+    case OP_CONSTANT:
+      return isConstant(chunk, arg) ? length : 0;
+
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      return arg < function->maxSlots ? length : 0;
+
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+      return (uint32_t)OPERAND_SHORT(operands) < globalCount ? length : 0;
+
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+      return arg < function->upvalueCount ? length : 0;
+
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+      return isStringConstant(chunk, arg) &&
+             isCache(chunk, OPERAND_SHORT(rest)) ? length : 0;
+
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_INVOKE:
+      return isStringConstant(chunk, arg) &&
+             isCache(chunk, OPERAND_SHORT(rest + 1)) ? length : 0;
+
+    case OP_CLASS:
+    case OP_METHOD:
+      return isStringConstant(chunk, arg) ? length : 0;
+
+    case OP_GET_LOCAL_PROPERTY:
+      return arg < function->maxSlots &&
+             isStringConstant(chunk, rest[0]) &&
+             isCache(chunk, OPERAND_SHORT(rest + 1)) ? length : 0;
+
+    case OP_INCREMENT_LOCAL:
+    case OP_LESS_LOCAL_CONSTANT_JUMP:
+    case OP_GREATER_LOCAL_CONSTANT_JUMP:
+      return arg < function->maxSlots &&
+             isNumberConstant(chunk, rest[0]) ? length : 0;
+
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR:
+    case OP_LESS_RR:
+    case OP_GREATER_RR:
+    case OP_MOVE:
+      return arg < function->maxSlots &&
+             rest[0] < function->maxSlots ? length : 0;
+
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK:
+    case OP_LESS_RK:
+    case OP_GREATER_RK:
+    case OP_LOADK:
+      return arg < function->maxSlots &&
+             isConstant(chunk, rest[0]) ? length : 0;
+
+    case OP_STORE_ADD_RR:
+    case OP_STORE_SUBTRACT_RR:
+    case OP_STORE_MULTIPLY_RR:
+    case OP_STORE_DIVIDE_RR:
+      return arg < function->maxSlots && rest[0] < function->maxSlots &&
+             rest[1] < function->maxSlots ? length : 0;
+
+    case OP_STORE_ADD_RK:
+    case OP_STORE_SUBTRACT_RK:
+    case OP_STORE_MULTIPLY_RK:
+    case OP_STORE_DIVIDE_RK:
+      return arg < function->maxSlots && rest[0] < function->maxSlots &&
+             isConstant(chunk, rest[1]) ? length : 0;
+
+    case OP_CLOSURE: {
+      // Each capture is a local of ours or one of our own upvalues.
+      ObjFunction* closed = AS_FUNCTION(chunk->constants.values[arg]);
+      for (int i = 0; i < closed->upvalueCount; i++) {
+        uint8_t isLocal = rest[0];
+        int index = wide ? OPERAND_SHORT(rest + 1) : rest[1];
+        if (isLocal > 2) return 0;
+        if (index >= (isLocal ? function->maxSlots
+                              : function->upvalueCount)) {
+          return 0;
+        }
+        rest += wide ? 3 : 2;
+      }
+      return length;
+    }
+
+    default:
+      return length;
+  }
+}
+
+// Where the jump at [offset] goes, or -1 if it isn't one.
+static int jumpTarget(Chunk* chunk, int offset) {
+  const uint8_t* ip = chunk->code + offset;
+  switch (ip[0]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_POP:
+      return offset + 3 + OPERAND_SHORT(ip + 1);
+    case OP_LOOP:
+      return offset + 3 - OPERAND_SHORT(ip + 1);
+    case OP_LESS_LOCAL_CONSTANT_JUMP:
+    case OP_GREATER_LOCAL_CONSTANT_JUMP:
+      return offset + 5 + OPERAND_SHORT(ip + 3);
+    default:
+      return -1;
+  }
+}
+
+#undef OPERAND_SHORT
+
+static bool verifyChunk(ObjFunction* function, uint32_t globalCount) {
+  Chunk* chunk = &function->chunk;
+  if (chunk->count == 0) return false;
+
+  // Where each instruction starts, jumps have to land on one of those.
+  bool* starts = (bool*)calloc(chunk->count, sizeof(bool));
+  if (starts == NULL) exit(1);
+
+  bool ok = true;
+  int last = 0;
+  for (int offset = 0; ok && offset < chunk->count;) {
+    int length = verifyInstruction(function, globalCount, offset);
+    starts[offset] = true;
+    last = offset;
+    ok = length > 0;
+    offset += length;
+  }
+
+  // The compiler always ends a function with a return, so running off
+  // the end can't happen.
+  if (ok && chunk->code[last] != OP_RETURN) ok = false;
+
+  for (int offset = 0; ok && offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    int target = jumpTarget(chunk, offset);
+    if (target != -1 &&
+        (target < 0 || target >= chunk->count || !starts[target])) {
+      ok = false;
+    }
+  }
+
+  free(starts);
+  return ok;
+}
+
+static ObjFunction* readFunction(VM* vm, Reader* reader) {
+  ObjFunction* function = newFunction(vm);
+  push(vm, OBJ_VAL(function));
+
+  uint32_t arity = readU32(reader);
+  uint32_t upvalueCount = readU32(reader);
+  uint32_t maxSlots = readU32(reader);
+  if (arity > UINT8_MAX || upvalueCount > UINT8_COUNT ||
+      maxSlots > STACK_MAX) {
+    reader->failed = true;
+  }
+  function->arity = (int)arity;
+  function->upvalueCount = (int)upvalueCount;
+  function->maxSlots = (int)maxSlots;
+
+  uint32_t name = readU32(reader);
+  if (name != NO_NAME) {
+    function->name = stringAt(vm, reader, name);
+    writeBarrier(vm, (Obj*)function);
+  }
+
+  Chunk* chunk = &function->chunk;
+  uint32_t constantCount = readU32(reader);
+  if (constantCount > UINT16_COUNT) reader->failed = true;
+  for (uint32_t i = 0; i < constantCount && !reader->failed; i++) {
+    const uint8_t* kind = readBytes(reader, 1);
+    if (kind == NULL) break;
+
+    Value constant = NIL_VAL;
+    switch (*kind) {
+      case CONSTANT_NUMBER: {
+        double number = 0;
+        const uint8_t* bytes = readBytes(reader, sizeof(number));
+        if (bytes != NULL) memcpy(&number, bytes, sizeof(number));
+        constant = NUMBER_VAL(number);
+        break;
+      }
+
+      case CONSTANT_STRING: {
+        ObjString* string = readString(vm, reader);
+        if (string != NULL) constant = OBJ_VAL(string);
+        break;
+      }
+
+      case CONSTANT_FUNCTION:
+        constant = OBJ_VAL(readFunction(vm, reader));
+        break;
+
+      default:
+        reader->failed = true;
+        break;
+    }
+
+    addConstant(vm, chunk, constant);
+    writeBarrier(vm, (Obj*)function);
+  }
+
+  uint32_t count = readU32(reader);
+  const uint8_t* code = readBytes(reader, count);
+  uint32_t lineCount = readU32(reader);
+  if (lineCount > count) reader->failed = true;
+  const uint8_t* lines = readBytes(reader, sizeof(LineStart) * lineCount);
+  uint32_t cacheCount = readU32(reader);
+  if (cacheCount > UINT16_COUNT) reader->failed = true;
+
+  if (!reader->failed && count > 0) {
+    chunk->code = GROW_ARRAY(vm, uint8_t, NULL, 0, count);
+    chunk->capacity = (int)count;
+    chunk->count = (int)count;
+    memcpy(chunk->code, code, count);
+  }
+
+  if (!reader->failed && lineCount > 0) {
+    chunk->lines = GROW_ARRAY(vm, LineStart, NULL, 0, lineCount);
+    chunk->lineCapacity = (int)lineCount;
+    chunk->lineCount = (int)lineCount;
+    memcpy(chunk->lines, lines, sizeof(LineStart) * lineCount);
+  }
+
+  for (uint32_t i = 0; i < cacheCount && !reader->failed; i++) {
+    addInlineCache(vm, chunk);
+  }
+
+  if (!reader->failed && !verifyChunk(function, reader->globalCount)) {
+    reader->failed = true;
+  }
+
+  pop(vm);
+  return function;
+}
+
+// Global slots are handed out as they're first seen so they can differ
+// from the run that wrote the file, point the code at the current ones.
+static void remapGlobals(Reader* reader, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    switch (chunk->code[offset]) {
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL:
+      case OP_DEFINE_GLOBAL: {
+        uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) |
+                                   chunk->code[offset + 2]);
+        int current = reader->globalSlots[slot];
+        chunk->code[offset + 1] = (current >> 8) & 0xff;
+        chunk->code[offset + 2] = current & 0xff;
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_FUNCTION(constant)) remapGlobals(reader, AS_FUNCTION(constant));
+  }
+}
+
+// Only called once the whole image checked out, so a file that turns
+// out to be bad doesn't leave globals behind in the VM.
+static bool bindGlobals(VM* vm, Reader* reader) {
+  int added = 0;
+  for (uint32_t i = 0; i < reader->globalCount; i++) {
+    ObjString* name = stringAt(vm, reader, reader->globalNames[i]);
+    Value slot;
+    if (!tableGet(&vm->globals, name, &slot)) added++;
+  }
+  if (vm->globalValues.count + added > UINT16_COUNT) return false;
+
+  for (uint32_t i = 0; i < reader->globalCount; i++) {
+    reader->globalSlots[i] =
+        globalSlot(vm, stringAt(vm, reader, reader->globalNames[i]));
+  }
+  return true;
+}
+
+static ObjFunction* readImage(VM* vm, Reader* reader, uint64_t sourceHash) {
+  const uint8_t* magic = readBytes(reader, 4);
+  if (magic == NULL || memcmp(magic, BYTECODE_MAGIC, 4) != 0) {
+    return NULL;
+  }
+
+  uint32_t version = readU32(reader);
+  uint32_t opcodes = readU32(reader);
+  uint64_t hash = readU64(reader);
+  uint64_t payloadHash = readU64(reader);
+
+  if (reader->failed || version != BYTECODE_VERSION ||
+      opcodes != opcodeCount || hash != sourceHash ||
+      payloadHash != hashBytes(FNV_OFFSET, reader->bytes + reader->offset,
+                               reader->size - reader->offset)) {
+    return NULL;
+  }
+
+  reader->stringCount = readU32(reader);
+  if (reader->failed || reader->stringCount > reader->size) return NULL;
+  reader->stringOffsets =
+      (size_t*)malloc(sizeof(size_t) * (reader->stringCount + 1));
+  if (reader->stringOffsets == NULL) exit(1);
+
+  for (uint32_t i = 0; i < reader->stringCount; i++) {
+    reader->stringOffsets[i] = reader->offset;
+    uint32_t length = readU32(reader);
+    if (length > INT32_MAX || readBytes(reader, length) == NULL) {
+      return NULL;
+    }
+  }
+
+  reader->globalCount = readU32(reader);
+  if (reader->failed || reader->globalCount > UINT16_COUNT) return NULL;
+  reader->globalNames = (uint32_t*)malloc(sizeof(uint32_t) *
+                                          (reader->globalCount + 1));
+  reader->globalSlots = (int*)malloc(sizeof(int) *
+                                     (reader->globalCount + 1));
+  if (reader->globalNames == NULL || reader->globalSlots == NULL) exit(1);
+
+  for (uint32_t i = 0; i < reader->globalCount; i++) {
+    reader->globalNames[i] = readU32(reader);
+    if (reader->failed || reader->globalNames[i] >= reader->stringCount) {
+      return NULL;
+    }
+  }
+
+  ObjFunction* function = readFunction(vm, reader);
+  if (reader->failed || reader->offset != reader->size ||
+      function->upvalueCount != 0) {
+    return NULL;
+  }
+
+  push(vm, OBJ_VAL(function));
+  bool bound = bindGlobals(vm, reader);
+  if (bound) remapGlobals(reader, function);
+  pop(vm);
+  return bound ? function : NULL;
+}
+
+ObjFunction* readBytecode(VM* vm, const char* path, uint64_t sourceHash) {
+  Reader reader;
+  memset(&reader, 0, sizeof(reader));
+
+#ifdef NO_MMAP
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+
+  fseek(file, 0L, SEEK_END);
+  reader.size = ftell(file);
+  rewind(file);
+
+  uint8_t* bytes = (uint8_t*)malloc(reader.size + 1);
+  if (bytes == NULL ||
+      fread(bytes, 1, reader.size, file) < reader.size) {
+    free(bytes);
+    fclose(file);
+    return NULL;
+  }
+  fclose(file);
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return NULL;
+
+  struct stat info;
+  if (fstat(fd, &info) == -1 || info.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  reader.size = (size_t)info.st_size;
+  void* bytes = mmap(NULL, reader.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (bytes == MAP_FAILED) return NULL;
+#endif
+
+  reader.bytes = (const uint8_t*)bytes;
+  ObjFunction* function = readImage(vm, &reader, sourceHash);
+
+  free(reader.stringOffsets);
+  free(reader.globalNames);
+  free(reader.globalSlots);
+#ifdef NO_MMAP
+  free(bytes);
+#else
+  munmap(bytes, reader.size);
+#endif
+  return function;
+}
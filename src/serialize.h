@@ -0,0 +1,11 @@
+#ifndef clox_serialize_h
+#define clox_serialize_h
+
+#include "object.h"
+
+uint64_t hashSource(const char* source, size_t length);
+bool writeBytecode(VM* vm, const char* path, ObjFunction* function,
+                   uint64_t sourceHash);
+ObjFunction* readBytecode(VM* vm, const char* path, uint64_t sourceHash);
+
+#endif
@@ -8,35 +8,44 @@
 
 #define TABLE_MAX_LOAD 0.75
 
+// Deleted keys are replaced with this, so the probe sequence going
+// through them isn't broken. It's never dereferenced.
+static uint64_t tombstoneKey;
+#define TOMBSTONE ((ObjString*)&tombstoneKey)
+
+#define TABLE_SLOT_SIZE (sizeof(ObjString*) + sizeof(Value))
+
 void initTable(Table* table) {
   table->count = 0;
   table->capacity = 0;
-  table->entries = NULL;
+  table->keys = NULL;
+  table->values = NULL;
 }
 
-void freeTable(Table* table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM* vm, Table* table) {
+  reallocate(vm, table->keys, TABLE_SLOT_SIZE * table->capacity, 0);
   initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity,
-                        ObjString* key) {
+static inline bool isLiveKey(ObjString* key) {
+  return key != NULL && key != TOMBSTONE;
+}
+
+// Returns the slot [key] is in, or the one to put it in if it isn't in
+// the table.
+static int findSlot(ObjString** keys, int capacity, ObjString* key) {
   uint32_t index = key->hash & (capacity - 1);
-  Entry* tombstone = NULL;
-  
+  int tombstone = -1;
+
   for (;;) {
-    Entry* entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // Empty entry.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // We found a tombstone.
-        if (tombstone == NULL) tombstone = entry;
-      }
-    } else if (entry->key == key) {
-      // We found the key.
-      return entry;
+    ObjString* found = keys[index];
+    if (found == key) return (int)index;
+
+    if (found == NULL) {
+      // Empty slot.
+      return tombstone != -1 ? tombstone : (int)index;
+    } else if (found == TOMBSTONE && tombstone == -1) {
+      tombstone = (int)index;
     }
 
     index = (index + 1) & (capacity - 1);
@@ -46,69 +55,65 @@ static Entry* findEntry(Entry* entries, int capacity,
 bool tableGet(Table* table, ObjString* key, Value* value) {
   if (table->count == 0) return false;
 
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  int slot = findSlot(table->keys, table->capacity, key);
+  if (table->keys[slot] != key) return false;
 
-  *value = entry->value;
+  *value = table->values[slot];
   return true;
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-  Entry* entries = ALLOCATE(Entry, capacity);
-  for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
-  }
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
+  ObjString** keys = (ObjString**)reallocate(vm, NULL, 0,
+                                             TABLE_SLOT_SIZE * capacity);
+  Value* values = (Value*)(keys + capacity);
+  for (int i = 0; i < capacity; i++) keys[i] = NULL;
 
   table->count = 0;
   for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    if (entry->key == NULL) continue;
+    ObjString* key = table->keys[i];
+    if (!isLiveKey(key)) continue;
 
-    Entry* dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
+    int slot = findSlot(keys, capacity, key);
+    keys[slot] = key;
+    values[slot] = table->values[i];
     table->count++;
   }
 
-  FREE_ARRAY(Entry, table->entries, table->capacity);
-  table->entries = entries;
+  reallocate(vm, table->keys, TABLE_SLOT_SIZE * table->capacity, 0);
+  table->keys = keys;
+  table->values = values;
   table->capacity = capacity;
 }
 
-bool tableSet(Table* table, ObjString* key, Value value) {
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
   if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
     int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
+    adjustCapacity(vm, table, capacity);
   }
 
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value)) table->count++;
+  int slot = findSlot(table->keys, table->capacity, key);
+  bool isNewKey = table->keys[slot] != key;
+  if (table->keys[slot] == NULL) table->count++;
 
-  entry->key = key;
-  entry->value = value;
+  table->keys[slot] = key;
+  table->values[slot] = value;
   return isNewKey;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
   if (table->count == 0) return false;
 
-  // Find the entry.
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  int slot = findSlot(table->keys, table->capacity, key);
+  if (table->keys[slot] != key) return false;
 
-  // Place a tombstone in the entry.
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  table->keys[slot] = TOMBSTONE;
   return true;
 }
 
-void tableAddAll(Table* from, Table* to) {
+void tableAddAll(VM* vm, Table* from, Table* to) {
   for (int i = 0; i < from->capacity; i++) {
-    Entry* entry = &from->entries[i];
-    if (entry->key != NULL) {
-      tableSet(to, entry->key, entry->value);
+    if (isLiveKey(from->keys[i])) {
+      tableSet(vm, to, from->keys[i], from->values[i]);
     }
   }
 }
@@ -119,34 +124,189 @@ ObjString* tableFindString(Table* table, const char* chars,
 
   uint32_t index = hash & (table->capacity - 1);
   for (;;) {
-    Entry* entry = &table->entries[index];
-    if (entry->key == NULL) {
-      // Stop if we find an empty non-tombstone entry.
-      if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length &&
-        entry->key->hash == hash &&
-        memcmp(entry->key->chars, chars, length) == 0) {
+    ObjString* key = table->keys[index];
+    // Stop if we find an empty non-tombstone slot.
+    if (key == NULL) return NULL;
+
+    if (key != TOMBSTONE && key->hash == hash &&
+        key->length == length &&
+        memcmp(key->chars, chars, length) == 0) {
       // We found it.
-      return entry->key;
+      return key;
     }
 
     index = (index + 1) & (table->capacity - 1);
   }
 }
 
-void tableRemoveWhite(Table* table) {
+void tableRemoveWhite(VM* vm, Table* table) {
   for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
-      tableDelete(table, entry->key);
+    ObjString* key = table->keys[i];
+    if (isLiveKey(key) && !IS_MARKED(vm, &key->obj)) {
+      table->keys[i] = TOMBSTONE;
+    }
+  }
+}
+
+void markTable(VM* vm, Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    ObjString* key = table->keys[i];
+    if (!isLiveKey(key)) continue;
+
+    markObject(vm, (Obj*)key);
+    markValue(vm, table->values[i]);
+  }
+}
+
+// Like valuesEqual(), except that NaN is a key like any other number.
+// Otherwise `map[0/0] = x` would add an entry that no lookup can find.
+static bool keysEqual(Value a, Value b) {
+  if (valuesEqual(a, b)) return true;
+  return IS_NUMBER(a) && IS_NUMBER(b) &&
+         AS_NUMBER(a) != AS_NUMBER(a) && AS_NUMBER(b) != AS_NUMBER(b);
+}
+
+static uint32_t hashValue(Value value) {
+  if (IS_STRING(value)) return AS_STRING(value)->hash;
+
+  uint64_t bits;
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    // 0 and -0 are equal so they have to be the same key, and every NaN
+    // is the same key too, see keysEqual().
+    if (number == 0) number = 0;
+    if (number != number) {
+      bits = UINT64_C(0x7ff8000000000000);
+    } else {
+      memcpy(&bits, &number, sizeof(bits));
     }
+  } else if (IS_BOUND_METHOD(value)) {
+    // Has to agree with valuesEqual(), which compares what's bound.
+    ObjBoundMethod* bound = AS_BOUND_METHOD(value);
+    bits = hashValue(bound->receiver) ^
+           (uint64_t)(uintptr_t)bound->method;
+  } else if (IS_OBJ(value)) {
+    bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+  } else {
+    bits = IS_NIL(value) ? 1 : AS_BOOL(value) ? 2 : 3;
   }
+
+  // Mix the bits so numbers that only differ in their high bits don't
+  // all end up in the same bucket.
+  bits ^= bits >> 33;
+  bits *= UINT64_C(0xff51afd7ed558ccd);
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+void initValueTable(ValueTable* table) {
+  table->count = 0;
+  table->liveCount = 0;
+  table->capacity = 0;
+  table->entries = NULL;
+}
+
+void freeValueTable(VM* vm, ValueTable* table) {
+  FREE_ARRAY(vm, ValueEntry, table->entries, table->capacity);
+  initValueTable(table);
+}
+
+static ValueEntry* findValueEntry(ValueEntry* entries, int capacity,
+                                  Value key) {
+  uint32_t index = hashValue(key) & (capacity - 1);
+  ValueEntry* tombstone = NULL;
+
+  for (;;) {
+    ValueEntry* entry = &entries[index];
+    if (IS_UNDEFINED(entry->key)) {
+      if (IS_NIL(entry->value)) {
+        // Empty entry.
+        return tombstone != NULL ? tombstone : entry;
+      } else {
+        // We found a tombstone.
+        if (tombstone == NULL) tombstone = entry;
+      }
+    } else if (keysEqual(entry->key, key)) {
+      // We found the key.
+      return entry;
+    }
+
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+bool valueTableGet(ValueTable* table, Value key, Value* value) {
+  if (table->count == 0) return false;
+
+  ValueEntry* entry = findValueEntry(table->entries, table->capacity,
+                                     key);
+  if (IS_UNDEFINED(entry->key)) return false;
+
+  *value = entry->value;
+  return true;
+}
+
+static void adjustValueCapacity(VM* vm, ValueTable* table, int capacity) {
+  ValueEntry* entries = ALLOCATE(vm, ValueEntry, capacity);
+  for (int i = 0; i < capacity; i++) {
+    entries[i].key = UNDEFINED_VAL;
+    entries[i].value = NIL_VAL;
+  }
+
+  table->count = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    ValueEntry* entry = &table->entries[i];
+    if (IS_UNDEFINED(entry->key)) continue;
+
+    ValueEntry* dest = findValueEntry(entries, capacity, entry->key);
+    dest->key = entry->key;
+    dest->value = entry->value;
+    table->count++;
+  }
+
+  FREE_ARRAY(vm, ValueEntry, table->entries, table->capacity);
+  table->entries = entries;
+  table->capacity = capacity;
+}
+
+bool valueTableSet(VM* vm, ValueTable* table, Value key, Value value) {
+  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+    int capacity = GROW_CAPACITY(table->capacity);
+    adjustValueCapacity(vm, table, capacity);
+  }
+
+  ValueEntry* entry = findValueEntry(table->entries, table->capacity,
+                                     key);
+  bool isNewKey = IS_UNDEFINED(entry->key);
+  if (isNewKey) {
+    if (IS_NIL(entry->value)) table->count++;
+    table->liveCount++;
+  }
+
+  entry->key = key;
+  entry->value = value;
+  return isNewKey;
+}
+
+bool valueTableDelete(ValueTable* table, Value key) {
+  if (table->count == 0) return false;
+
+  // Find the entry.
+  ValueEntry* entry = findValueEntry(table->entries, table->capacity,
+                                     key);
+  if (IS_UNDEFINED(entry->key)) return false;
+
+  // Place a tombstone in the entry.
+  entry->key = UNDEFINED_VAL;
+  entry->value = BOOL_VAL(true);
+  table->liveCount--;
+  return true;
 }
 
-void markTable(Table* table) {
+void markValueTable(VM* vm, ValueTable* table) {
   for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    markObject((Obj*)entry->key);
-    markValue(entry->value);
+    ValueEntry* entry = &table->entries[i];
+    markValue(vm, entry->key);
+    markValue(vm, entry->value);
   }
 }
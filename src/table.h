@@ -4,27 +4,48 @@
 #include "common.h"
 #include "value.h"
 
-typedef struct {
-  ObjString* key;
-  Value value;
-} Entry;
-
+// The keys are kept apart from the values, so probing only ever walks
+// an array of pointers. Both arrays share one allocation.
 typedef struct {
   int count;
   int capacity;
-  Entry* entries;
+  ObjString** keys;
+  Value* values;
 } Table;
 
 void initTable(Table* table);
-void freeTable(Table* table);
+void freeTable(VM* vm, Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
-bool tableSet(Table* table, ObjString* key, Value value);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
-void tableAddAll(Table* from, Table* to);
+void tableAddAll(VM* vm, Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash);
 
-void tableRemoveWhite(Table* table);
-void markTable(Table* table);
+void tableRemoveWhite(VM* vm, Table* table);
+void markTable(VM* vm, Table* table);
+
+// The same open addressing scheme but keyed by any value, keys are
+// compared with valuesEqual(). Empty entries and tombstones both have
+// an undefined key, [count] includes the tombstones while [liveCount]
+// is the number of keys actually in the table.
+typedef struct {
+  Value key;
+  Value value;
+} ValueEntry;
+
+typedef struct {
+  int count;
+  int liveCount;
+  int capacity;
+  ValueEntry* entries;
+} ValueTable;
+
+void initValueTable(ValueTable* table);
+void freeValueTable(VM* vm, ValueTable* table);
+bool valueTableGet(ValueTable* table, Value key, Value* value);
+bool valueTableSet(VM* vm, ValueTable* table, Value key, Value value);
+bool valueTableDelete(ValueTable* table, Value key);
+void markValueTable(VM* vm, ValueTable* table);
 
 #endif
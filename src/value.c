@@ -11,11 +11,11 @@ void initValueArray(ValueArray* array) {
   array->count = 0;
 }
 
-void writeValueArray(ValueArray* array, Value value) {
+void writeValueArray(VM* vm, ValueArray* array, Value value) {
   if (array->capacity < array->count + 1) {
     int oldCapacity = array->capacity;
     array->capacity = GROW_CAPACITY(oldCapacity);
-    array->values = GROW_ARRAY(Value, array->values,
+    array->values = GROW_ARRAY(vm, Value, array->values,
                                oldCapacity, array->capacity);
   }
   
@@ -23,13 +23,13 @@ void writeValueArray(ValueArray* array, Value value) {
   array->count++;
 }
 
-void freeValueArray(ValueArray* array) {
-  FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM* vm, ValueArray* array) {
+  FREE_ARRAY(vm, Value, array->values, array->capacity);
   initValueArray(array);
 }
 
-void printValue(Value value) {
-#ifdef NAN_BOXING
+void printValue(VM* vm, Value value) {
+#if NAN_BOXING
   if (IS_BOOL(value)) {
     printf(AS_BOOL(value) ? "true" : "false");
   } else if (IS_NIL(value)) {
@@ -37,7 +37,7 @@ void printValue(Value value) {
   } else if (IS_NUMBER(value)) {
     printf("%g", AS_NUMBER(value));
   } else if (IS_OBJ(value)) {
-    printObject(value);
+    printObject(vm, value);
   }
 #else
   switch (value.type) {
@@ -46,24 +46,37 @@ void printValue(Value value) {
       break;
     case VAL_NIL: printf("nil"); break;
     case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-    case VAL_OBJ: printObject(value); break;
+    case VAL_OBJ: printObject(vm, value); break;
+    case VAL_UNDEFINED: printf("undefined"); break;
   }
 #endif
 }
 
+// Reading a method twice can make two bound methods, or the same one
+// out of the VM's cache, so they're equal when they bind the same
+// method to the same receiver.
+static bool sameBoundMethod(Value a, Value b) {
+  if (!IS_BOUND_METHOD(a) || !IS_BOUND_METHOD(b)) return false;
+  ObjBoundMethod* x = AS_BOUND_METHOD(a);
+  ObjBoundMethod* y = AS_BOUND_METHOD(b);
+  return x->method == y->method && valuesEqual(x->receiver, y->receiver);
+}
+
 bool valuesEqual(Value a, Value b) {
-#ifdef NAN_BOXING
+#if NAN_BOXING
   if (IS_NUMBER(a) && IS_NUMBER(b)) {
     return AS_NUMBER(a) == AS_NUMBER(b);
   }
-  return a == b;
+  return a == b || sameBoundMethod(a, b);
 #else
   if (a.type != b.type) return false;
   switch (a.type) {
     case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:    return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-    case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_OBJ:
+      return AS_OBJ(a) == AS_OBJ(b) || sameBoundMethod(a, b);
+    case VAL_UNDEFINED: return true;
     default:         return false; // Unreachable.
   }
 #endif
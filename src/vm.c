@@ -7,53 +7,148 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
+#include "parallel.h"
+#include "profiler.h"
 #include "vm.h"
 
-VM vm;
 
-static Value clockNative(int argCount, Value* args) {
+static Value clockNative(VM* vm, int argCount, Value* args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static Value exitNative(int argCount, Value* args) {
-  freeVM();
+static Value exitNative(VM* vm, int argCount, Value* args) {
+  freeVM(vm);
   exit(0);
 
   return NIL_VAL;
 }
 
-static Value gcNative(int argCount, Value* args) {
-  int before = vm.bytesAllocated;
-  collectGarbage();
+static Value gcNative(VM* vm, int argCount, Value* args) {
+  int before = vm->bytesAllocated;
+  collectGarbage(vm);
 
-  return NUMBER_VAL((double)(before - vm.bytesAllocated));
+  return NUMBER_VAL((double)(before - vm->bytesAllocated));
 }
 
-static Value gcHeapSizeNative(int argCount, Value* args) {
-  return NUMBER_VAL((double)(vm.bytesAllocated));
+static Value gcHeapSizeNative(VM* vm, int argCount, Value* args) {
+  return NUMBER_VAL((double)(vm->bytesAllocated));
 }
 
-static void resetStack(void) {
-  vm.stackTop = vm.stack;
-  vm.frameCount = 0;
-  vm.openUpvalues = NULL;
+static void setStat(VM* vm, ObjMap* map, const char* name, double value) {
+  push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+  valueTableSet(vm, &map->table, vm->stackTop[-1], NUMBER_VAL(value));
+  pop(vm);
+  writeBarrier(vm, (Obj*)map);
 }
 
-static void runtimeError(const char* format, ...) {
-  va_list args;
-  va_start(args, format);
+static Value gcStatsNative(VM* vm, int argCount, Value* args) {
+  GCStats* stats = &vm->gcStats;
+  ObjMap* map = newMap(vm);
+  push(vm, OBJ_VAL(map));
+  setStat(vm, map, "minor", stats->minorCollections);
+  setStat(vm, map, "major", stats->majorCollections);
+  setStat(vm, map, "slices", stats->slices);
+  setStat(vm, map, "totalPause", stats->totalPause);
+  setStat(vm, map, "maxPause", stats->maxPause);
+  setStat(vm, map, "allocated", (double)stats->totalAllocated);
+  setStat(vm, map, "freed", (double)stats->bytesFreed);
+  setStat(vm, map, "peakHeap", (double)stats->peakHeap);
+  setStat(vm, map, "heapSize", (double)vm->bytesAllocated);
+  pop(vm);
+  return OBJ_VAL(map);
+}
+
+// Swaps a rope in [slot] for its flattened string, needed wherever the
+// interned identity matters like equality and map keys.
+static void flattenSlot(VM* vm, Value* slot) {
+  if (IS_ROPE(*slot)) *slot = OBJ_VAL(flattenRope(vm, AS_ROPE(*slot)));
+}
+
+static Value lenNative(VM* vm, int argCount, Value* args) {
+  if (IS_LIST(args[0])) {
+    return NUMBER_VAL((double)AS_LIST(args[0])->items.count);
+  }
+  if (IS_MAP(args[0])) {
+    return NUMBER_VAL((double)AS_MAP(args[0])->table.liveCount);
+  }
+  if (isStringLike(args[0])) {
+    return NUMBER_VAL((double)stringLength(args[0]));
+  }
+  return nativeError(vm, "Only lists, maps and strings have a length.");
+}
+
+static Value appendNative(VM* vm, int argCount, Value* args) {
+  if (!IS_LIST(args[0])) return nativeError(vm, "Can only append to a list.");
+
+  ObjList* list = AS_LIST(args[0]);
+  writeValueArray(vm, &list->items, args[1]);
+  writeBarrier(vm, (Obj*)list);
+  return NIL_VAL;
+}
+
+static Value hasNative(VM* vm, int argCount, Value* args) {
+  if (!IS_MAP(args[0])) return nativeError(vm, "Expected a map.");
+
+  Value value;
+  flattenSlot(vm, &args[1]);
+  return BOOL_VAL(valueTableGet(&AS_MAP(args[0])->table, args[1], &value));
+}
+
+static Value removeNative(VM* vm, int argCount, Value* args) {
+  if (!IS_MAP(args[0])) return nativeError(vm, "Expected a map.");
+
+  flattenSlot(vm, &args[1]);
+  return BOOL_VAL(valueTableDelete(&AS_MAP(args[0])->table, args[1]));
+}
+
+static Value keysNative(VM* vm, int argCount, Value* args) {
+  if (!IS_MAP(args[0])) return nativeError(vm, "Expected a map.");
+
+  ValueTable* table = &AS_MAP(args[0])->table;
+  ObjList* list = newList(vm);
+  // Growing the list can collect.
+  push(vm, OBJ_VAL(list));
+  for (int i = 0; i < table->capacity; i++) {
+    ValueEntry* entry = &table->entries[i];
+    if (!IS_UNDEFINED(entry->key)) {
+      writeValueArray(vm, &list->items, entry->key);
+    }
+  }
+  pop(vm);
+  writeBarrier(vm, (Obj*)list);
+  return OBJ_VAL(list);
+}
+
+static void resetStack(VM* vm) {
+  vm->stackTop = vm->stack;
+  vm->frameCount = 0;
+  vm->openUpvalues = NULL;
+}
+
+// How many frames a stack trace shows at either end.
+#define TRACE_FRAMES 10
+
+static void reportError(VM* vm, const char* format, va_list args) {
   vfprintf(stderr, format, args);
-  va_end(args);
   fputs("\n", stderr);
 
-  for (int i = vm.frameCount - 1; i >= 0; i--) {
-    CallFrame* frame = &vm.frames[i];
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    // Deep recursion would print thousands of identical lines, keep the
+    // innermost and outermost frames.
+    if (i == vm->frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+      fprintf(stderr, "... %d more frames\n", i - TRACE_FRAMES + 1);
+      i = TRACE_FRAMES;
+      continue;
+    }
+
+    CallFrame* frame = &vm->frames[i];
     ObjFunction* function = frame->closure->function;
     size_t instruction = frame->ip - function->chunk.code - 1;
     fprintf(stderr, "[line %d] in ",
-            function->chunk.lines[instruction]);
+            getLine(&function->chunk, (int)instruction));
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
@@ -61,164 +156,453 @@ static void runtimeError(const char* format, ...) {
     }
   }
 
-  resetStack();
+  resetStack(vm);
 }
 
-static void defineNative(const char* name, NativeFn function) {
-  push(OBJ_VAL(copyString(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-  pop();
-  pop();
+static void runtimeError(VM* vm, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  reportError(vm, format, args);
+  va_end(args);
 }
 
-void initVM(void) {
-  resetStack();
-  vm.objects = NULL;
-  vm.bytesAllocated = 0;
-  vm.nextGC = 1024 * 1024;
+Value nativeError(VM* vm, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  reportError(vm, format, args);
+  va_end(args);
+  // Nothing a native could return otherwise, so it's safe to use as
+  // the sign something went wrong.
+  return UNDEFINED_VAL;
+}
+
+// Returns the slot in [vm->globalValues] holding the global variable
+// [name], reserving a new undefined one if this is the first time the
+// name is seen.
+int globalSlot(VM* vm, ObjString* name) {
+  Value index;
+  if (tableGet(&vm->globals, name, &index)) {
+    return (int)AS_NUMBER(index);
+  }
+
+  push(vm, OBJ_VAL(name));
+  writeValueArray(vm, &vm->globalValues, UNDEFINED_VAL);
+  writeValueArray(vm, &vm->globalNames, OBJ_VAL(name));
+  int slot = vm->globalValues.count - 1;
+  tableSet(vm, &vm->globals, name, NUMBER_VAL((double)slot));
+  pop(vm);
+
+  return slot;
+}
+
+void defineNative(VM* vm, const char* name, NativeFn function, int arity,
+                  void* context) {
+  push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+  push(vm, OBJ_VAL(newNative(vm, function, arity, context)));
+  int slot = globalSlot(vm, AS_STRING(vm->stack[0]));
+  vm->globalValues.values[slot] = vm->stack[1];
+  pop(vm);
+  pop(vm);
+}
 
-  vm.grayCount = 0;
-  vm.grayCapacity = 0;
-  vm.grayStack = NULL;
+void initVM(VM* vm) {
+  // Allocated outside the GC's accounting, neither ever holds objects
+  // the collector couldn't find anyway.
+  vm->stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL);
+  vm->stackCapacity = STACK_INITIAL;
+  vm->frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+  vm->frameCapacity = FRAMES_INITIAL;
+  if (vm->stack == NULL || vm->frames == NULL) exit(1);
+
+  resetStack(vm);
+  vm->objects = NULL;
+  vm->youngObjects = NULL;
+  vm->markValue = true;
+  vm->bytesAllocated = 0;
+  vm->gcInitialHeap = GC_INITIAL_HEAP;
+  vm->gcGrowFactor = GC_GROW_FACTOR;
+  vm->gcMaxHeap = 0;
+  vm->gcTarget = GC_TARGET;
+  vm->gcLastCycle = gcClock();
+  vm->gcThreads = 1;
+  vm->gcWorkers = NULL;
+  vm->sweepBoundaries = NULL;
+  vm->sweepBoundaryCount = 0;
+  vm->sweepBoundaryCapacity = 0;
+  vm->nextGC = vm->gcInitialHeap;
+  vm->youngAllocated = 0;
+  vm->sliceAllocated = 0;
+
+  vm->grayCount = 0;
+  vm->grayCapacity = 0;
+  vm->grayStack = NULL;
+
+  vm->rememberedCount = 0;
+  vm->rememberedCapacity = 0;
+  vm->remembered = NULL;
+
+  for (int i = 0; i < POOL_COUNT; i++) {
+    vm->pools[i] = NULL;
+  }
+  vm->slabs = NULL;
+
+  vm->gcIncremental = false;
+  vm->gcSliceBudget = GC_SLICE_BUDGET;
+  vm->gcPhase = GC_PHASE_IDLE;
+  vm->sweepPrevious = NULL;
+  memset(&vm->gcStats, 0, sizeof(GCStats));
+  vm->gcLastStats = vm->gcStats;
+
+  vm->sampleRequested = 0;
+  vm->profiler = NULL;
+  vm->reportGCStats = false;
+#if PROFILE_OPCODES
+  vm->reportOpcodeStats = false;
+  memset(vm->opcodeCounts, 0, sizeof(vm->opcodeCounts));
+  memset(vm->opcodeTicks, 0, sizeof(vm->opcodeTicks));
+  vm->lastTicks = profileTicks();
+  vm->lastOpcode = 0;
+#endif
+#ifdef DEBUG_STRESS_GC
+  vm->stressFull = false;
+#endif
 
-  initTable(&vm.globals);
-  initTable(&vm.strings);
+  for (int i = 0; i < BOUND_CACHE_SIZE; i++) {
+    vm->boundMethods[i] = NULL;
+  }
 
-  vm.initString = NULL;
-  vm.initString = copyString("init", 4);
+  initTable(&vm->globals);
+  initValueArray(&vm->globalValues);
+  initValueArray(&vm->globalNames);
+  initTable(&vm->strings);
+
+  vm->parser = NULL;
+  vm->initString = NULL;
+  vm->initString = copyString(vm, "init", 4);
+
+  defineNative(vm, "clock", clockNative, 0, NULL);
+  defineNative(vm, "exit", exitNative, 0, NULL);
+  defineNative(vm, "gc", gcNative, 0, NULL);
+  defineNative(vm, "gcHeapSize", gcHeapSizeNative, 0, NULL);
+  defineNative(vm, "gcStats", gcStatsNative, 0, NULL);
+  defineNative(vm, "len", lenNative, 1, NULL);
+  defineNative(vm, "append", appendNative, 2, NULL);
+  defineNative(vm, "has", hasNative, 2, NULL);
+  defineNative(vm, "remove", removeNative, 2, NULL);
+  defineNative(vm, "keys", keysNative, 1, NULL);
+}
+
+void freeVM(VM* vm) {
+  stopProfiler(vm);
+  if (vm->reportGCStats) printGCStats(vm, stderr);
+#if PROFILE_OPCODES
+  if (vm->reportOpcodeStats) printOpcodeStats(vm, stderr);
+#endif
 
-  defineNative("clock", clockNative);
-  defineNative("exit", exitNative);
-  defineNative("gc", gcNative);
-  defineNative("gcHeapSize", gcHeapSizeNative);
+  freeTable(vm, &vm->globals);
+  freeValueArray(vm, &vm->globalValues);
+  freeValueArray(vm, &vm->globalNames);
+  freeTable(vm, &vm->strings);
+  vm->initString = NULL;
+  freeObjects(vm);
+#if PARALLEL_GC
+  freeGCWorkers(vm);
+#endif
+  free(vm->stack);
+  free(vm->frames);
 }
 
-void freeVM(void) {
-  freeTable(&vm.globals);
-  freeTable(&vm.strings);
-  vm.initString = NULL;
-  freeObjects();
+void push(VM* vm, Value value) {
+  *vm->stackTop = value;
+  vm->stackTop++;
 }
 
-void push(Value value) {
-  *vm.stackTop = value;
-  vm.stackTop++;
+Value pop(VM* vm) {
+  vm->stackTop--;
+  return *vm->stackTop;
 }
 
-Value pop(void) {
-  vm.stackTop--;
-  return *vm.stackTop;
+static Value peek(VM* vm, int distance) {
+  return vm->stackTop[-1 - distance];
 }
 
-static Value peek(int distance) {
-  return vm.stackTop[-1 - distance];
+// Where [slot] of the stack that used to start at [old] is now. The old
+// address is only used as a number since that memory is gone.
+static inline Value* movedSlot(VM* vm, Value* slot, uintptr_t old) {
+  return vm->stack + ((uintptr_t)slot - old) / sizeof(Value);
 }
 
-static bool call(ObjClosure* closure, int argCount) {
+// Makes room for [needed] more values above the stack top. Growing
+// moves the stack, so the frames and open upvalues pointing into it are
+// moved along.
+static bool ensureStack(VM* vm, int needed) {
+  int used = (int)(vm->stackTop - vm->stack);
+  if (used + needed <= vm->stackCapacity) return true;
+  if (used + needed > STACK_MAX) return false;
+
+  int capacity = vm->stackCapacity;
+  while (capacity < used + needed) capacity *= 2;
+  if (capacity > STACK_MAX) capacity = STACK_MAX;
+
+  uintptr_t old = (uintptr_t)vm->stack;
+  vm->stack = (Value*)realloc(vm->stack, sizeof(Value) * capacity);
+  if (vm->stack == NULL) exit(1);
+  vm->stackCapacity = capacity;
+  if ((uintptr_t)vm->stack == old) return true;
+
+  vm->stackTop = vm->stack + used;
+  for (int i = 0; i < vm->frameCount; i++) {
+    vm->frames[i].slots = movedSlot(vm, vm->frames[i].slots, old);
+  }
+  for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = movedSlot(vm, upvalue->location, old);
+  }
+  return true;
+}
+
+static bool ensureFrame(VM* vm) {
+  if (vm->frameCount < vm->frameCapacity) return true;
+  if (vm->frameCapacity == FRAMES_MAX) return false;
+
+  vm->frameCapacity *= 2;
+  vm->frames = (CallFrame*)realloc(vm->frames,
+                                  sizeof(CallFrame) * vm->frameCapacity);
+  if (vm->frames == NULL) exit(1);
+  return true;
+}
+
+static bool call(VM* vm, ObjClosure* closure, int argCount) {
   if (argCount != closure->function->arity) {
-    runtimeError("Expected %d arguments but got %d.",
+    runtimeError(vm, "Expected %d arguments but got %d.",
         closure->function->arity, argCount);
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
-    runtimeError("Stack overflow.");
+  // Functions can have more than 256 locals so the frame count alone
+  // doesn't bound the stack anymore.
+  if (!ensureFrame(vm) ||
+      !ensureStack(vm, closure->function->maxSlots + STACK_SLACK)) {
+    runtimeError(vm, "Stack overflow.");
     return false;
   }
 
-  CallFrame* frame = &vm.frames[vm.frameCount++];
+  CallFrame* frame = &vm->frames[vm->frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
-  frame->slots = vm.stackTop - argCount - 1;
+  frame->slots = vm->stackTop - argCount - 1;
+  if (closure->function->jit == NULL) closure->function->hotness++;
   return true;
 }
 
-static bool callValue(Value callee, int argCount) {
+// Natives don't get a frame, the result just replaces the native and
+// its arguments on the stack.
+static inline bool callNative(VM* vm, ObjNative* native, int argCount) {
+  if (argCount != native->arity && native->arity != NATIVE_VARIADIC) {
+    runtimeError(vm, "Expected %d arguments but got %d.",
+                 native->arity, argCount);
+    return false;
+  }
+
+  Value result = native->function(vm, argCount, vm->stackTop - argCount);
+  if (IS_UNDEFINED(result)) return false;
+
+  vm->stackTop -= argCount;
+  vm->stackTop[-1] = result;
+  return true;
+}
+
+static bool callValue(VM* vm, Value callee, int argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
       case OBJ_BOUND_METHOD: {
         ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-        vm.stackTop[-argCount - 1] = bound->receiver;
-        return call(bound->method, argCount);
+        vm->stackTop[-argCount - 1] = bound->receiver;
+        return call(vm, bound->method, argCount);
       }
       case OBJ_CLASS: {
         ObjClass* klass = AS_CLASS(callee);
-        vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
-        Value initializer;
-        if (tableGet(&klass->methods, vm.initString,
-                     &initializer)) {
-          return call(AS_CLOSURE(initializer), argCount);
+        vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
+        if (klass->initializer != NULL) {
+          return call(vm, klass->initializer, argCount);
         } else if (argCount != 0) {
-          runtimeError("Expected 0 arguments but got %d.",
+          runtimeError(vm, "Expected 0 arguments but got %d.",
                        argCount);
           return false;
         }
         return true;
       }
       case OBJ_CLOSURE:
-        return call(AS_CLOSURE(callee), argCount);
-      case OBJ_NATIVE: {
-        NativeFn native = AS_NATIVE(callee);
-        Value result = native(argCount, vm.stackTop - argCount);
-        vm.stackTop -= argCount + 1;
-        push(result);
-        return true;
-      }
+        return call(vm, AS_CLOSURE(callee), argCount);
+      case OBJ_NATIVE:
+        return callNative(vm, AS_NATIVE(callee), argCount);
       default:
         break; // Non-callable object type.
     }
   }
-  runtimeError("Can only call functions and classes.");
+  runtimeError(vm, "Can only call functions and classes.");
   return false;
 }
 
-static bool invokeFromClass(ObjClass* klass, ObjString* name,
-                            int argCount) {
+static inline CacheEntry* findCacheEntry(InlineCache* cache,
+                                         ObjShape* shape) {
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    if (cache->entries[i].shape == shape) return &cache->entries[i];
+  }
+
+  return NULL;
+}
+
+static CacheEntry* claimCacheEntry(InlineCache* cache,
+                                   ObjShape* shape) {
+  // Take the first free way, once the site turns megamorphic keep
+  // recycling the last one so the earlier entries stay stable.
+  CacheEntry* entry = &cache->entries[INLINE_CACHE_WAYS - 1];
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    if (cache->entries[i].shape == NULL) {
+      entry = &cache->entries[i];
+      break;
+    }
+  }
+
+  entry->shape = shape;
+  entry->target = NULL;
+  entry->method = NIL_VAL;
+  entry->slot = -1;
+  return entry;
+}
+
+// Resolves a property read for an instance shape that missed the
+// cache. Returns NULL if the property is undefined.
+static CacheEntry* cacheProperty(VM* vm, ObjFunction* owner,
+                                 InlineCache* cache,
+                                 ObjInstance* instance,
+                                 ObjString* name) {
+  int slot = shapeLookup(instance->shape, name);
+  Value method = NIL_VAL;
+  if (slot == -1 &&
+      !tableGet(&instance->klass->methods, name, &method)) {
+    return NULL;
+  }
+
+  CacheEntry* entry = claimCacheEntry(cache, instance->shape);
+  entry->slot = slot;
+  entry->method = method;
+  writeBarrier(vm, (Obj*)owner);
+  return entry;
+}
+
+// Resolves a field store for an instance shape that missed the cache,
+// creating the transition to a new shape if the field doesn't exist.
+static CacheEntry* cacheFieldStore(VM* vm, ObjFunction* owner,
+                                   InlineCache* cache,
+                                   ObjShape* shape,
+                                   ObjString* name) {
+  int slot = shapeLookup(shape, name);
+  ObjShape* target = NULL;
+  if (slot == -1) {
+    target = shapeTransition(vm, shape, name);
+    slot = target->fieldCount - 1;
+  }
+
+  CacheEntry* entry = claimCacheEntry(cache, shape);
+  entry->target = target;
+  entry->slot = slot;
+  writeBarrier(vm, (Obj*)owner);
+  return entry;
+}
+
+// Resolves a method on [superclass] for a super access that missed the
+// cache. The class a super access goes to doesn't depend on the
+// receiver, so these entries are keyed on the superclass' root shape.
+static CacheEntry* cacheSuperMethod(VM* vm, ObjFunction* owner,
+                                    InlineCache* cache,
+                                    ObjClass* superclass,
+                                    ObjString* name) {
   Value method;
-  if (!tableGet(&klass->methods, name, &method)) {
-    runtimeError("Undefined property '%s'.", name->chars);
-    return false;
+  if (!tableGet(&superclass->methods, name, &method)) return NULL;
+
+  CacheEntry* entry = claimCacheEntry(cache, superclass->rootShape);
+  entry->method = method;
+  writeBarrier(vm, (Obj*)owner);
+  return entry;
+}
+
+static ObjClosure* superMethod(VM* vm, ObjClass* superclass, ObjString* name,
+                               InlineCache* cache) {
+  CacheEntry* entry = findCacheEntry(cache, superclass->rootShape);
+  if (entry == NULL) {
+    ObjFunction* owner = vm->frames[vm->frameCount - 1].closure->function;
+    entry = cacheSuperMethod(vm, owner, cache, superclass, name);
+    if (entry == NULL) {
+      runtimeError(vm, "Undefined property '%s'.", name->chars);
+      return NULL;
+    }
   }
-  return call(AS_CLOSURE(method), argCount);
+
+  return AS_CLOSURE(entry->method);
 }
 
-static bool invoke(ObjString* name, int argCount) {
-  Value receiver = peek(argCount);
+static bool invoke(VM* vm, ObjString* name, int argCount,
+                   InlineCache* cache) {
+  Value receiver = peek(vm, argCount);
 
   if (!IS_INSTANCE(receiver)) {
-    runtimeError("Only instances have methods.");
+    runtimeError(vm, "Only instances have methods.");
     return false;
   }
 
   ObjInstance* instance = AS_INSTANCE(receiver);
 
-  Value value;
-  if (tableGet(&instance->fields, name, &value)) {
-    vm.stackTop[-argCount - 1] = value;
-    return callValue(value, argCount);
+  CacheEntry* entry = findCacheEntry(cache, instance->shape);
+  if (entry == NULL) {
+    ObjFunction* owner = vm->frames[vm->frameCount - 1].closure->function;
+    entry = cacheProperty(vm, owner, cache, instance, name);
+    if (entry == NULL) {
+      runtimeError(vm, "Undefined property '%s'.", name->chars);
+      return false;
+    }
   }
 
-  return invokeFromClass(instance->klass, name, argCount);
+  if (entry->slot != -1) {
+    Value value = instance->fields[entry->slot];
+    vm->stackTop[-argCount - 1] = value;
+    return callValue(vm, value, argCount);
+  }
+
+  return call(vm, AS_CLOSURE(entry->method), argCount);
 }
 
-static bool bindMethod(ObjClass* klass, ObjString* name) {
-  Value method;
-  if (!tableGet(&klass->methods, name, &method)) {
-    runtimeError("Undefined property '%s'.", name->chars);
-    return false;
+// Binds [method] to the receiver on top of the stack, reusing the bound
+// method from last time if it's still in the cache.
+static ObjBoundMethod* bindCached(VM* vm, ObjClosure* method) {
+  Obj* receiver = AS_OBJ(peek(vm, 0));
+  uintptr_t hash = ((uintptr_t)receiver >> 4) ^ ((uintptr_t)method >> 3);
+  ObjBoundMethod** slot = &vm->boundMethods[hash & (BOUND_CACHE_SIZE - 1)];
+
+  ObjBoundMethod* bound = *slot;
+  if (bound == NULL || bound->method != method ||
+      AS_OBJ(bound->receiver) != receiver) {
+    bound = newBoundMethod(vm, peek(vm, 0), method);
+    *slot = bound;
   }
+  return bound;
+}
 
-  ObjBoundMethod* bound = newBoundMethod(peek(0),
-                                         AS_CLOSURE(method));
-  pop();
-  push(OBJ_VAL(bound));
+static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name,
+                       InlineCache* cache) {
+  ObjClosure* method = superMethod(vm, klass, name, cache);
+  if (method == NULL) return false;
+
+  ObjBoundMethod* bound = bindCached(vm, method);
+  pop(vm);
+  push(vm, OBJ_VAL(bound));
   return true;
 }
 
-static ObjUpvalue* captureUpvalue(Value* local) {
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
   ObjUpvalue* prevUpvalue = NULL;
-  ObjUpvalue* upvalue = vm.openUpvalues;
+  ObjUpvalue* upvalue = vm->openUpvalues;
   while (upvalue != NULL && upvalue->location > local) {
     prevUpvalue = upvalue;
     upvalue = upvalue->next;
@@ -228,11 +612,11 @@ static ObjUpvalue* captureUpvalue(Value* local) {
     return upvalue;
   }
 
-  ObjUpvalue* createdUpvalue = newUpvalue(local);
+  ObjUpvalue* createdUpvalue = newUpvalue(vm, local);
   createdUpvalue->next = upvalue;
 
   if (prevUpvalue == NULL) {
-    vm.openUpvalues = createdUpvalue;
+    vm->openUpvalues = createdUpvalue;
   } else {
     prevUpvalue->next = createdUpvalue;
   }
@@ -240,96 +624,337 @@ static ObjUpvalue* captureUpvalue(Value* local) {
   return createdUpvalue;
 }
 
-static void closeUpvalues(Value* last) {
-  while (vm.openUpvalues != NULL &&
-         vm.openUpvalues->location >= last) {
-    ObjUpvalue* upvalue = vm.openUpvalues;
+// Captures a variable that's never assigned as upvalue [index] of
+// [closure]. The value is copied into the closure's own storage, so
+// there's no upvalue object to allocate or close later.
+static ObjUpvalue* captureValue(ObjClosure* closure, int index,
+                                Value value) {
+  ObjUpvalue* upvalue = &closure->values[index];
+  // Never on any object list, the closure it's part of is.
+  initObjHeader(&upvalue->obj, OBJ_UPVALUE, false, NULL);
+  upvalue->closed = value;
+  upvalue->location = &upvalue->closed;
+  upvalue->next = NULL;
+  return upvalue;
+}
+
+// Whether any of the captures following an OP_CLOSURE at [ip] will be
+// by value, so the closure can be allocated with room for them.
+static bool hasValueCaptures(ObjClosure* enclosing, ObjFunction* function,
+                             uint8_t* ip, bool wide) {
+  for (int i = 0; i < function->upvalueCount; i++) {
+    uint8_t isLocal = ip[0];
+    uint16_t index = wide ? (uint16_t)((ip[1] << 8) | ip[2]) : ip[1];
+    if (isLocal == 2) return true;
+    if (!isLocal &&
+        isValueCapture(enclosing, enclosing->upvalues[index])) {
+      return true;
+    }
+    ip += wide ? 3 : 2;
+  }
+  return false;
+}
+
+static void closeUpvalues(VM* vm, Value* last) {
+  while (vm->openUpvalues != NULL &&
+         vm->openUpvalues->location >= last) {
+    ObjUpvalue* upvalue = vm->openUpvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
-    vm.openUpvalues = upvalue->next;
+    writeBarrier(vm, (Obj*)upvalue);
+    vm->openUpvalues = upvalue->next;
   }
 }
 
-static void defineMethod(ObjString* name) {
-  Value method = peek(0);
-  ObjClass* klass = AS_CLASS(peek(1));
-  tableSet(&klass->methods, name, method);
-  pop();
+// Replaces the calling frame with the one a tail call just pushed, so
+// the caller's locals and frame are reused.
+static void collapseFrame(VM* vm) {
+  CallFrame* callee = &vm->frames[vm->frameCount - 1];
+  CallFrame* caller = callee - 1;
+  closeUpvalues(vm, caller->slots);
+
+  int size = (int)(vm->stackTop - callee->slots);
+  memmove(caller->slots, callee->slots, sizeof(Value) * size);
+  vm->stackTop = caller->slots + size;
+  caller->closure = callee->closure;
+  caller->ip = callee->ip;
+  vm->frameCount--;
+}
+
+static void defineMethod(VM* vm, ObjString* name) {
+  Value method = peek(vm, 0);
+  ObjClass* klass = AS_CLASS(peek(vm, 1));
+  tableSet(vm, &klass->methods, name, method);
+  if (name == vm->initString) klass->initializer = AS_CLOSURE(method);
+  writeBarrier(vm, (Obj*)klass);
+  pop(vm);
 }
 
 static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate(void) {
-  ObjString* b = AS_STRING(peek(0));
-  ObjString* a = AS_STRING(peek(1));
+static void concatenate(VM* vm) {
+  int length = stringLength(peek(vm, 1)) +
+               stringLength(peek(vm, 0));
+  if (length >= ROPE_MIN_LENGTH) {
+    // Long strings are joined lazily, copying, hashing and interning
+    // wait until the characters are needed.
+    ObjRope* rope = newRope(vm, AS_OBJ(peek(vm, 1)), AS_OBJ(peek(vm, 0)),
+                            length);
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(rope));
+    return;
+  }
+
+  // Ropes are never this short so both sides are flat.
+  ObjString* b = AS_STRING(peek(vm, 0));
+  ObjString* a = AS_STRING(peek(vm, 1));
 
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
+  char chars[ROPE_MIN_LENGTH];
   memcpy(chars, a->chars, a->length);
   memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
 
-  ObjString* result = takeString(chars, length);
-  pop();
-  pop();
-  push(OBJ_VAL(result));
+  ObjString* result = copyString(vm, chars, length);
+  pop(vm);
+  pop(vm);
+  push(vm, OBJ_VAL(result));
+}
+
+static void appendItems(VM* vm, ObjList* list, Value* items, int count) {
+  if (count == 0) return;
+
+  ValueArray* array = &list->items;
+  if (array->capacity < array->count + count) {
+    int oldCapacity = array->capacity;
+    array->capacity = array->count + count;
+    array->values = GROW_ARRAY(vm, Value, array->values,
+        oldCapacity, array->capacity);
+  }
+
+  memcpy(array->values + array->count, items, sizeof(Value) * count);
+  array->count += count;
+  writeBarrier(vm, (Obj*)list);
 }
 
-static InterpretResult run(void) {
+// Inserts [count] key/value pairs laid out flat in [items].
+static void insertPairs(VM* vm, ObjMap* map, Value* items, int count) {
+  for (int i = 0; i < count; i++) {
+    flattenSlot(vm, &items[i * 2]);
+    valueTableSet(vm, &map->table, items[i * 2], items[i * 2 + 1]);
+  }
+  writeBarrier(vm, (Obj*)map);
+}
+
+static InterpretResult run(VM* vm) {
   register CallFrame* frame;
   register Value* stackStart;
   register uint8_t* ip;
   register ObjFunction* fn;
 
 #define LOAD_FRAME()                     \
-  frame = &vm.frames[vm.frameCount - 1]; \
+  frame = &vm->frames[vm->frameCount - 1]; \
   stackStart = frame->slots;             \
   ip = frame->ip;                        \
   fn = frame->closure->function;
 
 #define STORE_FRAME() frame->ip = ip
 
+// Continues in machine code if the function has been compiled or just
+// got hot enough to be.
+#if JIT
+#define ENTER_JIT() \
+    if (fn->jit != NULL || fn->hotness >= JIT_THRESHOLD) goto runNative
+#else
+#define ENTER_JIT()
+#endif
+
+// Takes a profiler sample if the timer asked for one. Checked wherever
+// the JIT could be entered, so on every loop iteration and call.
+#define SAMPLE() \
+    if (vm->sampleRequested) { STORE_FRAME(); takeSample(vm); }
+
 #define READ_BYTE() (*ip++)
-#define PUSH(value) (*vm.stackTop++ = value)
-#define POP()       (*(--vm.stackTop))
-#define DROP()      (--vm.stackTop)
-#define PEEK()      (*(vm.stackTop - 1))
-#define PEEK2()     (*(vm.stackTop - 2))
+#define PUSH(value) (*vm->stackTop++ = value)
+#define POP()       (*(--vm->stackTop))
+#define DROP()      (--vm->stackTop)
+#define PEEK()      (*(vm->stackTop - 1))
+#define PEEK2()     (*(vm->stackTop - 2))
 #define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 
 #define READ_CONSTANT() (fn->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define CONSTANT_STRING(index) AS_STRING(fn->chunk.constants.values[index])
+#define READ_CACHE() (&fn->chunk.caches[READ_SHORT()])
+#define GLOBAL_NAME(slot) AS_CSTRING(vm->globalNames.values[slot])
+
+// Instructions that have seen the types of their operands rewrite
+// themselves in place into a variant specialized for those types. The
+// specialized variant goes back to the generic one and runs that
+// again as soon as its guard fails.
+#define QUICKEN(op) (ip[-1] = OP_##op)
+#define DEQUICKEN(op) \
+    do { \
+      ip[-1] = OP_##op; \
+      ip--; \
+      DISPATCH(); \
+    } while (false)
 
-#define BINARY_OP(valueType, op) \
+#define BINARY_OP(valueType, op, quickened) \
     do { \
       if (!IS_NUMBER(PEEK()) || !IS_NUMBER(PEEK2())) { \
         frame->ip = ip; \
-        runtimeError("Operands must be numbers."); \
+        runtimeError(vm, "Operands must be numbers."); \
         return INTERPRET_RUNTIME_ERROR; \
       } \
+      QUICKEN(quickened); \
       double b = AS_NUMBER(POP()); \
       double a = AS_NUMBER(POP()); \
       PUSH(valueType(a op b)); \
     } while (false)
 
+#define NUMBER_OP(valueType, op, generic) \
+    do { \
+      Value b = PEEK(); \
+      Value a = PEEK2(); \
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) DEQUICKEN(generic); \
+      DROP(); \
+      vm->stackTop[-1] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+
+// Compares a local against a number constant and jumps when the
+// comparison fails.
+#define COMPARE_JUMP(op) \
+    do { \
+      Value a = stackStart[READ_BYTE()]; \
+      Value b = READ_CONSTANT(); \
+      uint16_t offset = READ_SHORT(); \
+      if (!IS_NUMBER(a)) { \
+        frame->ip = ip; \
+        runtimeError(vm, "Operands must be numbers."); \
+        return INTERPRET_RUNTIME_ERROR; \
+      } \
+      if (!(AS_NUMBER(a) op AS_NUMBER(b))) ip += offset; \
+    } while (false)
+
+// Register instructions name their operands, locals in the frame or a
+// constant for the second operand of the _RK forms.
+#define READ_REGISTER() (stackStart[READ_BYTE()])
+
+#define REGISTER_OP(valueType, op, readB) \
+    do { \
+      Value a = READ_REGISTER(); \
+      Value b = readB; \
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+        STORE_FRAME(); \
+        runtimeError(vm, "Operands must be numbers."); \
+        return INTERPRET_RUNTIME_ERROR; \
+      } \
+      PUSH(valueType(AS_NUMBER(a) op AS_NUMBER(b))); \
+    } while (false)
+
+// Like REGISTER_OP, but writes the result to the local [dst].
+#define STORE_OP(op, readB) \
+    do { \
+      int dst = READ_BYTE(); \
+      Value a = READ_REGISTER(); \
+      Value b = readB; \
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+        STORE_FRAME(); \
+        runtimeError(vm, "Operands must be numbers."); \
+        return INTERPRET_RUNTIME_ERROR; \
+      } \
+      stackStart[dst] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+
+// Strings still go through the stack to be concatenated, which keeps
+// them reachable if that collects.
+#define ADD_VALUES(a, b) \
+    do { \
+      if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+        PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b))); \
+      } else if (isStringLike(a) && isStringLike(b)) { \
+        PUSH(a); \
+        PUSH(b); \
+        concatenate(vm); \
+      } else { \
+        STORE_FRAME(); \
+        runtimeError(vm, \
+            "Operands must be two numbers or two strings."); \
+        return INTERPRET_RUNTIME_ERROR; \
+      } \
+    } while (false)
+
+#define REGISTER_ADD(readB) \
+    do { \
+      Value a = READ_REGISTER(); \
+      Value b = readB; \
+      ADD_VALUES(a, b); \
+    } while (false)
+
+#define STORE_ADD(readB) \
+    do { \
+      int dst = READ_BYTE(); \
+      Value a = READ_REGISTER(); \
+      Value b = readB; \
+      if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+        stackStart[dst] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)); \
+      } else { \
+        ADD_VALUES(a, b); \
+        stackStart[dst] = POP(); \
+      } \
+    } while (false)
+
+// Checks that [index] can be used on [list], leaving it in [slot].
+#define LIST_INDEX(list, index, slot) \
+    do { \
+      if (!IS_NUMBER(index)) { \
+        frame->ip = ip; \
+        runtimeError(vm, "List index must be a number."); \
+        return INTERPRET_RUNTIME_ERROR; \
+      } \
+      double number = AS_NUMBER(index); \
+      slot = (int)number; \
+      if (number < 0 || number >= (list)->items.count || \
+          slot != number) { \
+        frame->ip = ip; \
+        runtimeError(vm, "List index out of range."); \
+        return INTERPRET_RUNTIME_ERROR; \
+      } \
+    } while (false)
+
 #ifdef DEBUG_TRACE_EXECUTION
 #define TRACE_EXECUTION()                                        \
   do {                                                            \
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {    \
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {    \
       printf("[ ");                                               \
-      printValue(*slot);                                          \
+      printValue(vm, *slot);                                          \
       printf(" ]");                                               \
     }                                                             \
     printf("\n");                                                 \
-    disassembleInstruction(&fn->chunk,      \
+    disassembleInstruction(vm, &fn->chunk,      \
         (int)(ip - fn->chunk.code)); \
   } while(false)
 #else
 #define TRACE_EXECUTION() do {} while(false)
 #endif
 
+#if PROFILE_OPCODES
+// Charges the time since the last dispatch to the instruction that ran
+// and counts the one about to.
+#define COUNT_OPCODE()                                         \
+  do {                                                          \
+    uint64_t ticks = profileTicks();                            \
+    vm->opcodeTicks[vm->lastOpcode] += ticks - vm->lastTicks;   \
+    vm->lastTicks = ticks;                                      \
+    vm->lastOpcode = *ip;                                       \
+    vm->opcodeCounts[*ip]++;                                    \
+  } while (false)
+#else
+#define COUNT_OPCODE() do {} while (false)
+#endif
+
 #if COMPUTED_GOTO
   static void* dispatchTable[] = {
     #define OPCODE(op) &&code_##op,
@@ -342,6 +967,7 @@ static InterpretResult run(void) {
 #define DISPATCH()                                           \
   do {                                                       \
     TRACE_EXECUTION();                                       \
+    COUNT_OPCODE();                                          \
     goto *dispatchTable[instruction = (OpCode)READ_BYTE()];  \
   } while(false)
 
@@ -351,6 +977,7 @@ static InterpretResult run(void) {
 #define INTERPRET_LOOP                                        \
     loop:                                                     \
       TRACE_EXECUTION();                                      \
+      COUNT_OPCODE();                                         \
       switch (instruction = (OpCode)READ_BYTE())
 
 #define CASE_CODE(name)  case OP_##name
@@ -358,8 +985,14 @@ static InterpretResult run(void) {
 #endif
 
   LOAD_FRAME();
+#if PROFILE_OPCODES
+  vm->lastTicks = profileTicks();
+#endif
 
   OpCode instruction;
+  // The constant or slot operand of an instruction that can be wide.
+  uint16_t arg;
+  bool wide;
   INTERPRET_LOOP {
     CASE_CODE(CONSTANT): {
       PUSH(READ_CONSTANT());
@@ -382,11 +1015,11 @@ static InterpretResult run(void) {
     }
     
     CASE_CODE(GET_GLOBAL): {
-      ObjString* name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
+      uint16_t slot = READ_SHORT();
+      Value value = vm->globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
         STORE_FRAME();
-        runtimeError("Undefined variable '%s'.", name->chars);
+        runtimeError(vm, "Undefined variable '%s'.", GLOBAL_NAME(slot));
         return INTERPRET_RUNTIME_ERROR;
       }
       PUSH(value);
@@ -394,20 +1027,19 @@ static InterpretResult run(void) {
     }
 
     CASE_CODE(DEFINE_GLOBAL): {
-      ObjString* name = READ_STRING();
-      tableSet(&vm.globals, name, PEEK());
+      vm->globalValues.values[READ_SHORT()] = PEEK();
       DROP();
       DISPATCH();
     }
     
     CASE_CODE(SET_GLOBAL): {
-      ObjString* name = READ_STRING();
-      if (tableSet(&vm.globals, name, PEEK())) {
-        tableDelete(&vm.globals, name);
+      uint16_t slot = READ_SHORT();
+      if (IS_UNDEFINED(vm->globalValues.values[slot])) {
         STORE_FRAME();
-        runtimeError("Undefined variable '%s'.", name->chars);
+        runtimeError(vm, "Undefined variable '%s'.", GLOBAL_NAME(slot));
         return INTERPRET_RUNTIME_ERROR;
       }
+      vm->globalValues.values[slot] = PEEK();
       DISPATCH();
     }
 
@@ -417,103 +1049,145 @@ static InterpretResult run(void) {
     }
 
     CASE_CODE(SET_UPVALUE): {
-      *frame->closure->upvalues[READ_BYTE()]->location = PEEK();
+      ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+      *upvalue->location = PEEK();
+      writeBarrier(vm, (Obj*)upvalue);
       DISPATCH();
     }
     
-    CASE_CODE(GET_PROPERTY): {
+    CASE_CODE(GET_PROPERTY):
+      arg = READ_BYTE();
+    getProperty: {
       if (!IS_INSTANCE(PEEK())) {
         STORE_FRAME();
-        runtimeError("Only instances have properties.");
+        runtimeError(vm, "Only instances have properties.");
         return INTERPRET_RUNTIME_ERROR;
       }
 
       ObjInstance* instance = AS_INSTANCE(PEEK());
-      ObjString* name = READ_STRING();
-        
-      Value value;
-      if (tableGet(&instance->fields, name, &value)) {
+      ObjString* name = CONSTANT_STRING(arg);
+      InlineCache* cache = READ_CACHE();
+
+      CacheEntry* entry = findCacheEntry(cache, instance->shape);
+      if (entry == NULL) {
+        entry = cacheProperty(vm, fn, cache, instance, name);
+        if (entry == NULL) {
+          STORE_FRAME();
+          runtimeError(vm, "Undefined property '%s'.", name->chars);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+      }
+
+      if (entry->slot != -1) {
+        Value value = instance->fields[entry->slot];
         DROP(); // Instance.
         PUSH(value);
         DISPATCH();
       }
 
-      if (!bindMethod(instance->klass, name)) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
+      ObjBoundMethod* bound = bindCached(vm, AS_CLOSURE(entry->method));
+      DROP(); // Instance.
+      PUSH(OBJ_VAL(bound));
       DISPATCH();
     }
 
-    CASE_CODE(SET_PROPERTY): {
+    CASE_CODE(SET_PROPERTY):
+      arg = READ_BYTE();
+    setProperty: {
       if (!IS_INSTANCE(PEEK2())) {
         STORE_FRAME();
-        runtimeError("Only instances have fields.");
+        runtimeError(vm, "Only instances have fields.");
         return INTERPRET_RUNTIME_ERROR;
       }
 
       ObjInstance* instance = AS_INSTANCE(PEEK2());
-      tableSet(&instance->fields, READ_STRING(), PEEK());
+      ObjString* name = CONSTANT_STRING(arg);
+      InlineCache* cache = READ_CACHE();
+
+      CacheEntry* entry = findCacheEntry(cache, instance->shape);
+      if (entry == NULL) {
+        entry = cacheFieldStore(vm, fn, cache, instance->shape, name);
+      }
+
+      if (entry->target != NULL) {
+        instanceSetShape(vm, instance, entry->target);
+      }
+      instance->fields[entry->slot] = PEEK();
+      writeBarrier(vm, (Obj*)instance);
+
       Value value = POP();
       DROP();
       PUSH(value);
       DISPATCH();
     }
 
-    CASE_CODE(GET_SUPER): {
-      ObjString* name = READ_STRING();
+    CASE_CODE(GET_SUPER):
+      arg = READ_BYTE();
+    getSuper: {
+      ObjString* name = CONSTANT_STRING(arg);
+      InlineCache* cache = READ_CACHE();
       ObjClass* superclass = AS_CLASS(POP());
-        
-      if (!bindMethod(superclass, name)) {
+      STORE_FRAME();
+
+      if (!bindMethod(vm, superclass, name, cache)) {
         return INTERPRET_RUNTIME_ERROR;
       }
       DISPATCH();
     }
 
     CASE_CODE(EQUAL): {
+      flattenSlot(vm, &vm->stackTop[-1]);
+      flattenSlot(vm, &vm->stackTop[-2]);
       Value b = POP();
       Value a = POP();
       PUSH(BOOL_VAL(valuesEqual(a, b)));
       DISPATCH();
     }
 
-    CASE_CODE(GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
-    CASE_CODE(LESS):    BINARY_OP(BOOL_VAL, <); DISPATCH();
+    CASE_CODE(GREATER): BINARY_OP(BOOL_VAL, >, GREATER_NUMBER); DISPATCH();
+    CASE_CODE(LESS):    BINARY_OP(BOOL_VAL, <, LESS_NUMBER); DISPATCH();
 
     CASE_CODE(ADD): {
-      if (IS_STRING(PEEK()) && IS_STRING(PEEK2())) {
-        concatenate();
+      if (isStringLike(PEEK()) && isStringLike(PEEK2())) {
+        QUICKEN(ADD_STRING);
+        concatenate(vm);
       } else if (IS_NUMBER(PEEK()) && IS_NUMBER(PEEK2())) {
+        QUICKEN(ADD_NUMBER);
         double b = AS_NUMBER(POP());
         double a = AS_NUMBER(POP());
         PUSH(NUMBER_VAL(a + b));
       } else {
         STORE_FRAME();
-        runtimeError(
+        runtimeError(vm,
             "Operands must be two numbers or two strings.");
         return INTERPRET_RUNTIME_ERROR;
       }
       DISPATCH();
     }
 
-    CASE_CODE(SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
-    CASE_CODE(MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
-    CASE_CODE(DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+    CASE_CODE(SUBTRACT): BINARY_OP(NUMBER_VAL, -, SUBTRACT_NUMBER); DISPATCH();
+    CASE_CODE(MULTIPLY): BINARY_OP(NUMBER_VAL, *, MULTIPLY_NUMBER); DISPATCH();
+    CASE_CODE(DIVIDE):   BINARY_OP(NUMBER_VAL, /, DIVIDE_NUMBER); DISPATCH();
 
-    CASE_CODE(NOT):
-      PUSH(BOOL_VAL(isFalsey(POP())));
+    CASE_CODE(NOT): {
+      Value value = POP();
+      PUSH(BOOL_VAL(isFalsey(value)));
       DISPATCH();
+    }
 
     CASE_CODE(NEGATE):
       if (!IS_NUMBER(PEEK())) {
         STORE_FRAME();
-        runtimeError("Operand must be a number.");
+        runtimeError(vm, "Operand must be a number.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      PUSH(-AS_NUMBER(POP()));
+      vm->stackTop[-1] = NUMBER_VAL(-AS_NUMBER(PEEK()));
       DISPATCH();
 
     CASE_CODE(PRINT): {
-      printValue(POP());
+      // Printing a rope flattens it, which can collect.
+      printValue(vm, PEEK());
+      DROP();
       printf("\n");
       DISPATCH();
     }
@@ -533,123 +1207,457 @@ static InterpretResult run(void) {
     CASE_CODE(LOOP): {
       uint16_t offset = READ_SHORT();
       ip -= offset;
+      if (fn->jit == NULL) fn->hotness++;
+      SAMPLE();
+      ENTER_JIT();
       DISPATCH();
     }
 
+#if JIT
+    // The compiled code runs until it gets to something it leaves to
+    // us, which is then where we carry on. A long running loop at the
+    // top level gets replaced with compiled code this way too. Profiled
+    // runs stay in the interpreter so the samples see every loop.
+    runNative: {
+      if (vm->profiler != NULL) DISPATCH();
+      if (fn->jit == NULL && !compileJit(fn)) DISPATCH();
+      int resume = runJit(vm, frame->closure, stackStart,
+                          (int)(ip - fn->chunk.code));
+      if (resume != -1) ip = fn->chunk.code + resume;
+      DISPATCH();
+    }
+#endif
+
     CASE_CODE(CALL): {
       int argCount = READ_BYTE();
       STORE_FRAME();
 
-      if (!callValue(peek(argCount), argCount)) {
+      // Natives leave the frame alone, so there's nothing to reload and
+      // no reason to look for compiled code afterwards.
+      Value callee = vm->stackTop[-argCount - 1];
+      if (IS_NATIVE(callee)) {
+        if (!callNative(vm, AS_NATIVE(callee), argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        DISPATCH();
+      }
+
+      if (!callValue(vm, peek(vm, argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      LOAD_FRAME();
+      SAMPLE();
+      ENTER_JIT();
+      DISPATCH();
+    }
+
+    CASE_CODE(INVOKE):
+      arg = READ_BYTE();
+    invokeMethod: {
+      ObjString* method = CONSTANT_STRING(arg);
+      int argCount = READ_BYTE();
+      InlineCache* cache = READ_CACHE();
+      STORE_FRAME();
+
+      if (!invoke(vm, method, argCount, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      LOAD_FRAME();
+      SAMPLE();
+      ENTER_JIT();
+      DISPATCH();
+    }
+
+    // A call right before a return. When the call pushed a frame it
+    // takes over ours, otherwise (natives, classes without an
+    // initializer) the result is already on the stack to return.
+    CASE_CODE(TAIL_CALL): {
+      int argCount = READ_BYTE();
+      int depth = vm->frameCount;
+      STORE_FRAME();
+
+      if (!callValue(vm, peek(vm, argCount), argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
 
+      if (vm->frameCount == depth) goto returnValue;
+      collapseFrame(vm);
       LOAD_FRAME();
+      SAMPLE();
+      ENTER_JIT();
       DISPATCH();
     }
 
-    CASE_CODE(INVOKE): {
+    CASE_CODE(TAIL_INVOKE): {
       ObjString* method = READ_STRING();
       int argCount = READ_BYTE();
+      InlineCache* cache = READ_CACHE();
+      int depth = vm->frameCount;
       STORE_FRAME();
 
-      if (!invoke(method, argCount)) {
+      if (!invoke(vm, method, argCount, cache)) {
         return INTERPRET_RUNTIME_ERROR;
       }
 
+      if (vm->frameCount == depth) goto returnValue;
+      collapseFrame(vm);
       LOAD_FRAME();
+      SAMPLE();
+      ENTER_JIT();
       DISPATCH();
     }
     
-    CASE_CODE(SUPER_INVOKE): {
-      ObjString* method = READ_STRING();
+    CASE_CODE(SUPER_INVOKE):
+      arg = READ_BYTE();
+    superInvoke: {
+      ObjString* name = CONSTANT_STRING(arg);
       int argCount = READ_BYTE();
+      InlineCache* cache = READ_CACHE();
       ObjClass* superclass = AS_CLASS(POP());
       STORE_FRAME();
-      if (!invokeFromClass(superclass, method, argCount)) {
+
+      ObjClosure* method = superMethod(vm, superclass, name, cache);
+      if (method == NULL || !call(vm, method, argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
       LOAD_FRAME();
+      SAMPLE();
+      ENTER_JIT();
       DISPATCH();
     }
 
-    CASE_CODE(CLOSURE): {
-      ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-      ObjClosure* closure = newClosure(function);
+    CASE_CODE(CLOSURE):
+      arg = READ_BYTE();
+      wide = false;
+    makeClosure: {
+      ObjFunction* function =
+          AS_FUNCTION(fn->chunk.constants.values[arg]);
+      ObjClosure* closure = newClosure(vm, function,
+          hasValueCaptures(frame->closure, function, ip, wide));
       PUSH(OBJ_VAL(closure));
       for (int i = 0; i < closure->upvalueCount; i++) {
         uint8_t isLocal = READ_BYTE();
-        uint8_t index = READ_BYTE();
-        if (isLocal) {
+        uint16_t index = wide ? READ_SHORT() : READ_BYTE();
+        if (isLocal == 2) {
           closure->upvalues[i] =
-              captureUpvalue(stackStart + index);
+              captureValue(closure, i, stackStart[index]);
+        } else if (isLocal) {
+          closure->upvalues[i] =
+              captureUpvalue(vm, stackStart + index);
         } else {
-          closure->upvalues[i] = frame->closure->upvalues[index];
+          ObjUpvalue* upvalue = frame->closure->upvalues[index];
+          // Our copy lives inside our closure, so nested ones copy it
+          // again rather than pointing into it.
+          if (isValueCapture(frame->closure, upvalue)) {
+            upvalue = captureValue(closure, i, upvalue->closed);
+          }
+          closure->upvalues[i] = upvalue;
         }
+        writeBarrier(vm, (Obj*)closure);
       }
       DISPATCH();
     }
 
     CASE_CODE(CLOSE_UPVALUE):
-      closeUpvalues(vm.stackTop - 1);
+      closeUpvalues(vm, vm->stackTop - 1);
       DROP();
       DISPATCH();
 
-    CASE_CODE(RETURN): {
+    CASE_CODE(RETURN):
+    returnValue: {
       Value result = POP();
-      closeUpvalues(stackStart);
-      vm.frameCount--;
-      if (vm.frameCount == 0) {
+      closeUpvalues(vm, stackStart);
+      vm->frameCount--;
+      if (vm->frameCount == 0) {
         DROP();
         return INTERPRET_OK;
       }
 
-      vm.stackTop = stackStart;
+      vm->stackTop = stackStart;
       PUSH(result);
       LOAD_FRAME();
+      SAMPLE();
+      ENTER_JIT();
       DISPATCH();
     }
 
     CASE_CODE(CLASS):
-      PUSH(OBJ_VAL(newClass(READ_STRING())));
+      arg = READ_BYTE();
+    makeClass:
+      PUSH(OBJ_VAL(newClass(vm, CONSTANT_STRING(arg))));
       DISPATCH();
 
     CASE_CODE(INHERIT): {
       Value superclass = PEEK2();
       if (!IS_CLASS(superclass)) {
         STORE_FRAME();
-        runtimeError("Superclass must be a class.");
+        runtimeError(vm, "Superclass must be a class.");
         return INTERPRET_RUNTIME_ERROR;
       }
 
       ObjClass* subclass = AS_CLASS(PEEK());
-      tableAddAll(&AS_CLASS(superclass)->methods,
+      tableAddAll(vm, &AS_CLASS(superclass)->methods,
                   &subclass->methods);
+      subclass->initializer = AS_CLASS(superclass)->initializer;
+      writeBarrier(vm, (Obj*)subclass);
       DROP(); // Subclass.
       DISPATCH();
     }
 
     CASE_CODE(METHOD):
-      defineMethod(READ_STRING());
+      arg = READ_BYTE();
+    addMethod:
+      defineMethod(vm, CONSTANT_STRING(arg));
+      DISPATCH();
+
+    CASE_CODE(WIDE):
+      // The next instruction has a 16-bit constant or slot operand.
+      instruction = (OpCode)READ_BYTE();
+      arg = READ_SHORT();
+      wide = true;
+      switch (instruction) {
+        case OP_CONSTANT:
+          PUSH(fn->chunk.constants.values[arg]);
+          DISPATCH();
+        case OP_GET_LOCAL:
+          PUSH(stackStart[arg]);
+          DISPATCH();
+        case OP_SET_LOCAL:
+          stackStart[arg] = PEEK();
+          DISPATCH();
+        case OP_GET_PROPERTY: goto getProperty;
+        case OP_SET_PROPERTY: goto setProperty;
+        case OP_GET_SUPER:    goto getSuper;
+        case OP_INVOKE:       goto invokeMethod;
+        case OP_SUPER_INVOKE: goto superInvoke;
+        case OP_CLOSURE:      goto makeClosure;
+        case OP_CLASS:        goto makeClass;
+        case OP_METHOD:       goto addMethod;
+        default:
+          return INTERPRET_RUNTIME_ERROR; // Unreachable.
+      }
+
+    CASE_CODE(SET_LOCAL_POP): {
+      stackStart[READ_BYTE()] = POP();
+      DISPATCH();
+    }
+
+    CASE_CODE(ADD_RR): REGISTER_ADD(READ_REGISTER()); DISPATCH();
+
+    CASE_CODE(INCREMENT_LOCAL): {
+      Value* local = &stackStart[READ_BYTE()];
+      Value amount = READ_CONSTANT();
+      if (!IS_NUMBER(*local)) {
+        STORE_FRAME();
+        runtimeError(vm,
+            "Operands must be two numbers or two strings.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      *local = NUMBER_VAL(AS_NUMBER(*local) + AS_NUMBER(amount));
+      DISPATCH();
+    }
+
+    CASE_CODE(LESS_LOCAL_CONSTANT_JUMP):    COMPARE_JUMP(<); DISPATCH();
+    CASE_CODE(GREATER_LOCAL_CONSTANT_JUMP): COMPARE_JUMP(>); DISPATCH();
+
+    CASE_CODE(JUMP_IF_FALSE_POP): {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(POP())) ip += offset;
+      DISPATCH();
+    }
+
+    CASE_CODE(GET_LOCAL_PROPERTY):
+      PUSH(stackStart[READ_BYTE()]);
+      arg = READ_BYTE();
+      goto getProperty;
+
+    CASE_CODE(ADD_NUMBER):      NUMBER_OP(NUMBER_VAL, +, ADD); DISPATCH();
+    CASE_CODE(SUBTRACT_NUMBER): NUMBER_OP(NUMBER_VAL, -, SUBTRACT); DISPATCH();
+    CASE_CODE(MULTIPLY_NUMBER): NUMBER_OP(NUMBER_VAL, *, MULTIPLY); DISPATCH();
+    CASE_CODE(DIVIDE_NUMBER):   NUMBER_OP(NUMBER_VAL, /, DIVIDE); DISPATCH();
+    CASE_CODE(GREATER_NUMBER):  NUMBER_OP(BOOL_VAL, >, GREATER); DISPATCH();
+    CASE_CODE(LESS_NUMBER):     NUMBER_OP(BOOL_VAL, <, LESS); DISPATCH();
+
+    CASE_CODE(BUILD_LIST): {
+      int count = READ_BYTE();
+      Value* items = vm->stackTop - count;
+      ObjList* list = newList(vm);
+      PUSH(OBJ_VAL(list));
+      appendItems(vm, list, items, count);
+      vm->stackTop = items;
+      PUSH(OBJ_VAL(list));
+      DISPATCH();
+    }
+
+    CASE_CODE(EXTEND_LIST): {
+      int count = READ_BYTE();
+      Value* items = vm->stackTop - count;
+      appendItems(vm, AS_LIST(items[-1]), items, count);
+      vm->stackTop = items;
+      DISPATCH();
+    }
+
+    CASE_CODE(BUILD_MAP): {
+      int count = READ_BYTE();
+      Value* items = vm->stackTop - count * 2;
+      ObjMap* map = newMap(vm);
+      // The pairs stay on the stack while the table grows.
+      PUSH(OBJ_VAL(map));
+      insertPairs(vm, map, items, count);
+      vm->stackTop = items;
+      PUSH(OBJ_VAL(map));
       DISPATCH();
+    }
+
+    CASE_CODE(EXTEND_MAP): {
+      int count = READ_BYTE();
+      Value* items = vm->stackTop - count * 2;
+      insertPairs(vm, AS_MAP(items[-1]), items, count);
+      vm->stackTop = items;
+      DISPATCH();
+    }
+
+    CASE_CODE(GET_INDEX): {
+      if (!IS_LIST(PEEK2())) {
+        if (!IS_MAP(PEEK2())) {
+          STORE_FRAME();
+          runtimeError(vm, "Only lists and maps can be indexed.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        // Missing keys read as nil.
+        flattenSlot(vm, &vm->stackTop[-1]);
+        Value value;
+        if (!valueTableGet(&AS_MAP(PEEK2())->table, PEEK(), &value)) {
+          value = NIL_VAL;
+        }
+        DROP();
+        vm->stackTop[-1] = value;
+        DISPATCH();
+      }
+
+      ObjList* list = AS_LIST(PEEK2());
+      int index;
+      LIST_INDEX(list, PEEK(), index);
+      DROP();
+      vm->stackTop[-1] = list->items.values[index];
+      DISPATCH();
+    }
+
+    CASE_CODE(SET_INDEX): {
+      Value target = vm->stackTop[-3];
+      if (IS_LIST(target)) {
+        ObjList* list = AS_LIST(target);
+        int index;
+        LIST_INDEX(list, PEEK2(), index);
+        list->items.values[index] = PEEK();
+        writeBarrier(vm, (Obj*)list);
+      } else if (IS_MAP(target)) {
+        // The key and value are still on the stack if the table grows.
+        ObjMap* map = AS_MAP(target);
+        flattenSlot(vm, &vm->stackTop[-2]);
+        valueTableSet(vm, &map->table, PEEK2(), PEEK());
+        writeBarrier(vm, (Obj*)map);
+      } else {
+        STORE_FRAME();
+        runtimeError(vm, "Only lists and maps can be indexed.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      Value value = POP();
+      vm->stackTop -= 2;
+      PUSH(value);
+      DISPATCH();
+    }
+
+    CASE_CODE(ADD_STRING):
+      if (!isStringLike(PEEK()) || !isStringLike(PEEK2())) DEQUICKEN(ADD);
+      concatenate(vm);
+      DISPATCH();
+
+    CASE_CODE(ADD_RK):      REGISTER_ADD(READ_CONSTANT()); DISPATCH();
+    CASE_CODE(SUBTRACT_RR): REGISTER_OP(NUMBER_VAL, -, READ_REGISTER());
+                            DISPATCH();
+    CASE_CODE(SUBTRACT_RK): REGISTER_OP(NUMBER_VAL, -, READ_CONSTANT());
+                            DISPATCH();
+    CASE_CODE(MULTIPLY_RR): REGISTER_OP(NUMBER_VAL, *, READ_REGISTER());
+                            DISPATCH();
+    CASE_CODE(MULTIPLY_RK): REGISTER_OP(NUMBER_VAL, *, READ_CONSTANT());
+                            DISPATCH();
+    CASE_CODE(DIVIDE_RR):   REGISTER_OP(NUMBER_VAL, /, READ_REGISTER());
+                            DISPATCH();
+    CASE_CODE(DIVIDE_RK):   REGISTER_OP(NUMBER_VAL, /, READ_CONSTANT());
+                            DISPATCH();
+    CASE_CODE(LESS_RR):     REGISTER_OP(BOOL_VAL, <, READ_REGISTER());
+                            DISPATCH();
+    CASE_CODE(LESS_RK):     REGISTER_OP(BOOL_VAL, <, READ_CONSTANT());
+                            DISPATCH();
+    CASE_CODE(GREATER_RR):  REGISTER_OP(BOOL_VAL, >, READ_REGISTER());
+                            DISPATCH();
+    CASE_CODE(GREATER_RK):  REGISTER_OP(BOOL_VAL, >, READ_CONSTANT());
+                            DISPATCH();
+
+    CASE_CODE(STORE_ADD_RR):      STORE_ADD(READ_REGISTER()); DISPATCH();
+    CASE_CODE(STORE_ADD_RK):      STORE_ADD(READ_CONSTANT()); DISPATCH();
+    CASE_CODE(STORE_SUBTRACT_RR): STORE_OP(-, READ_REGISTER()); DISPATCH();
+    CASE_CODE(STORE_SUBTRACT_RK): STORE_OP(-, READ_CONSTANT()); DISPATCH();
+    CASE_CODE(STORE_MULTIPLY_RR): STORE_OP(*, READ_REGISTER()); DISPATCH();
+    CASE_CODE(STORE_MULTIPLY_RK): STORE_OP(*, READ_CONSTANT()); DISPATCH();
+    CASE_CODE(STORE_DIVIDE_RR):   STORE_OP(/, READ_REGISTER()); DISPATCH();
+    CASE_CODE(STORE_DIVIDE_RK):   STORE_OP(/, READ_CONSTANT()); DISPATCH();
+
+    CASE_CODE(MOVE): {
+      int dst = READ_BYTE();
+      stackStart[dst] = READ_REGISTER();
+      DISPATCH();
+    }
+
+    CASE_CODE(LOADK): {
+      int dst = READ_BYTE();
+      stackStart[dst] = READ_CONSTANT();
+      DISPATCH();
+    }
   }
 
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef CONSTANT_STRING
+#undef READ_CACHE
+#undef GLOBAL_NAME
 #undef BINARY_OP
+#undef COMPARE_JUMP
+#undef LIST_INDEX
+#undef QUICKEN
+#undef DEQUICKEN
+#undef NUMBER_OP
+#undef ENTER_JIT
+#undef SAMPLE
+#undef COUNT_OPCODE
+#undef READ_REGISTER
+#undef REGISTER_OP
+#undef STORE_OP
+#undef ADD_VALUES
+#undef REGISTER_ADD
+#undef STORE_ADD
 }
 
-InterpretResult interpret(const char* source) {
-  ObjFunction* function = compile(source);
+InterpretResult interpret(VM* vm, const char* source) {
+  ObjFunction* function = compile(vm, source, strlen(source));
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
-  push(OBJ_VAL(function));
-  ObjClosure* closure = newClosure(function);
-  pop();
-  push(OBJ_VAL(closure));
-  call(closure, 0);
+  return interpretFunction(vm, function);
+}
+
+InterpretResult interpretFunction(VM* vm, ObjFunction* function) {
+  push(vm, OBJ_VAL(function));
+  ObjClosure* closure = newClosure(vm, function, false);
+  pop(vm);
+  push(vm, OBJ_VAL(closure));
+  call(vm, closure, 0);
 
-  return run();
+  return run(vm);
 }
@@ -1,12 +1,76 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <signal.h>
+
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The value stack and call frames start out small and grow on demand
+// up to these limits.
+#define FRAMES_INITIAL 16
+#define FRAMES_MAX (64 * 1024)
+#define STACK_INITIAL 1024
+#define STACK_MAX (FRAMES_MAX * 64)
+
+// Every call makes sure there's room for the function's maxSlots, its
+// locals plus the temporaries the compiler counted, and this many more
+// for the few values instructions push on their own.
+#define STACK_SLACK UINT8_COUNT
+
+#define GC_SLICE_BUDGET 2000
+
+// The defaults for the heap size the first collection happens at and
+// how much the heap may grow over what survived a collection before
+// the next.
+#define GC_INITIAL_HEAP (1024 * 1024)
+#define GC_GROW_FACTOR 2.0
+
+// The adaptive policy grows the heap further when more than this
+// fraction of the time goes to major collections.
+#define GC_TARGET 0.05
+
+#define GC_MAX_THREADS 64
+
+// Slots in the bound method cache, a power of two.
+#define BOUND_CACHE_SIZE 256
+
+// Allocations of up to POOL_MAX_SIZE bytes are served from slabs split
+// into blocks of a fixed size class, one class every POOL_GRANULARITY
+// bytes. Nothing the VM allocates needs more alignment than a pointer.
+#define POOL_GRANULARITY 8
+#define POOL_COUNT 32
+#define POOL_MAX_SIZE (POOL_GRANULARITY * POOL_COUNT)
+#define SLAB_SIZE (64 * 1024)
+
+typedef struct PoolBlock {
+  struct PoolBlock* next;
+} PoolBlock;
+
+typedef struct Slab {
+  struct Slab* next;
+} Slab;
+
+typedef enum {
+  GC_PHASE_IDLE,
+  GC_PHASE_MARK,
+  GC_PHASE_SWEEP
+} GCPhase;
+
+// Collections so far, for gcStats(). Pauses are in seconds.
+typedef struct {
+  int minorCollections;
+  int majorCollections;
+  int slices;
+  double totalPause;
+  double minorPause;
+  double maxPause;
+  size_t totalAllocated;
+  size_t bytesFreed;
+  // The most bytes that were ever allocated at once.
+  size_t peakHeap;
+} GCStats;
 
 typedef struct {
   ObjClosure* closure;
@@ -14,24 +78,91 @@ typedef struct {
   Value* slots;
 } CallFrame;
 
-typedef struct {
-  CallFrame frames[FRAMES_MAX];
+struct VM {
+  CallFrame* frames;
   int frameCount;
-  
-  Value stack[STACK_MAX];
+  int frameCapacity;
+
+  Value* stack;
   Value* stackTop;
+  int stackCapacity;
   Table globals;
+  ValueArray globalValues;
+  ValueArray globalNames;
   Table strings;
   ObjString* initString;
   ObjUpvalue* openUpvalues;
+  // The compilation in progress, its functions are GC roots.
+  struct Parser* parser;
+  // Recently created bound methods, so reading the same method off the
+  // same receiver again doesn't allocate. Entries are weak, collections
+  // drop the ones that didn't survive.
+  ObjBoundMethod* boundMethods[BOUND_CACHE_SIZE];
 
   size_t bytesAllocated;
   size_t nextGC;
+  size_t youngAllocated;
+  size_t sliceAllocated;
   Obj* objects;
+  Obj* youngObjects;
+  bool markValue;
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
-} VM;
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** remembered;
+
+  PoolBlock* pools[POOL_COUNT];
+  Slab* slabs;
+
+  // Incremental collection. When enabled full collections are split
+  // into slices of at most [gcSliceBudget] objects each.
+  bool gcIncremental;
+  int gcSliceBudget;
+  GCPhase gcPhase;
+  // The last object the lazy sweep kept, NULL while it's still at the
+  // head of the list.
+  Obj* sweepPrevious;
+
+  // Heap sizing, see resizeHeap(). A [gcMaxHeap] of 0 means there's
+  // no limit and a [gcTarget] of 0 turns the adaptive policy off.
+  size_t gcInitialHeap;
+  double gcGrowFactor;
+  size_t gcMaxHeap;
+  double gcTarget;
+  double gcLastCycle;
+  GCStats gcStats;
+
+  // Full collections use this many threads, the sweep splits the old
+  // object list at [sweepBoundaries] to share it out.
+  int gcThreads;
+  struct GCWorkers* gcWorkers;
+  Obj** sweepBoundaries;
+  int sweepBoundaryCount;
+  int sweepBoundaryCapacity;
+  // The stats as they were when the last major collection finished.
+  GCStats gcLastStats;
+
+  // Set from the profiler's signal handler, the interpreter takes a
+  // sample at the next loop or call that checks it.
+  volatile sig_atomic_t sampleRequested;
+  struct Profiler* profiler;
+
+  bool reportGCStats;
+#if PROFILE_OPCODES
+  bool reportOpcodeStats;
+  uint64_t opcodeCounts[OPCODE_COUNT];
+  uint64_t opcodeTicks[OPCODE_COUNT];
+  uint64_t lastTicks;
+  uint8_t lastOpcode;
+#endif
+
+#ifdef DEBUG_STRESS_GC
+  // Stress collections alternate between young and full ones.
+  bool stressFull;
+#endif
+};
 
 typedef enum {
   INTERPRET_OK,
@@ -39,12 +170,22 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+void initVM(VM* vm);
+void freeVM(VM* vm);
+InterpretResult interpret(VM* vm, const char* source);
+InterpretResult interpretFunction(VM* vm, ObjFunction* function);
+int globalSlot(VM* vm, ObjString* name);
+
+// Defines the global [name] as a native. Calling it with anything but
+// [arity] arguments is an error unless that's NATIVE_VARIADIC, and it
+// can get at [context] with NATIVE_CONTEXT().
+void defineNative(VM* vm, const char* name, NativeFn function, int arity,
+                  void* context);
 
-void initVM(void);
-void freeVM(void);
-InterpretResult interpret(const char* source);
-void push(Value value);
-Value pop(void);
+// Reports a runtime error from a native, which then has to return what
+// this returns.
+Value nativeError(VM* vm, const char* format, ...);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
 
 #endif